@@ -32,9 +32,23 @@
 #define INTERNAL_ERROR 500
 #define NOT_SUPPORTED 501
 #define DEFAULT_PROTOCOL "HTTP/1.0"
+#define QUEUED_PER_THREAD 4 //accepted connections waiting per pool thread
+#define SHUTDOWN_DRAIN_MS 5000 //how long the queued connections get to be served at shutdown
+#define FILE_CHUNK (KILOBYTE * 10) //bytes of a file sent per write
+#define WORKER_STACK (256 * KILOBYTE) //stack of a pool thread, the big buffers aren't on it
+
+//the buffers of a request, borrowed from the worker's scratch arena
+typedef struct request_buffers_st
+{
+	char msg_received[4 * KILOBYTE];
+	char path[PATH_MAX];
+	char file_data[FILE_CHUNK];
+} request_buffers;
 
 //private functions - further information below
 int dispatch_function(void*);
+int fiber_function(void*);
+int serve_request(int, request_buffers*);
 
 //dispatch function is calling:
 /* 1. */int read_from_socket(int, char*);
@@ -43,13 +57,14 @@ int dispatch_function(void*);
 
 //and then by the code value will be called one of the following:
 void send_error_response(int, char*, char*, char*, int);
-int send_file_response(int, char*, char*, char*, int*);
+int send_file_response(int, char*, char*, char*, int*, char*);
 int send_folder_response(int, char*, char*, char*, int*);
 
 //these 3 functions mantioned above will use the following:
 char *code_to_string(int);
 char *get_mime_type(char*);
 int write_to_socket(int, char*, int);
+int would_block(void) __attribute__((noinline));
 
 //private functions for setting up the server
 int parse_args(char*[], int*, int*, int*);
@@ -60,16 +75,20 @@ int set_up_server(struct sockaddr_in*, int*, int);
 int main(int argc, char *argv[])
 {
 	//variables
-	int listen_socket, new_socket ,*client_socket, counter = 0;
+	int listen_socket, new_socket, counter = 0;
 	struct sockaddr_in my_server, client_addr;
 	socklen_t socklen = sizeof(struct sockaddr_in);
 
 	//check the number of arguments from the shell
-	if (argc != 4)
+	if (argc != 4 && (argc != 5 || strcmp(argv[4], "fibers")))
 	{
-		printf("Usage: server <port> <pool-size> <max-requests-number>\n");
+		printf("Usage: server <port> <pool-size> <max-requests-number> [fibers]\n");
 		exit(EXIT_FAILURE);
 	}
+	/* with "fibers" every connection runs on a fiber of its own that waits
+	for a slow client without holding a thread, so a few threads serve
+	far more connections at once than there are threads */
+	int use_fibers = argc == 5;
 	
 	//parse the arguments requested
 	int port, pool_size, max_requests;
@@ -79,8 +98,23 @@ int main(int argc, char *argv[])
 		exit(EXIT_FAILURE);
 	}
 	
-	//create a pool of threads
-	threadpool *pool = create_threadpool(pool_size);
+	/* create a pool of threads. the queue is bounded and dispatch blocks while
+	it's full, so the acceptor stops accepting and new clients wait in the
+	listen backlog instead of the queue growing without a limit */
+	threadpool_attr_t attr;
+	threadpool_attr_init(&attr);
+	attr.num_threads = pool_size;
+	attr.queue_capacity = pool_size * QUEUED_PER_THREAD;
+	attr.overflow = THREADPOOL_OVERFLOW_BLOCK;
+	attr.stack_size = WORKER_STACK;
+	attr.scratch_size = sizeof(request_buffers);
+	//a thread reading a slow client is stood in for, the others keep serving
+	if (!use_fibers)
+	{
+		attr.max_blocking = pool_size;
+		attr.thread_limit = pool_size * 2;
+	}
+	threadpool *pool = create_threadpool_attr(&attr);
 	if (!pool) //caused by memory, mutex, condition variables or threads initialtion failure
 	{
 		perror("pool");
@@ -104,33 +138,52 @@ int main(int argc, char *argv[])
 		if (new_socket < 0) //don't shutdown over one unsuccessful socket
 			perror("opening new socket\n");
 		else
-		{	//let the threads know that there is a new request
-			client_socket = (int*)calloc(1, sizeof(int));
-			if (!client_socket)
-				perror("allocating memory");
+		{	/* let the threads know that there is a new request, the socket
+			is copied into the job so nothing is allocated for it */
+			//a fiber's socket doesn't block, it waits in threadpool_wait_fd
+			if (use_fibers)
+				fcntl(new_socket, F_SETFL, fcntl(new_socket, F_GETFL) | O_NONBLOCK);
+			if ((use_fibers? dispatch_fiber(pool, fiber_function, (void*)(long)new_socket)
+				: dispatch_copy(pool, dispatch_function, &new_socket, sizeof(new_socket))) < 0)
+				close(new_socket);
 			else
-			{
-				*client_socket = new_socket;
-				dispatch(pool, dispatch_function, (void*)client_socket);
 				counter++;
-			}
 		}
 	}
-	//shutting down
+	//shutting down, connections still queued after the drain are closed unserved
 	close(listen_socket);
-	destroy_threadpool(pool);
+	work_t *pending = NULL;
+	int i, dropped = destroy_threadpool_drain(pool, SHUTDOWN_DRAIN_MS, &pending);
+	for (i = 0; pending && i < dropped; i++)
+		close(pending[i].routine == fiber_function? (int)(long)pending[i].arg : *((int*)(pending[i].arg)));
+	free(pending);
 	return SUCCESS; 
 }
 
 //the function of the threads
 int dispatch_function(void *arg)
+{
+	int socket_fd = *((int*)(arg)), result; //casting before going to work
+	//the worker's arena is reused without zeroing, a fiber has none and allocates
+	request_buffers *buffers = (request_buffers*)threadpool_scratch(sizeof(request_buffers)), *owned = NULL;
+	if (!buffers && !(buffers = owned = (request_buffers*)malloc(sizeof(request_buffers))))
+	{
+		perror("malloc");
+		close(socket_fd);
+		return FAILURE;
+	}
+	result = serve_request(socket_fd, buffers);
+	free(owned);
+	return result;
+}
+
+//serve the request of a connection and close it
+int serve_request(int socket_fd, request_buffers *buffers)
 {
 	//variables
-	int socket_fd = *((int*)(arg)), //casting before going to work
-		code = 0; //the code, will function like errno
-	free(arg);
-	char msg_received[4 * KILOBYTE] = { 0 },
-		path[PATH_MAX] = { 0 }, protocol[9] = { DEFAULT_PROTOCOL },
+	int code = 0; //the code, will function like errno
+	char *msg_received = buffers->msg_received,
+		*path = buffers->path, protocol[9] = { DEFAULT_PROTOCOL },
 		tb_now[32] = { 0 },
 		*header_check = NULL;
 	time_t now;
@@ -140,6 +193,8 @@ int dispatch_function(void *arg)
 	the variable "code" will be set appropriately for further use */
 	
 	//set up the current time
+	msg_received[0] = '\0';
+	path[0] = '\0';
 	now = time(NULL);
 	strftime(tb_now, sizeof(tb_now), RFC1123FMT, gmtime(&now));
 	
@@ -187,7 +242,7 @@ int dispatch_function(void *arg)
 	//send the response according to the code
 	if (code == OK_FILE)
 	{	//send the file information
-		if(send_file_response(socket_fd, path, protocol, tb_now, &code) < 0)
+		if(send_file_response(socket_fd, path, protocol, tb_now, &code, buffers->file_data) < 0)
 		{
 			//if a perror accoured we don't want 
 			if (code != WRITE_ERROR)
@@ -211,6 +266,13 @@ int dispatch_function(void *arg)
 	return SUCCESS;
 }
 
+//the function of the fibers, the socket comes in the pointer itself
+int fiber_function(void *arg)
+{
+	int socket_fd = (int)(long)arg;
+	return dispatch_function(&socket_fd);
+}
+
 //this function will read from a socket
 int read_from_socket(int socket_fd, char *msg_received)
 {
@@ -218,7 +280,16 @@ int read_from_socket(int socket_fd, char *msg_received)
 	char temp_data[KILOBYTE * 2] = { 0 };
 	while (1)
 	{
+		threadpool_blocking_begin();
 		bytes_read = read(socket_fd, temp_data, sizeof(temp_data));
+		threadpool_blocking_end();
+		//a fiber's socket has nothing yet, the fiber waits without its thread
+		if (bytes_read < 0 && would_block())
+		{
+			if (threadpool_wait_fd(socket_fd, THREADPOOL_WAIT_READ) < 0)
+				return FAILURE;
+			continue;
+		}
 		if (bytes_read < 0)
 			return FAILURE;
 		else if (bytes_read > 0)
@@ -289,6 +360,7 @@ int parse_header(char *http_request, char *path, char *protocol, int *code)
 	}
 	//copy the path into the allocated space
 	strncpy(path, http_request, n);
+	path[n] = '\0';
 	
 	char path_buff[PATH_MAX] = { 0 };
 	//if the request arrived from a webpage, look for %20
@@ -438,13 +510,13 @@ void send_error_response(int socket_fd, char *path, char *protocol, char *tb_now
 }
 
 //send response with a file as a content
-int send_file_response(int socket_fd, char *path, char *protocol, char *tb_now, int *code)
+int send_file_response(int socket_fd, char *path, char *protocol, char *tb_now, int *code, char *file_data)
 {	
 	//variables
 	struct stat file_info = { 0 };
 	struct dirent *file_entity = NULL;
 	DIR *folder = NULL;
-	char response[KILOBYTE] = { 0 }, file_data[KILOBYTE * 10] = { 0 },
+	char response[KILOBYTE] = { 0 },
 		time_buff_lm[32] = { 0 }, *file_name = NULL;
 	int file_fd, bytes_read, i;
 		
@@ -531,7 +603,7 @@ int send_file_response(int socket_fd, char *path, char *protocol, char *tb_now,
 	while (1)
 	{
 		//bytes_read - the size that was read
-		bytes_read = read(file_fd, file_data, sizeof(file_data));
+		bytes_read = read(file_fd, file_data, FILE_CHUNK);
 		if (bytes_read == 0) //no more to read
 		{
 			break;
@@ -714,7 +786,16 @@ int write_to_socket(int socket_fd, char *msg_to_send, int bytes_to_write)
 	char *yet_to_send = msg_to_send;
 	while (bytes_to_write > 0)
 	{
+		threadpool_blocking_begin();
 		bytes_written = write(socket_fd, yet_to_send, bytes_to_write);
+		threadpool_blocking_end();
+		//a fiber's socket is full, the fiber waits without its thread
+		if (bytes_written < 0 && would_block())
+		{
+			if (threadpool_wait_fd(socket_fd, THREADPOOL_WAIT_WRITE) < 0)
+				return FAILURE;
+			continue;
+		}
 		if (bytes_written < 0) 
 			return FAILURE;
 			
@@ -847,4 +928,10 @@ char *code_to_string(int code)
 		return "501 Not supported";
 }
 
-
+/* the last socket call of this thread found nothing to read or no room.
+not inlined: the compiler may keep the address of errno (thread local) for
+a whole function, and a fiber moves to another thread across a wait */
+int would_block(void)
+{
+	return errno == EAGAIN || errno == EWOULDBLOCK;
+}
@@ -1,27 +1,476 @@
+/* ===== threadpool regression suite ===== */
+/* ============== tester.c =============== */
+/* ======================================= */
+
+/* measures every scheduling mode and prints one CSV row per result:
+	mode,test,workers,producers,metric,value
+run "tester [jobs] [mode ...]" (modes: fifo stealing ring priority sharded,
+default all of them) and diff the rows of two releases to catch regressions.
+the tests:
+	throughput - empty jobs per second, one producer, a worker per cpu
+	latency_idle - dispatch to start of a job dispatched to idle workers
+	latency_loaded - dispatch to start of every job of a throughput run
+	producers - empty jobs per second from 1 to MAX_PRODUCERS producers
+	workers - empty jobs per second from 1 to MAXT_IN_POOL workers
+	mixed - every MIXED_EVERY-th job spins for LONG_JOB_NS, the latency of
+		the jobs queued behind the long ones and the jobs per second
+	batch - empty jobs per second entered BATCH_CHUNK at a time with
+		dispatch_batch, workers taking BATCH_DEQUEUE per lock trip. it and
+		throughput report the qlock acquisitions per 1000 jobs too
+	latency_idle_spin - latency_idle with workers spinning IDLE_SPIN checks
+		before they park
+	parallel_for - elements per second of threadpool_parallel_for, a job
+		per element is the throughput test
+	arg_malloc, arg_copy - jobs per second with a 16 byte argument malloc'ed
+		by the producer and freed by the job, or copied by dispatch_copy
+	traced - throughput while threadpool_trace_start records
+	flood, flood_groups - latency of short jobs entered one at a time behind
+		FLOOD_JOBS jobs of FLOOD_JOB_NS per worker, in the same queue or in a
+		group of weight 4 next to the flood's group of weight 1 */
+
 #include <stdio.h>
-#include <unistd.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sched.h>
+#include <time.h>
+#include <unistd.h>
+#include <stdatomic.h>
+#include <pthread.h>
 #include "threadpool.h"
 
-int dispatch_function(void *arg);
+//macros
+#define DEFAULT_JOBS 100000 //jobs per run
+#define IDLE_JOBS 1000 //jobs of the idle latency test
+#define IDLE_GAP_US 50 //pause between them, the workers go idle
+#define MAX_PRODUCERS 8
+#define MIXED_EVERY 50 //one long job in this many
+#define LONG_JOB_NS 100000 //100 us
+#define BATCH_CHUNK 64 //jobs per dispatch_batch call
+#define BATCH_DEQUEUE 16 //jobs a worker takes per lock trip in the batch test
+#define IDLE_SPIN 20000 //idle checks of the workers in latency_idle_spin
+#define PARALLEL_GRAIN 1024
+#define FLOOD_JOBS 500 //long jobs per worker in the flood tests
+#define FLOOD_JOB_NS 500000 //500 us
+#define SHORT_JOBS 200 //short jobs entered behind the flood, SHORT_GAP_US apart
+#define SHORT_GAP_US 1000
+
+//the argument of the timed jobs, copied into the job by dispatch_copy
+typedef struct stamp_st
+{
+	long long dispatched; //threadpool_now_ns
+	long index; //slot in latency
+	long long spin_ns; //how long the job runs
+} stamp_t;
+
+//a thread dispatching jobs [begin, end)
+typedef struct producer_st
+{
+	threadpool *pool;
+	long begin, end;
+	int timed; //dispatch_copy a stamp_t, else an empty job
+} producer_t;
+
+//the modes by name
+static const struct { const char *name; threadpool_sched_t sched; } modes[] =
+{
+	{ "fifo", THREADPOOL_SCHED_FIFO },
+	{ "stealing", THREADPOOL_SCHED_WORK_STEALING },
+	{ "ring", THREADPOOL_SCHED_RING },
+	{ "priority", THREADPOOL_SCHED_PRIORITY },
+	{ "sharded", THREADPOOL_SCHED_SHARDED }
+};
+#define NUM_MODES (int)(sizeof(modes) / sizeof(modes[0]))
+
+static atomic_long done;
+static long long *latency; //ns per job of the timed runs
+
+//declarations
+int empty_job(void *arg);
+int timed_job(void *arg);
+int heap_arg_job(void *arg);
+int spin_job(void *arg);
+int range_job(long begin, long end, void *ctx);
+void* producer(void *arg);
+threadpool* start_pool(threadpool_sched_t sched, int workers, int batch_size, int idle_spin);
+double run_jobs(threadpool *pool, int producers, long jobs, int timed, int mixed);
+double run_batch(threadpool *pool, long jobs);
+double run_args(threadpool *pool, long jobs, int copy);
+void idle_latency(threadpool *pool);
+void flood_latency(threadpool_sched_t sched, int workers, int groups);
+double qlocks_per_1k(threadpool *pool, long before, long jobs);
+void report(const char *mode, const char *test, int workers, int producers, const char *metric, double value);
+void report_latency(const char *mode, const char *test, int workers, long jobs);
+int by_value(const void *a, const void *b);
+void run_mode(const char *mode, threadpool_sched_t sched, int cpus, long jobs);
 
 int main(int argc, char *argv[])
 {
-	threadpool *t = create_threadpool(10);
-	int i, k;
-	for(i = 1; i <= 20; i++)
+	long jobs = DEFAULT_JOBS;
+	int cpus = (int)sysconf(_SC_NPROCESSORS_ONLN), selected = 0, i, m;
+	if (cpus < 1)
+		cpus = 1;
+	//the jobs and the modes from the arguments
+	for (i = 1; i < argc; i++)
 	{
-		k = i;
-		dispatch(t, dispatch_function, (void*)k);
+		if (atol(argv[i]) > 0)
+			jobs = atol(argv[i]);
+		else
+		{
+			for (m = 0; m < NUM_MODES && strcmp(argv[i], modes[m].name); m++)
+				;
+			if (m == NUM_MODES)
+			{
+				printf("Usage: tester [jobs] [fifo|stealing|ring|priority|sharded ...]\n");
+				return EXIT_FAILURE;
+			}
+			selected |= 1 << m;
+		}
 	}
-	destroy_threadpool(t);
-	printf("DONE\n");
-	return 1;
+	latency = (long long*)malloc((jobs > IDLE_JOBS? jobs : IDLE_JOBS) * sizeof(long long));
+	if (!latency)
+	{
+		perror("malloc");
+		return EXIT_FAILURE;
+	}
+
+	printf("mode,test,workers,producers,metric,value\n");
+	for (m = 0; m < NUM_MODES; m++)
+		if (!selected || selected & (1 << m))
+			run_mode(modes[m].name, modes[m].sched, cpus, jobs);
+	free(latency);
+	return EXIT_SUCCESS;
+}
+
+//an empty job, only counts itself
+int empty_job(void *arg)
+{
+	(void)arg;
+	atomic_fetch_add_explicit(&done, 1, memory_order_relaxed);
+	return 0;
+}
+
+//records the time since its dispatch and spins for as long as it was told
+int timed_job(void *arg)
+{
+	stamp_t *stamp = (stamp_t*)arg;
+	long long now = threadpool_now_ns();
+	latency[stamp->index] = now - stamp->dispatched;
+	while (stamp->spin_ns && threadpool_now_ns() - now < stamp->spin_ns)
+		;
+	atomic_fetch_add_explicit(&done, 1, memory_order_relaxed);
+	return 0;
+}
+
+//the job of arg_malloc, frees the argument its producer allocated
+int heap_arg_job(void *arg)
+{
+	free(arg);
+	atomic_fetch_add_explicit(&done, 1, memory_order_relaxed);
+	return 0;
 }
 
-int dispatch_function(void *arg)
+//a job of the flood, spins for FLOOD_JOB_NS
+int spin_job(void *arg)
 {
-	sleep(1);
-	printf("-- test number: %d --\n", (int)(arg));
+	long long start = threadpool_now_ns();
+	(void)arg;
+	while (threadpool_now_ns() - start < FLOOD_JOB_NS)
+		;
 	return 0;
 }
+
+//the body of the parallel_for test, the work of a job per element over a range
+int range_job(long begin, long end, void *ctx)
+{
+	long *items = (long*)ctx, i;
+	for (i = begin; i < end; i++)
+		items[i] = items[i] * 3 + 1;
+	return 0;
+}
+
+//dispatches its range of jobs, mixed in a long one every MIXED_EVERY if asked
+void* producer(void *arg)
+{
+	producer_t *p = (producer_t*)arg;
+	stamp_t stamp = { 0, 0, 0 };
+	long i;
+	for (i = p->begin; i < p->end; i++)
+	{
+		if (!p->timed)
+		{
+			dispatch(p->pool, empty_job, NULL);
+			continue;
+		}
+		stamp.index = i;
+		stamp.spin_ns = p->timed > 1 && i % MIXED_EVERY == 0? LONG_JOB_NS : 0;
+		stamp.dispatched = threadpool_now_ns();
+		dispatch_copy(p->pool, timed_job, &stamp, sizeof(stamp));
+	}
+	return NULL;
+}
+
+/* a pool of "workers" threads in mode "sched", 0 for batch_size and
+idle_spin keeps the defaults. exits on failure */
+threadpool* start_pool(threadpool_sched_t sched, int workers, int batch_size, int idle_spin)
+{
+	threadpool_attr_t attr;
+	threadpool_attr_init(&attr);
+	attr.num_threads = workers;
+	attr.sched = sched;
+	if (batch_size)
+		attr.batch_size = batch_size;
+	if (idle_spin)
+		attr.idle_spin = idle_spin;
+	threadpool *pool = create_threadpool_attr(&attr);
+	if (!pool)
+	{
+		perror("pool");
+		exit(EXIT_FAILURE);
+	}
+	return pool;
+}
+
+/* "producers" threads dispatch "jobs" jobs together, empty or timed (and
+mixed), returns the seconds until the last one ran */
+double run_jobs(threadpool *pool, int producers, long jobs, int timed, int mixed)
+{
+	pthread_t threads[MAX_PRODUCERS];
+	producer_t args[MAX_PRODUCERS];
+	struct timespec start, end;
+	int i;
+	done = 0;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < producers; i++)
+	{
+		args[i].pool = pool;
+		args[i].begin = jobs * i / producers;
+		args[i].end = jobs * (i + 1) / producers;
+		args[i].timed = timed? 1 + mixed : 0;
+		if (pthread_create(&threads[i], NULL, producer, &args[i]))
+		{
+			perror("producer");
+			exit(EXIT_FAILURE);
+		}
+	}
+	for (i = 0; i < producers; i++)
+		pthread_join(threads[i], NULL);
+	while (done < jobs)
+		sched_yield();
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	return (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+}
+
+//"jobs" empty jobs BATCH_CHUNK at a time, returns the seconds until the last one ran
+double run_batch(threadpool *pool, long jobs)
+{
+	dispatch_fn fns[BATCH_CHUNK];
+	void *args[BATCH_CHUNK];
+	struct timespec start, end;
+	long i;
+	for (i = 0; i < BATCH_CHUNK; i++)
+	{
+		fns[i] = empty_job;
+		args[i] = NULL;
+	}
+	done = 0;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < jobs; i += BATCH_CHUNK)
+		dispatch_batch(pool, fns, args, jobs - i < BATCH_CHUNK? (int)(jobs - i) : BATCH_CHUNK);
+	while (done < jobs)
+		sched_yield();
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	return (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+}
+
+/* "jobs" jobs with a 16 byte argument, copied into the job or malloc'ed
+here and freed by the job. returns the seconds until the last one ran */
+double run_args(threadpool *pool, long jobs, int copy)
+{
+	long payload[2] = { 0, 0 };
+	struct timespec start, end;
+	long i;
+	done = 0;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for (i = 0; i < jobs; i++)
+	{
+		payload[0] = i;
+		if (copy)
+			dispatch_copy(pool, empty_job, payload, sizeof(payload));
+		else
+		{
+			long *arg = (long*)malloc(sizeof(payload));
+			if (!arg)
+			{
+				perror("malloc");
+				exit(EXIT_FAILURE);
+			}
+			arg[0] = payload[0];
+			arg[1] = payload[1];
+			dispatch(pool, heap_arg_job, arg);
+		}
+	}
+	while (done < jobs)
+		sched_yield();
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	return (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+}
+
+//IDLE_JOBS jobs one at a time into "latency", every one wakes a worker
+void idle_latency(threadpool *pool)
+{
+	stamp_t stamp = { 0, 0, 0 };
+	long i;
+	for (i = 0; i < IDLE_JOBS; i++)
+	{
+		done = 0;
+		stamp.index = i;
+		stamp.dispatched = threadpool_now_ns();
+		dispatch_copy(pool, timed_job, &stamp, sizeof(stamp));
+		while (!done)
+			sched_yield();
+		usleep(IDLE_GAP_US);
+	}
+}
+
+/* FLOOD_JOBS long jobs per worker, then SHORT_JOBS short ones into "latency"
+behind them, all dispatched to the pool or to groups of weight 1 and 4 */
+void flood_latency(threadpool_sched_t sched, int workers, int groups)
+{
+	stamp_t stamps[SHORT_JOBS];
+	threadpool *pool = start_pool(sched, workers, 0, 0);
+	threadpool_group_t *bulk = threadpool_group_create(pool, "bulk", 1, 0);
+	threadpool_group_t *interactive = threadpool_group_create(pool, "interactive", 4, 0);
+	long i;
+	if (!bulk || !interactive)
+	{
+		perror("group");
+		exit(EXIT_FAILURE);
+	}
+	done = 0;
+	for (i = 0; i < FLOOD_JOBS * workers; i++)
+		if (groups)
+			dispatch_group(bulk, spin_job, NULL);
+		else
+			dispatch(pool, spin_job, NULL);
+	for (i = 0; i < SHORT_JOBS; i++)
+	{
+		stamps[i].index = i;
+		stamps[i].spin_ns = 0;
+		stamps[i].dispatched = threadpool_now_ns();
+		if (groups)
+			dispatch_group(interactive, timed_job, &stamps[i]);
+		else
+			dispatch(pool, timed_job, &stamps[i]);
+		usleep(SHORT_GAP_US);
+	}
+	while (done < SHORT_JOBS)
+		sched_yield();
+	destroy_threadpool_now(pool, NULL); //the rest of the flood isn't measured
+}
+
+//the qlock acquisitions per 1000 jobs since the count was "before"
+double qlocks_per_1k(threadpool *pool, long before, long jobs)
+{
+	threadpool_stats_t stats;
+	threadpool_get_stats(pool, &stats);
+	return (stats.qlock_acquisitions - before) * 1000.0 / jobs;
+}
+
+//a row of the results
+void report(const char *mode, const char *test, int workers, int producers, const char *metric, double value)
+{
+	printf("%s,%s,%d,%d,%s,%.1f\n", mode, test, workers, producers, metric, value);
+	fflush(stdout);
+}
+
+//the percentiles of the first "jobs" latencies, in ns
+void report_latency(const char *mode, const char *test, int workers, long jobs)
+{
+	qsort(latency, jobs, sizeof(long long), by_value);
+	report(mode, test, workers, 1, "p50_ns", latency[jobs / 2]);
+	report(mode, test, workers, 1, "p90_ns", latency[jobs * 90 / 100]);
+	report(mode, test, workers, 1, "p99_ns", latency[jobs * 99 / 100]);
+	report(mode, test, workers, 1, "p999_ns", latency[jobs * 999 / 1000]);
+	report(mode, test, workers, 1, "max_ns", latency[jobs - 1]);
+}
+
+//for qsort
+int by_value(const void *a, const void *b)
+{
+	long long x = *(const long long*)a, y = *(const long long*)b;
+	return (x > y) - (x < y);
+}
+
+//all the tests of a mode, "cpus" workers where the count is fixed
+void run_mode(const char *mode, threadpool_sched_t sched, int cpus, long jobs)
+{
+	threadpool_stats_t stats;
+	threadpool *pool;
+	int n;
+	long *items;
+
+	pool = start_pool(sched, cpus, 0, 0);
+	threadpool_get_stats(pool, &stats);
+	report(mode, "throughput", cpus, 1, "jobs_per_sec", jobs / run_jobs(pool, 1, jobs, 0, 0));
+	report(mode, "throughput", cpus, 1, "qlocks_per_1k_jobs", qlocks_per_1k(pool, stats.qlock_acquisitions, jobs));
+
+	idle_latency(pool);
+	report_latency(mode, "latency_idle", cpus, IDLE_JOBS);
+
+	run_jobs(pool, 1, jobs, 1, 0);
+	report_latency(mode, "latency_loaded", cpus, jobs);
+
+	for (n = 1; n <= MAX_PRODUCERS; n *= 2)
+		report(mode, "producers", cpus, n, "jobs_per_sec", jobs / run_jobs(pool, n, jobs, 0, 0));
+
+	double elapsed = run_jobs(pool, 1, jobs, 1, 1);
+	report(mode, "mixed", cpus, 1, "jobs_per_sec", jobs / elapsed);
+	report_latency(mode, "mixed", cpus, jobs);
+
+	items = (long*)calloc(jobs, sizeof(long));
+	if (!items)
+	{
+		perror("malloc");
+		exit(EXIT_FAILURE);
+	}
+	struct timespec start, end;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	threadpool_parallel_for(pool, 0, jobs, PARALLEL_GRAIN, range_job, items);
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	report(mode, "parallel_for", cpus, 1, "items_per_sec",
+		jobs / ((end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9));
+	free(items);
+
+	report(mode, "arg_malloc", cpus, 1, "jobs_per_sec", jobs / run_args(pool, jobs, 0));
+	report(mode, "arg_copy", cpus, 1, "jobs_per_sec", jobs / run_args(pool, jobs, 1));
+
+	threadpool_trace_start(pool, 0);
+	report(mode, "traced", cpus, 1, "jobs_per_sec", jobs / run_jobs(pool, 1, jobs, 0, 0));
+	threadpool_trace_stop(pool);
+	destroy_threadpool(pool);
+
+	//both sides batched
+	pool = start_pool(sched, cpus, BATCH_DEQUEUE, 0);
+	threadpool_get_stats(pool, &stats);
+	report(mode, "batch", cpus, 1, "jobs_per_sec", jobs / run_batch(pool, jobs));
+	report(mode, "batch", cpus, 1, "qlocks_per_1k_jobs", qlocks_per_1k(pool, stats.qlock_acquisitions, jobs));
+	destroy_threadpool(pool);
+
+	pool = start_pool(sched, cpus, 0, IDLE_SPIN);
+	idle_latency(pool);
+	report_latency(mode, "latency_idle_spin", cpus, IDLE_JOBS);
+	destroy_threadpool(pool);
+
+	flood_latency(sched, cpus, 0);
+	report_latency(mode, "flood", cpus, SHORT_JOBS);
+	flood_latency(sched, cpus, 1);
+	report_latency(mode, "flood_groups", cpus, SHORT_JOBS);
+
+	//a pool per size, up to the cap
+	for (n = 1; n <= MAXT_IN_POOL; n = n * 2 > MAXT_IN_POOL && n < MAXT_IN_POOL? MAXT_IN_POOL : n * 2)
+	{
+		pool = start_pool(sched, n, 0, 0);
+		report(mode, "workers", n, 1, "jobs_per_sec", jobs / run_jobs(pool, 1, jobs, 0, 0));
+		destroy_threadpool(pool);
+	}
+}
@@ -2,24 +2,784 @@
 /* ============ threadpool.c =========== */
 /* ===================================== */
 
+#define _GNU_SOURCE //cpu sets, sched_getcpu
 #include <stdio.h>
 #include <stdlib.h>
+#include <stddef.h>
+#include <string.h>
+#include <limits.h>
+#include <time.h>
+#include <unistd.h>
 #include <pthread.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <poll.h>
+#include <ucontext.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+#include <linux/futex.h>
+#include <linux/mempolicy.h>
 #include "threadpool.h"
 
 //macros
 #define ACCEPT 0
 #define DONT_ACCEPT 1
+#define CACHE_LINE 64
+#define DEQUE_INITIAL_SIZE 256 //must be a power of two
+#define INJECTION_BATCH 32 //max jobs moved from the injection queue to a deque at once
+#define RING_DEFAULT_CAPACITY 1024 //ring slots when the attr leaves queue_capacity 0
+#define SLAB_DEFAULT_CHUNK 256 //work_t nodes per slab chunk when the attr leaves slab_chunk 0
+#define SLAB_CACHE_MAX 64 //nodes a worker keeps in its own cache before returning them
+#define SLAB_REFILL 32 //nodes a cache takes from the shared free list at once
+#define PRODUCER_CACHES 8 //work_t caches of a thread outside the pool, one per NUMA sub-pool it feeds
+#define WORK_FROM_HEAP 1 //work_t flag - the node was calloc'ed because the slab could not grow
+#define WORK_INLINE 2 //work_t flag - the routine gets the payload, not arg (dispatch_copy)
+#define WORK_ARG(work) ((work)->flags & WORK_INLINE? (void*)(work)->payload : (work)->arg)
+#define WORK_BLOCKING 4 //work_t flag - the job runs in a blocking region (dispatch_blocking)
+#define WORK_RELAY 8 //work_t flag - the job runs other jobs through run_work (strand_run, group_run), only they are counted
+#define WORK_CARRIED (WORK_INLINE | WORK_BLOCKING | WORK_RELAY) //the flags a node copies from its job
+#define SCRATCH_ALIGN _Alignof(max_align_t) //of what threadpool_scratch lends
+#define MAY_GROW(pool) ((pool)->max_threads > (pool)->min_threads || (pool)->blocked)
+#define WORK_NUMA_SHIFT 8 //work_t flags above this bit - the NUMA sub-pool whose slab owns the node, plus one
+#define WORK_NUMA(work) ((int)((work)->flags >> WORK_NUMA_SHIFT) - 1)
+#define SPAWN_DEFAULT_DEPTH 16 //queued jobs with no idle worker that make an elastic pool spawn
+#define SPAWN_DEFAULT_WAIT_MS 10 //or how long they waited
+#define KEEP_ALIVE_DEFAULT_MS 10000 //idle time after which an elastic pool retires a thread
+//states of a worker slot, guarded by qlock
+#define WORKER_UNUSED 0
+#define WORKER_RUNNING 1
+#define WORKER_EXITED 2 //the thread retired and has to be joined
+#if defined(__x86_64__) || defined(__i386__)
+#define CPU_RELAX() __builtin_ia32_pause() //a spinning worker lets its hyperthread sibling run
+#elif defined(__aarch64__)
+#define CPU_RELAX() __asm__ __volatile__("yield")
+#else
+#define CPU_RELAX() ((void)0)
+#endif
+#define HIST_SUB_BITS 3 //a histogram has 2^HIST_SUB_BITS buckets per power of two
+#define PRIO_DEFAULT_AGING_MS 100 //a waiting priority class moves up a class per this many ms
+#define PRIO_HEAP_INITIAL 64 //initial capacity of a priority class heap
+#define HANDLE_CHUNK 64 //completion handles allocated at once
+#define HANDLE_SPIN 100 //checks of a handle before a waiter goes to sleep
+//states of a completion handle
+#define HANDLE_PENDING 0
+#define HANDLE_WAITED 1 //pending and somebody sleeps on it, the worker has to wake them
+#define HANDLE_DONE 2
+#define GRAPH_CHUNK 64 //tasks of a graph allocated at once
+#define GRAPH_SUCC_INITIAL 4 //initial capacity of a task's list of successors
+//the timer wheel: 2^WHEEL_ROOT_BITS slots of a tick, then levels of 2^WHEEL_BITS slots each that many times coarser
+#define WHEEL_TICK_NS 1000000 //1 ms
+#define WHEEL_ROOT_BITS 8
+#define WHEEL_BITS 6
+#define WHEEL_LEVELS 4 //above the root, up to 2^32 ticks ahead
+#define WHEEL_ROOT_MASK ((1 << WHEEL_ROOT_BITS) - 1)
+#define WHEEL_MASK ((1 << WHEEL_BITS) - 1)
+#define WHEEL_SHIFT(level) (WHEEL_ROOT_BITS + (level) * WHEEL_BITS)
+#define TIMER_CHUNK 256 //timers allocated at once
+#define STRAND_BUCKETS 256 //buckets of the keys of dispatch_keyed, a power of two
+#define STRAND_CHUNK 64 //strand entries allocated at once
+#define STRAND_BATCH 16 //jobs of a key run before its job is queued again
+#define GROUP_QUANTUM_NS 100000 //run time a group of weight 1 may start per round
+#define GROUP_FIRST_COST_NS 10000 //the charge of a job before its group's first one ended
+#define FIBER_DEFAULT_STACK (256 * 1024) //stack of a fiber when the attr leaves fiber_stack_size 0
+#define FIBER_CACHE_MAX 64 //ended fibers kept with their stacks for the next dispatch_fiber
+#define REACTOR_EVENTS 64 //ready fds the reactor takes per epoll_wait
+#define TRACE_DEFAULT_EVENTS 65536 //events of a thread's trace ring when threadpool_trace_start gets 0
+//the events of a job in a trace
+#define TRACE_ENQUEUE 0
+#define TRACE_DEQUEUE 1
+#define TRACE_START 2
+#define TRACE_END 3
+#ifndef THREADPOOL_NO_TRACE
+//record a trace event of a job, only a relaxed load while tracing is off
+#define TRACE(pool, kind, work) do { \
+	if (atomic_load_explicit(&((pool)->tracing), memory_order_relaxed)) \
+		trace_record((pool), (kind), (work)); \
+} while (0)
+#else
+#define TRACE(pool, kind, work) ((void)0)
+#endif
+//what a producer does about a full queue, see overflow_action
+#define OVERFLOW_REJECT -1
+#define OVERFLOW_WAIT 0
+#define OVERFLOW_RUN 1
+#define OVERFLOW_DISCARD 2
+
+/* the ring of a Chase-Lev deque. only the owner grows it, the old rings
+are kept on the "prev" list because a thief may still be reading them,
+they are freed when the pool is destroyed */
+typedef struct deque_ring_st {
+	long size; //power of two
+	struct deque_ring_st *prev;
+	_Atomic(work_t*) buf[];
+} deque_ring;
+
+//a chunk of work_t nodes, the slab grows by one chunk at a time
+typedef struct slab_chunk_st {
+	struct slab_chunk_st *next;
+	work_t nodes[];
+} slab_chunk;
+
+/* the work_t allocator of a pool. nodes freed by any thread are pushed on
+the lock free "returned" stack, allocators take the whole stack at once
+with an exchange (so there's no ABA) into their own cache. the free list
+and the chunks are only touched under "lock", when the caches run dry */
+typedef struct threadpool_slab_st {
+	_Alignas(CACHE_LINE) _Atomic(work_t*) returned;
+	_Alignas(CACHE_LINE) pthread_mutex_t lock;
+	work_t *free_list;
+	slab_chunk *chunks;
+	int chunk_nodes;
+	int node; //the NUMA node its chunks are bound to, -1 for none
+	unsigned int home; //the WORK_NUMA bits of its nodes
+	unsigned int id; //tells the caches of threads outside the pool which pool they hold nodes of
+	struct threadpool_slab_st *next_live; //in live_slabs
+	atomic_long hits; //allocations served by the slab
+	atomic_long fallbacks; //allocations that had to use calloc
+	atomic_long chunks_allocated;
+} threadpool_slab;
+
+//a queue of the sharded mode
+typedef struct threadpool_shard_st {
+	_Alignas(CACHE_LINE) pthread_mutex_t lock; //guards head and tail
+	work_t *head;
+	work_t *tail;
+	atomic_int size;
+} queue_shard;
+
+/* a NUMA sub-pool (work stealing mode with attr->numa): the injection
+queue of jobs dispatched to the node and a slab in the node's memory */
+typedef struct threadpool_numa_st {
+	_Alignas(CACHE_LINE) pthread_mutex_t lock; //guards head and tail
+	work_t *head;
+	work_t *tail;
+	atomic_int size;
+	threadpool_slab *slab;
+	int id; //the system's number of the node
+	cpu_set_t cpus; //where its workers without a cpu of their own run
+} threadpool_numa;
+
+//a cpu the workers may run on, see place_workers
+typedef struct cpu_place_st {
+	int cpu;
+	int node; //the system's NUMA node of the cpu
+	int core; //the first hyperthread of its core
+	int rank; //its position among the hyperthreads of the core
+	int core_rank; //the core's position among the cores of the node
+} cpu_place;
+
+/* the jobs of a priority class, a binary heap ordered by deadline (jobs
+without one last) and then by arrival. "last_served" is when a job of the
+class was last taken, or when the class became non empty, for the aging */
+typedef struct prio_heap_st {
+	work_t **items;
+	int size;
+	int capacity;
+	long long last_served;
+} prio_heap;
+
+//the queues of the priority mode, guarded by qlock
+typedef struct threadpool_prio_st {
+	prio_heap heaps[THREADPOOL_PRIO_LEVELS];
+	unsigned long seq; //arrival order
+	long long aging_ns;
+} threadpool_prio;
+
+//a completion handle, "state" is also the futex word waiters sleep on
+struct threadpool_handle_st {
+	atomic_int state;
+	int result;
+	atomic_int refs; //the caller and the job
+	threadpool *pool;
+	struct threadpool_handle_st *next; //on the free list
+};
+
+//a chunk of handles, they are allocated HANDLE_CHUNK at a time
+typedef struct handle_chunk_st {
+	struct handle_chunk_st *next;
+	threadpool_handle_t handles[HANDLE_CHUNK];
+} handle_chunk;
+
+/* the completion handles of a pool. "epoch" is the futex word of
+threadpool_wait_any, it moves every time a handle somebody waits on completes */
+typedef struct threadpool_handles_st {
+	pthread_mutex_t lock; //guards the free list and the chunks
+	threadpool_handle_t *free_list;
+	handle_chunk *chunks;
+	_Alignas(CACHE_LINE) atomic_int epoch;
+	atomic_int epoch_waiters;
+} threadpool_handles;
+
+/* a running threadpool_parallel_for/reduce, shared by the caller and the
+helper jobs. "next" is the offset of the first index nobody claimed, "left"
+counts the indices not finished yet. the last reference frees it */
+typedef struct parallel_loop_st {
+	_Alignas(CACHE_LINE) atomic_ulong next;
+	_Alignas(CACHE_LINE) atomic_ulong left;
+	atomic_int state; //HANDLE_* - the caller may sleep on it until left reaches 0
+	atomic_int refs; //the caller and the queued helpers
+	atomic_int failed;
+	atomic_int slots_used; //accumulators handed out
+	long begin;
+	unsigned long n; //indices in the range
+	unsigned long grain;
+	int participants; //the caller and the helpers
+	threadpool_range_fn range; //the body of a parallel_for
+	threadpool_fold_fn fold; //or of a parallel_reduce
+	void *ctx;
+	const void *identity;
+	size_t size; //of an accumulator
+	size_t stride; //between two accumulators, whole cache lines
+	_Alignas(CACHE_LINE) char slots[]; //an accumulator per participant that claimed a chunk
+} parallel_loop;
+
+//a task of a graph, everything but "pending" is fixed while the graph runs
+struct threadpool_task_st {
+	dispatch_fn routine;
+	void *arg;
+	atomic_int pending; //predecessors not completed yet in this run
+	int deps; //predecessors
+	threadpool_task_t **succ; //the tasks waiting for it
+	int num_succ;
+	int succ_capacity;
+	threadpool_graph_t *graph;
+	threadpool_task_t *next_ready; //in graph_ready, a task becomes ready once per run
+};
+
+//a chunk of tasks, a graph allocates them GRAPH_CHUNK at a time
+typedef struct task_chunk_st {
+	struct task_chunk_st *next;
+	int used;
+	threadpool_task_t tasks[GRAPH_CHUNK];
+} task_chunk;
+
+/* a task graph. "state" is HANDLE_DONE while it doesn't run, and the futex
+word threadpool_graph_wait sleeps on while it does */
+struct threadpool_graph_st {
+	task_chunk *chunks; //the newest first
+	int count; //tasks
+	int checked; //1 if it has no cycle, cleared by every change
+	threadpool *pool; //of the current run
+	_Alignas(CACHE_LINE) atomic_int left; //tasks of this run not completed yet
+	atomic_int failed;
+	atomic_int state;
+	atomic_int finishing; //the last task is still waking the waiter
+};
+
+/* a fork/join scope. the joiner sleeps on "pending" itself, a child that
+brings it to 0 wakes it if "waiting" is set. the owner and every queued
+child hold a reference, the last one frees it */
+struct threadpool_join_st {
+	threadpool *pool;
+	_Alignas(CACHE_LINE) atomic_int pending; //children forked and not finished
+	atomic_int waiting; //the joiner may sleep on pending
+	atomic_int failed; //since the last join
+	atomic_int refs;
+};
+
+//the argument of a child job, copied into the job itself (WORK_INLINE)
+typedef struct join_child_st {
+	dispatch_fn routine;
+	void *arg;
+	threadpool_join_t *join;
+} join_child;
+
+//a cancel token, the caller and every queued job hold a reference
+struct threadpool_token_st {
+	atomic_int cancelled;
+	atomic_int refs;
+};
+
+//the jobs a destructor drops, collected for the caller or given to the discard handler
+typedef struct dropped_jobs_st {
+	work_t *jobs;
+	int count;
+	int capacity;
+	int collect; //the caller wants them
+} dropped_jobs;
+
+/* a key of dispatch_keyed with queued jobs. it exists while its job
+(strand_run) is queued or running, and is freed when its queue runs dry */
+typedef struct strand_st {
+	struct strand_st *next; //in its bucket, or on the free list
+	unsigned long key;
+	work_t *head; //its jobs, in order
+	work_t *tail;
+	struct threadpool_strands_st *strands;
+	int bucket;
+} strand;
+
+//a bucket of keys, the lock guards the chain and the queues of its strands
+typedef struct strand_bucket_st {
+	_Alignas(CACHE_LINE) pthread_mutex_t lock;
+	strand *chain;
+} strand_bucket;
+
+//the keys of a pool, the strand entries come from chunks
+typedef struct threadpool_strands_st {
+	strand_bucket buckets[STRAND_BUCKETS];
+	threadpool *pool;
+	pthread_mutex_t lock; //guards the free list and the chunks
+	strand *free_list;
+	void **chunks;
+} threadpool_strands;
+
+/* a job of dispatch_fiber and the stack it runs on. while it waits in
+threadpool_wait_fd it's on the reactor's list and its fd is in the epoll
+set, when the fd is ready its job (fiber_run) is queued again */
+typedef struct fiber_st {
+	ucontext_t context; //where it goes on
+	ucontext_t *back; //the thread that resumed it, where it goes when it suspends
+	struct fiber_st *next; //on the reactor's list, or the free list
+	struct fiber_st *prev;
+	struct threadpool_fibers_st *fibers;
+	void *stack; //mmap'ed, a guard page below the stack
+	dispatch_fn routine;
+	void *arg;
+	int result;
+	int started;
+	int done;
+	int fd; //what it waits for
+	int events;
+	int error; //errno of its wait, 0 if fd is ready
+} fiber;
+
+/* the fibers of a pool and the reactor thread that resumes them, "lock"
+guards the lists and "stop". the epoll set and the thread are created with
+the first wait */
+typedef struct threadpool_fibers_st {
+	pthread_mutex_t lock;
+	threadpool *pool;
+	size_t stack_size;
+	size_t guard; //a page
+	int epoll_fd;
+	int wake_fd; //an eventfd in the epoll set, tells the reactor to stop
+	pthread_t thread;
+	int started;
+	int stop;
+	fiber *waiting; //suspended on an fd
+	fiber *free_list;
+	int num_free;
+	int live; //fibers that didn't end yet: queued, running or suspended
+	pthread_cond_t idle; //live dropped to 0
+} threadpool_fibers;
+
+//an event of a trace ring
+typedef struct trace_event_st {
+	unsigned long long clock; //trace_clock
+	unsigned long job; //the trace_id of the job
+	dispatch_fn routine;
+	int kind; //TRACE_*
+} trace_event;
+
+/* the events one thread recorded, it's the only writer. "head" counts the
+events written, the last "capacity" of them are in the ring */
+typedef struct trace_ring_st {
+	struct trace_ring_st *next; //on the trace's list
+	_Alignas(CACHE_LINE) atomic_ulong head;
+	atomic_ulong session; //the threadpool_trace_start its events are of
+	unsigned long capacity; //a power of two
+	long tid;
+	int worker; //the worker's id, -1 for a thread outside the pool
+	trace_event events[];
+} trace_ring;
+
+/* the trace of a pool. "lock" guards the list of rings and the settings of
+the last threadpool_trace_start */
+typedef struct threadpool_trace_st {
+	pthread_mutex_t lock;
+	unsigned int id; //tells the trace_cache of a thread which pool its ring is of
+	atomic_ulong session; //moves on every start, the rings of older ones start over
+	atomic_ulong next_job; //trace ids
+	unsigned long capacity; //of the rings of this session
+	unsigned long long clock0; //trace_clock and threadpool_now_ns at the start
+	long long ns0;
+	trace_ring *rings;
+} threadpool_trace;
+
+/* a timer of dispatch_after/dispatch_every, in a slot list of the wheel
+while it's armed. the id of a timer is its generation and its index, the
+generation moves every time it's freed so stale ids don't match */
+typedef struct wheel_timer_st {
+	struct wheel_timer_st *next; //in its slot, or on the free list
+	struct wheel_timer_st *prev;
+	struct wheel_timer_st **slot; //the slot it's armed in, NULL if it isn't
+	struct wheel_timer_st *fired_next; //on the list the timer thread is dispatching
+	unsigned long long expires; //tick
+	unsigned long long period; //ticks, 0 for a one shot timer
+	dispatch_fn routine;
+	void *arg;
+	unsigned int gen; //0 while free
+	int index;
+	int firing; //its job is being dispatched, the timer thread frees it if it isn't armed
+} wheel_timer;
+
+/* the timers of a pool, everything is guarded by "lock". "tick" is the
+next tick to expire, a tick is WHEEL_TICK_NS since "base" */
+typedef struct threadpool_timers_st {
+	pthread_mutex_t lock;
+	pthread_cond_t changed; //a timer due before "wake" was armed, or stop (monotonic clock)
+	pthread_t thread;
+	int started;
+	int stop;
+	long long base;
+	unsigned long long tick;
+	unsigned long long wake; //the tick the thread sleeps until, ULLONG_MAX if it doesn't
+	int count; //timers not on the free list
+	wheel_timer *root[1 << WHEEL_ROOT_BITS];
+	wheel_timer *levels[WHEEL_LEVELS][1 << WHEEL_BITS];
+	wheel_timer **chunks; //TIMER_CHUNK timers each
+	int num_chunks;
+	wheel_timer *free_list;
+} threadpool_timers;
+
+#ifndef THREADPOOL_NO_STATS
+//a threadpool_histogram_t its worker fills, see stat_add
+typedef struct histogram_st {
+	atomic_llong count;
+	atomic_llong sum_ns;
+	atomic_llong max_ns;
+	atomic_llong buckets[THREADPOOL_HIST_BUCKETS];
+} histogram;
+
+//the instrumentation of a worker, only the worker writes it
+typedef struct worker_stats_st {
+	atomic_llong jobs;
+	atomic_llong failed;
+	atomic_llong busy_ns;
+	atomic_llong idle_ns;
+	atomic_llong lock_wait_ns;
+	long long last_end; //when its last job ended, 0 before the first
+	histogram queue_wait;
+	histogram run_time;
+} worker_stats;
+#endif
+
+//a task group, guarded by the lock of the groups
+struct threadpool_group_st {
+	char name[THREADPOOL_GROUP_NAME];
+	int weight;
+	int max_running; //0 for no cap
+	work_t *head, *tail; //queued jobs
+	long queued;
+	long running;
+	long long deficit; //run time it may still start this round, may go negative
+	long long cost_ns; //what a job is charged when it starts, a moving average
+	long dispatched, completed, failed, discarded;
+#ifndef THREADPOOL_NO_STATS
+	histogram queue_wait;
+	histogram run_time;
+#endif
+	struct threadpool_groups_st *groups;
+};
+
+/* the task groups of a pool. "tickets" counts the group_run jobs in the
+pool's queue, there's one for every job some group may start now. "cursor"
+is the group whose turn it is */
+typedef struct threadpool_groups_st {
+	pthread_mutex_t lock;
+	threadpool *pool;
+	threadpool_group_t **list;
+	int count;
+	int capacity;
+	int cursor;
+	int tickets;
+} threadpool_groups;
+
+//the per worker state
+typedef struct threadpool_worker_st {
+	_Alignas(CACHE_LINE) atomic_long top; //thieves take from here
+	_Alignas(CACHE_LINE) atomic_long bottom; //the owner pushes and takes here
+	_Atomic(deque_ring*) ring;
+	threadpool *pool;
+	int id;
+	unsigned int seed; //for picking steal victims
+	work_t *cache; //work_t nodes for dispatches made by this worker
+	int cache_count;
+	int state; //WORKER_*, guarded by qlock
+	int cpu; //the cpu it's pinned to, -1 for none
+	int numa; //its NUMA sub-pool
+	int blocking; //depth of its blocking regions
+	char *scratch; //its arena, allocated on first use
+	size_t scratch_used; //bytes lent to the jobs running now
+#ifndef THREADPOOL_NO_STATS
+	_Alignas(CACHE_LINE) worker_stats stats; //away from the lines thieves touch
+#endif
+} threadpool_worker;
+
+/* a slot of the ring queue (Vyukov's bounded MPMC queue). "seq" tells
+whose turn the slot is: seq == pos means free for the producer of ticket
+pos, seq == pos + 1 means full for the consumer of ticket pos. a slot
+takes a whole cache line so neighbouring tickets don't false share */
+typedef struct ring_slot_st {
+	_Alignas(CACHE_LINE) atomic_size_t seq;
+	work_t work; //the job is stored by value, no allocation per job
+} ring_slot;
+
+//the ring queue, the two tickets live on their own cache lines
+typedef struct threadpool_ring_st {
+	_Alignas(CACHE_LINE) atomic_size_t enqueue_pos;
+	_Alignas(CACHE_LINE) atomic_size_t dequeue_pos;
+	_Alignas(CACHE_LINE) size_t mask; //capacity - 1
+	ring_slot slots[];
+} threadpool_ring;
+
+//the worker running on the current thread, NULL for threads outside any pool
+static __thread threadpool_worker *current_worker = NULL;
+
+/* the work_t caches of a thread outside the pool (e.g. an acceptor), each
+valid while slab_id matches. a NUMA pool's sub-pools each get their own,
+so the round robin of numa_target doesn't switch slabs on every dispatch */
+static __thread struct {
+	unsigned int slab_id;
+	work_t *list;
+} producer_cache[PRODUCER_CACHES];
+
+//the NUMA sub-pool the next dispatch of this thread goes to, it moves round robin
+static __thread unsigned int numa_turn = 0;
+
+//the random choices of shard_pick
+static __thread unsigned int shard_seed = 0;
+
+//the fiber this thread runs, NULL on the thread's own stack
+static __thread fiber *current_fiber = NULL;
+
+/* the ready graph tasks this thread has to queue, run or discard. while
+graph_queue works through them, the tasks they release join the list */
+static __thread threadpool_task_t *graph_ready = NULL;
+static __thread int graph_draining = 0;
+
+#ifndef THREADPOOL_NO_TRACE
+//the trace ring of this thread, valid while trace_id matches
+static __thread struct {
+	unsigned int trace_id;
+	trace_ring *ring;
+} trace_cache = { 0, NULL };
+#endif
+
+//ids of the traces, 0 is never used so an empty trace_cache matches no trace
+static atomic_uint next_trace_id = 1;
+
+//ids of the slabs, 0 is never used so an empty producer_cache matches no slab
+static atomic_uint next_slab_id = 1;
+
+//the slabs not destroyed yet, a producer_cache that switches slabs gives its nodes back to one of them
+static pthread_mutex_t live_slabs_lock = PTHREAD_MUTEX_INITIALIZER;
+static threadpool_slab *live_slabs = NULL;
+
+//generations of the timers, 0 is never used so a free timer matches no id
+static atomic_uint next_timer_gen = 1;
+
+//private functions
+static void* worker_main(void*);
+static void* work_stealing_loop(threadpool*, threadpool_worker*);
+static void* ring_loop(threadpool*);
+static void* sharded_loop(threadpool*, threadpool_worker*);
+static work_t* queue_take_locked(threadpool*, int);
+static int help_run(threadpool*);
+static void wake_workers(threadpool*, int);
+static void job_taken(threadpool*);
+static int park_worker(threadpool*);
+static int idle_wait(threadpool*);
+static void grow(threadpool*);
+static int spawn_locked(threadpool*);
+static int retire_locked(threadpool*);
+static struct timespec idle_deadline(threadpool*);
+static threadpool_ring* ring_create(size_t);
+static int ring_push(threadpool_ring*, const work_t*);
+static int ring_pop(threadpool_ring*, work_t*);
+static int ring_dispatch(threadpool*, const work_t*, const struct timespec*);
+static int submit(threadpool*, const work_t*, const struct timespec*);
+static struct timespec deadline_after(long);
+static int destroy_pool(threadpool*, int, const struct timespec*, work_t**);
+static void drop_job(threadpool*, work_t*, dropped_jobs*);
+static void token_put(threadpool_token_t*);
+static int queue_job(threadpool*, const work_t*, const struct timespec*);
+static int overflow_action(threadpool*, const struct timespec*);
+static int room_locked(threadpool*, const struct timespec*, work_t**);
+static work_t* take_oldest_locked(threadpool*);
+static int overflowed(threadpool*, work_t*, int);
+static void discard_work(threadpool*, work_t*);
+static void discard_list(threadpool*, work_t*);
+static int prio_push_locked(threadpool*, work_t*);
+static work_t* prio_pop_locked(threadpool*);
+static work_t* prio_take_oldest_locked(threadpool*);
+static int prio_before(const work_t*, const work_t*);
+static void prio_sift_up(prio_heap*, int);
+static void prio_sift_down(prio_heap*, int);
+static work_t* node_from(threadpool*, const work_t*, int);
+static int run_work(threadpool*, work_t*);
+static threadpool_handles* handles_create(void);
+static int handles_grow(threadpool_handles*);
+static void handle_complete(threadpool_handle_t*, int);
+static void handle_put(threadpool_handle_t*);
+static threadpool_strands* strands_create(threadpool*);
+static void strands_free(threadpool_strands*);
+static threadpool_groups* groups_create(threadpool*);
+static void groups_free(threadpool_groups*);
+static int group_run(void*);
+static int group_ready(const threadpool_group_t*);
+static threadpool_group_t* group_pick_locked(threadpool_groups*);
+static work_t* group_take_locked(threadpool_group_t*);
+static int groups_refill_locked(threadpool_groups*);
+static void groups_submit(threadpool_groups*, int);
+static void group_drop(threadpool*, dropped_jobs*);
+static void groups_drop(threadpool*, dropped_jobs*);
+static int strand_run(void*);
+static work_t* strand_take_all(strand*);
+static void strand_put(threadpool_strands*, strand*);
+static threadpool_timers* timers_create(void);
+static void timers_stop(threadpool*, dropped_jobs*);
+static void timers_free(threadpool_timers*);
+static long long timer_arm(threadpool*, long, long, dispatch_fn, void*);
+static wheel_timer* timer_lookup(threadpool_timers*, long long);
+static void timer_free(threadpool_timers*, wheel_timer*);
+static void* timer_main(void*);
+static unsigned long long wheel_now(threadpool_timers*);
+static unsigned long long wheel_next(threadpool_timers*);
+static void wheel_advance(threadpool_timers*, wheel_timer**, wheel_timer**);
+static void wheel_insert(threadpool_timers*, wheel_timer*);
+static void wheel_unlink(wheel_timer*);
+static threadpool_fibers* fibers_create(threadpool*, size_t);
+static void fibers_stop(threadpool*, int, const struct timespec*);
+static void fibers_free(threadpool_fibers*);
+static fiber* fiber_alloc(threadpool_fibers*);
+static void fiber_free(threadpool_fibers*, fiber*);
+static void fiber_entry(void);
+static int fiber_run(void*);
+static int fiber_watch(threadpool_fibers*, fiber*);
+static void fiber_drop(threadpool*, fiber*);
+static void* reactor_main(void*);
+static threadpool_trace* trace_create(void);
+static void trace_free(threadpool_trace*);
+#ifndef THREADPOOL_NO_TRACE
+static void trace_record(threadpool*, int, work_t*);
+static trace_ring* trace_ring_get(threadpool*);
+#endif
+static unsigned long long trace_clock(void);
+static void futex_wait(atomic_int*, int);
+static void futex_wake(atomic_int*, int);
+static int parallel_loop_start(threadpool*, long, long, long, threadpool_range_fn, threadpool_fold_fn,
+	threadpool_combine_fn, void*, size_t, void*);
+static int parallel_helper(void*);
+static void parallel_run(parallel_loop*);
+static unsigned long parallel_claim(parallel_loop*, long*);
+static void parallel_put(parallel_loop*);
+static int graph_task(void*);
+static void graph_task_done(threadpool_task_t*, int);
+static void graph_queue(threadpool_task_t*);
+static int graph_acyclic(threadpool_graph_t*);
+static int join_child_run(void*);
+static void join_done(threadpool_join_t*, int);
+static void join_put(threadpool_join_t*);
+static deque_ring* deque_ring_create(long);
+static int deque_push(threadpool_worker*, work_t*);
+static work_t* deque_take(threadpool_worker*);
+static work_t* deque_steal(threadpool_worker*, int*);
+static int injection_push(threadpool*, work_t*, const struct timespec*);
+static work_t* injection_pop(threadpool*, threadpool_worker*);
+static work_t* steal_work(threadpool*, threadpool_worker*, int*);
+static int numa_push(threadpool*, int, work_t*, const struct timespec*);
+static void numa_append(threadpool_numa*, work_t*, work_t*, int);
+static work_t* numa_pop(threadpool*, threadpool_numa*, threadpool_worker*);
+static int numa_target(threadpool*, const work_t*);
+static int shard_push(threadpool*, work_t*, const struct timespec*);
+static void shard_append(queue_shard*, work_t*, work_t*, int);
+static work_t* shard_pop(threadpool*, queue_shard*);
+static int shard_pick(threadpool*);
+static int place_workers(threadpool*, const threadpool_attr_t*);
+static int read_topology(const threadpool_attr_t*, cpu_place*);
+static int read_cpulist(const char*, unsigned char*);
+static int by_compact(const void*, const void*);
+static int by_core(const void*, const void*);
+static int by_scatter(const void*, const void*);
+static int start_worker(threadpool*, int);
+static void free_pool_state(threadpool*);
+static void lock_queue(threadpool*);
+#ifndef THREADPOOL_NO_STATS
+static void stat_add(atomic_llong*, long long);
+static void histogram_add(histogram*, long long);
+static void histogram_merge(threadpool_histogram_t*, histogram*);
+static int histogram_bucket(long long);
+#endif
+static threadpool_slab* slab_create(int, int, unsigned int);
+static void slab_destroy(threadpool_slab*);
+static void slab_return(threadpool_slab*, work_t*);
+static void slab_give_back(unsigned int, work_t*);
+static void numa_bind(void*, size_t, int);
+static work_t* slab_alloc(threadpool*, int);
+static void slab_free(threadpool*, work_t*);
+static void slab_flush_cache(threadpool*, threadpool_worker*);
+static work_t* slab_refill(threadpool_slab*);
+
+//the default options
+void threadpool_attr_init(threadpool_attr_t *attr)
+{
+	attr->num_threads = 1;
+	attr->min_threads = 0;
+	attr->max_threads = 0;
+	attr->thread_limit = MAXT_IN_POOL;
+	attr->spawn_depth = SPAWN_DEFAULT_DEPTH;
+	attr->spawn_wait_ms = SPAWN_DEFAULT_WAIT_MS;
+	attr->keep_alive_ms = KEEP_ALIVE_DEFAULT_MS;
+	attr->max_blocking = 0;
+	attr->sched = THREADPOOL_SCHED_FIFO;
+	attr->queue_capacity = 0;
+	attr->slab_chunk = 0;
+	attr->batch_size = 1;
+	attr->overflow = THREADPOOL_OVERFLOW_BLOCK;
+	attr->discard_handler = NULL;
+	attr->aging_ms = PRIO_DEFAULT_AGING_MS;
+	attr->discard_expired = 0;
+	attr->affinity = THREADPOOL_AFFINITY_NONE;
+	attr->cpus = NULL;
+	attr->num_cpus = 0;
+	attr->numa = 0;
+	attr->shards = 0;
+	attr->fiber_stack_size = 0;
+	attr->idle_spin = 0;
+	attr->idle_yield = 0;
+	attr->stack_size = 0;
+	attr->guard_size = 0;
+	attr->sched_policy = SCHED_OTHER;
+	attr->sched_priority = 0;
+	attr->scratch_size = 0;
+}
 
 //the threads constructor
 threadpool* create_threadpool(int num_threads_in_pool)
 {
+	threadpool_attr_t attr;
+	threadpool_attr_init(&attr);
+	attr.num_threads = num_threads_in_pool;
+	return create_threadpool_attr(&attr);
+}
+
+//the threads constructor with options
+threadpool* create_threadpool_attr(const threadpool_attr_t *attr)
+{
+	int num_threads_in_pool = attr->num_threads;
+	int min_threads = attr->min_threads? attr->min_threads : num_threads_in_pool;
+	int max_threads = attr->max_threads? attr->max_threads : num_threads_in_pool;
 	//checking the number of threads requested
-	if (num_threads_in_pool > MAXT_IN_POOL || num_threads_in_pool < 1)
+	if (num_threads_in_pool > attr->thread_limit || num_threads_in_pool < 1
+		|| min_threads < 1 || min_threads > num_threads_in_pool
+		|| max_threads < num_threads_in_pool || max_threads > attr->thread_limit)
 	{
 		printf("Illegal number of threads requested\n");
 		return NULL;
 	}
+	//checking when an elastic pool spawns and retires threads
+	if (attr->spawn_depth < 1 || attr->spawn_wait_ms < 0 || attr->keep_alive_ms < 0
+		|| attr->max_blocking < 0 || max_threads + attr->max_blocking > attr->thread_limit)
+	{
+		printf("Illegal elastic pool options requested\n");
+		return NULL;
+	}
 	
 	//initialize the object
 	threadpool *my_threadpool = (threadpool*)calloc(1, sizeof(threadpool));
@@ -29,11 +789,92 @@ threadpool* create_threadpool(int num_threads_in_pool)
 		return NULL;
 	}
 	
+	//checking the scheduling mode requested
+	if (attr->sched < THREADPOOL_SCHED_FIFO || attr->sched > THREADPOOL_SCHED_SHARDED)
+	{
+		printf("Illegal scheduling mode requested\n");
+		free(my_threadpool);
+		return NULL;
+	}
+	my_threadpool->sched = attr->sched;
+	
+	//checking the number of jobs a worker takes per lock acquisition
+	if (attr->batch_size < 1)
+	{
+		printf("Illegal batch size requested\n");
+		free(my_threadpool);
+		return NULL;
+	}
+	my_threadpool->batch_size = attr->batch_size;
+	
+	//checking the idle policy
+	if (attr->idle_spin < 0 || attr->idle_yield < 0)
+	{
+		printf("Illegal idle policy requested\n");
+		free(my_threadpool);
+		return NULL;
+	}
+	my_threadpool->idle_spin = attr->idle_spin;
+	my_threadpool->idle_yield = attr->idle_yield;
+	
+	//checking the thread attributes, a bad policy has no priority range
+	if ((attr->stack_size && attr->stack_size < (size_t)PTHREAD_STACK_MIN) || (attr->sched_policy != SCHED_OTHER
+		&& (attr->sched_priority < sched_get_priority_min(attr->sched_policy)
+		|| attr->sched_priority > sched_get_priority_max(attr->sched_policy))))
+	{
+		printf("Illegal thread attributes requested\n");
+		free(my_threadpool);
+		return NULL;
+	}
+	my_threadpool->stack_size = attr->stack_size;
+	my_threadpool->guard_size = attr->guard_size;
+	my_threadpool->sched_policy = attr->sched_policy;
+	my_threadpool->sched_priority = attr->sched_priority;
+	my_threadpool->scratch_size = attr->scratch_size;
+	
+	//checking the bound of the queue and what to do when it's full
+	if (attr->queue_capacity < 0 || attr->overflow < THREADPOOL_OVERFLOW_BLOCK
+		|| attr->overflow > THREADPOOL_OVERFLOW_DISCARD_OLDEST)
+	{
+		printf("Illegal queue capacity or overflow policy requested\n");
+		free(my_threadpool);
+		return NULL;
+	}
+	my_threadpool->queue_capacity = attr->queue_capacity;
+	my_threadpool->overflow = attr->overflow;
+	my_threadpool->discard_handler = attr->discard_handler;
+	my_threadpool->discard_expired = attr->discard_expired;
+	
+	//the ring mode allocates all of its slots up front
+	if (my_threadpool->sched == THREADPOOL_SCHED_RING)
+	{
+		my_threadpool->ring = ring_create(attr->queue_capacity ? attr->queue_capacity : RING_DEFAULT_CAPACITY);
+		if (!my_threadpool->ring)
+		{
+			perror("Ring queue memory allocation failed\n");
+			free(my_threadpool);
+			return NULL;
+		}
+		my_threadpool->queue_capacity = (int)(my_threadpool->ring->mask + 1);
+	}
+	
 	//set the field num_threads to the requested number of threads by the user
-	my_threadpool->num_threads = num_threads_in_pool;
+	atomic_init(&(my_threadpool->num_threads), num_threads_in_pool);
+	my_threadpool->peak_threads = num_threads_in_pool;
+	my_threadpool->min_threads = min_threads;
+	my_threadpool->max_threads = max_threads;
+	my_threadpool->max_blocking = attr->max_blocking;
+	my_threadpool->num_slots = max_threads + attr->max_blocking;
+	atomic_init(&(my_threadpool->blocked), 0);
+	my_threadpool->spawn_depth = attr->spawn_depth;
+	my_threadpool->spawn_wait_ns = attr->spawn_wait_ms * 1000000LL;
+	my_threadpool->keep_alive_ns = attr->keep_alive_ms * 1000000LL;
+	atomic_init(&(my_threadpool->backlog_since), 0);
+	atomic_init(&(my_threadpool->spawned), 0);
+	atomic_init(&(my_threadpool->retired), 0);
 	
-	//initializing the array for the threads, size of num_threads
-	my_threadpool->threads = (pthread_t*)calloc(my_threadpool->num_threads, sizeof(pthread_t));
+	//initializing the array for the threads, a slot for every thread the pool may have
+	my_threadpool->threads = (pthread_t*)calloc(my_threadpool->num_slots, sizeof(pthread_t));
 	if (!my_threadpool->threads)
 	{
 		perror("Threads array memory allocation failed\n");
@@ -41,19 +882,225 @@ threadpool* create_threadpool(int num_threads_in_pool)
 		return NULL;
 	}
 	
+	//initializing the per worker state, cache line aligned so workers don't share lines
+	my_threadpool->workers = (threadpool_worker*)aligned_alloc(CACHE_LINE,
+		my_threadpool->num_slots * sizeof(threadpool_worker));
+	if (!my_threadpool->workers)
+	{
+		perror("Workers array memory allocation failed\n");
+		free(my_threadpool->ring);
+		free(my_threadpool->threads);
+		free(my_threadpool);
+		return NULL;
+	}
+	int w;
+	for (w = 0; w < my_threadpool->num_slots; w++)
+	{
+		threadpool_worker *worker = &(my_threadpool->workers[w]);
+		atomic_init(&(worker->top), 0);
+		atomic_init(&(worker->bottom), 0);
+		atomic_init(&(worker->ring), NULL);
+		worker->pool = my_threadpool;
+		worker->id = w;
+		worker->seed = (unsigned int)w * 2654435761u + 1;
+		worker->cache = NULL;
+		worker->cache_count = 0;
+		worker->state = w < num_threads_in_pool? WORKER_RUNNING : WORKER_UNUSED;
+		worker->cpu = -1;
+		worker->numa = 0;
+		worker->blocking = 0;
+		worker->scratch = NULL;
+		worker->scratch_used = 0;
+#ifndef THREADPOOL_NO_STATS
+		memset(&(worker->stats), 0, sizeof(worker_stats));
+#endif
+		//only the work stealing mode uses the deques
+		if (my_threadpool->sched == THREADPOOL_SCHED_WORK_STEALING)
+		{
+			deque_ring *ring = deque_ring_create(DEQUE_INITIAL_SIZE);
+			if (!ring)
+			{
+				perror("Worker deque memory allocation failed\n");
+				while (w-- > 0)
+					free(atomic_load(&(my_threadpool->workers[w].ring)));
+				free(my_threadpool->workers);
+				free(my_threadpool->ring);
+				free(my_threadpool->threads);
+				free(my_threadpool);
+				return NULL;
+			}
+			atomic_init(&(worker->ring), ring);
+		}
+	}
+	
+	//pin the workers and group them into NUMA sub-pools
+	if (place_workers(my_threadpool, attr) < 0)
+	{
+		printf("Illegal worker placement requested\n");
+		free_pool_state(my_threadpool);
+		free(my_threadpool->threads);
+		free(my_threadpool);
+		return NULL;
+	}
+	
+	//the work_t allocator, starts with one chunk (a slab per NUMA sub-pool)
+	if (attr->slab_chunk < 0)
+	{
+		printf("Illegal slab chunk size requested\n");
+		free_pool_state(my_threadpool);
+		free(my_threadpool->threads);
+		free(my_threadpool);
+		return NULL;
+	}
+	int chunk = attr->slab_chunk ? attr->slab_chunk : SLAB_DEFAULT_CHUNK;
+	for (w = 0; w < my_threadpool->num_numa; w++)
+	{
+		threadpool_numa *numa = &(my_threadpool->numa[w]);
+		numa->slab = slab_create(chunk, numa->id, (unsigned int)(w + 1) << WORK_NUMA_SHIFT);
+		if (!numa->slab)
+			break;
+	}
+	if (my_threadpool->numa)
+		my_threadpool->slab = my_threadpool->numa[0].slab;
+	else
+		my_threadpool->slab = slab_create(chunk, -1, 0);
+	if (!my_threadpool->slab || w < my_threadpool->num_numa)
+	{
+		perror("Work slab memory allocation failed\n");
+		free_pool_state(my_threadpool);
+		free(my_threadpool->threads);
+		free(my_threadpool);
+		return NULL;
+	}
+	
+	//the completion handles, starts with one chunk
+	my_threadpool->handles = handles_create();
+	if (!my_threadpool->handles)
+	{
+		perror("Handles memory allocation failed\n");
+		free_pool_state(my_threadpool);
+		free(my_threadpool->threads);
+		free(my_threadpool);
+		return NULL;
+	}
+	
+	//the sharded mode's queues, a shard per thread unless asked otherwise
+	if (my_threadpool->sched == THREADPOOL_SCHED_SHARDED)
+	{
+		int shards = attr->shards? attr->shards : max_threads;
+		my_threadpool->shards = shards > 0? (queue_shard*)aligned_alloc(CACHE_LINE, shards * sizeof(queue_shard)) : NULL;
+		if (!my_threadpool->shards)
+		{
+			printf("Queue shards initializing failed\n");
+			free_pool_state(my_threadpool);
+			free(my_threadpool->threads);
+			free(my_threadpool);
+			return NULL;
+		}
+		for (w = 0; w < shards; w++)
+		{
+			pthread_mutex_init(&(my_threadpool->shards[w].lock), NULL);
+			my_threadpool->shards[w].head = NULL;
+			my_threadpool->shards[w].tail = NULL;
+			atomic_init(&(my_threadpool->shards[w].size), 0);
+		}
+		my_threadpool->num_shards = shards;
+	}
+	
+	//the timer wheel, its thread starts with the first timer
+	my_threadpool->timers = timers_create();
+	if (!my_threadpool->timers)
+	{
+		perror("Timers memory allocation failed\n");
+		free_pool_state(my_threadpool);
+		free(my_threadpool->threads);
+		free(my_threadpool);
+		return NULL;
+	}
+	
+	//the keys of dispatch_keyed
+	my_threadpool->strands = strands_create(my_threadpool);
+	if (!my_threadpool->strands)
+	{
+		perror("Strands memory allocation failed\n");
+		free_pool_state(my_threadpool);
+		free(my_threadpool->threads);
+		free(my_threadpool);
+		return NULL;
+	}
+	
+	//the task groups, none yet
+	my_threadpool->groups = groups_create(my_threadpool);
+	if (!my_threadpool->groups)
+	{
+		perror("Groups memory allocation failed\n");
+		free_pool_state(my_threadpool);
+		free(my_threadpool->threads);
+		free(my_threadpool);
+		return NULL;
+	}
+	
+	//the stacks of dispatch_fiber, the reactor starts with the first wait
+	my_threadpool->fibers = fibers_create(my_threadpool, attr->fiber_stack_size);
+	if (!my_threadpool->fibers)
+	{
+		perror("Fibers memory allocation failed\n");
+		free_pool_state(my_threadpool);
+		free(my_threadpool->threads);
+		free(my_threadpool);
+		return NULL;
+	}
+	
+	//the trace rings, a thread gets one with its first event
+	my_threadpool->trace = trace_create();
+	if (!my_threadpool->trace)
+	{
+		perror("Trace memory allocation failed\n");
+		free_pool_state(my_threadpool);
+		free(my_threadpool->threads);
+		free(my_threadpool);
+		return NULL;
+	}
+	
+	//the priority mode keeps a heap per priority class
+	if (my_threadpool->sched == THREADPOOL_SCHED_PRIORITY)
+	{
+		my_threadpool->prio = (threadpool_prio*)calloc(1, sizeof(threadpool_prio));
+		if (!my_threadpool->prio || attr->aging_ms < 0)
+		{
+			printf("Priority queues initializing failed\n");
+			free_pool_state(my_threadpool);
+			free(my_threadpool->threads);
+			free(my_threadpool);
+			return NULL;
+		}
+		my_threadpool->prio->aging_ns = attr->aging_ms * 1000000LL;
+	}
+	
 	//initializing the list (empty at first)
 	my_threadpool->qhead = NULL;
 	my_threadpool->qtail = NULL;
-	my_threadpool->qsize = 0;
+	atomic_init(&(my_threadpool->qsize), 0);
+	atomic_init(&(my_threadpool->idle_waiters), 0);
+	atomic_init(&(my_threadpool->inject_size), 0);
+	atomic_init(&(my_threadpool->full_waiters), 0);
+	atomic_init(&(my_threadpool->rejected), 0);
+	atomic_init(&(my_threadpool->discarded), 0);
+	atomic_init(&(my_threadpool->caller_runs), 0);
+	atomic_init(&(my_threadpool->expired), 0);
+	atomic_init(&(my_threadpool->cancelled), 0);
+	atomic_init(&(my_threadpool->lock_wait_ns), 0);
 	
 	//initializing the flags (ACCEPT = 0)
-	my_threadpool->shutdown = ACCEPT;
-      my_threadpool->dont_accept = ACCEPT;
+	atomic_init(&(my_threadpool->shutdown), ACCEPT);
+      atomic_init(&(my_threadpool->dont_accept), ACCEPT);
+	atomic_init(&(my_threadpool->dropping), 0);
       
 	// initializing mutex and condition variables, all returns zero if successful
 	if (pthread_mutex_init(&(my_threadpool->qlock), NULL))
 	{
 		perror("Object Mutex lock initializing failed\n");
+   		free_pool_state(my_threadpool);
    		free(my_threadpool->threads);
    		free(my_threadpool);
    		return NULL;
@@ -62,6 +1109,7 @@ threadpool* create_threadpool(int num_threads_in_pool)
 	{
 		perror("Object Mutex lock initializing failed\n");
    		pthread_mutex_destroy(&(my_threadpool->qlock));
+   		free_pool_state(my_threadpool);
    		free(my_threadpool->threads);
    		free(my_threadpool);
    		return NULL;
@@ -71,6 +1119,18 @@ threadpool* create_threadpool(int num_threads_in_pool)
    		perror("Object conditions initializing error\n");
    		pthread_mutex_destroy(&(my_threadpool->qlock));
 		pthread_cond_destroy(&(my_threadpool->q_empty));
+		free_pool_state(my_threadpool);
+		free(my_threadpool->threads);
+   		free(my_threadpool);
+   		return NULL;
+   	}
+	if (pthread_cond_init(&(my_threadpool->q_not_full), NULL))
+	{
+   		perror("Object conditions initializing error\n");
+   		pthread_mutex_destroy(&(my_threadpool->qlock));
+		pthread_cond_destroy(&(my_threadpool->q_empty));
+		pthread_cond_destroy(&(my_threadpool->q_not_empty));
+		free_pool_state(my_threadpool);
 		free(my_threadpool->threads);
    		free(my_threadpool);
    		return NULL;
@@ -78,17 +1138,19 @@ threadpool* create_threadpool(int num_threads_in_pool)
 	
 	//initializing a pool of threads using
 	int i;
-	for (i = 0; i < my_threadpool->num_threads; i++)
+	for (i = 0; i < num_threads_in_pool; i++)
 	{
 		/* pthread_create will make the threads to start running the function 
-		"do_work", inside that function we will catch all the treads in an infinite 
+		"do_work" (through worker_main), inside that function we will catch all the treads in an infinite 
 		loop and make them wait for jobs. pthread_create returns zero if successful */
-		if (pthread_create(&(my_threadpool->threads[i]), NULL, do_work, my_threadpool))
+		if (start_worker(my_threadpool, i))
 		{
 			perror("Thread initializing failed\n");
 			pthread_mutex_destroy(&(my_threadpool->qlock));
 			pthread_cond_destroy(&(my_threadpool->q_empty));
 			pthread_cond_destroy(&(my_threadpool->q_not_empty));
+			pthread_cond_destroy(&(my_threadpool->q_not_full));
+			free_pool_state(my_threadpool);
 			free(my_threadpool->threads);
    			free(my_threadpool);
 			return NULL;
@@ -99,53 +1161,288 @@ threadpool* create_threadpool(int num_threads_in_pool)
 }
 
 //the add work function
-void dispatch(threadpool* from_me, dispatch_fn dispatch_to_here, void *arg)
+int dispatch(threadpool* from_me, dispatch_fn dispatch_to_here, void *arg)
 {
-	//critical section - checking the object
-	pthread_mutex_lock(&(from_me->qlock));
-	//destructor started and raised the flag "dont accept"
-	if(from_me->dont_accept == DONT_ACCEPT)
+	work_t job = { 0 };
+	job.routine = dispatch_to_here;
+	job.arg = arg;
+	job.priority = THREADPOOL_PRIO_NORMAL;
+	return submit(from_me, &job, NULL);
+}
+
+//add a job with a copy of its argument
+int dispatch_copy(threadpool* from_me, dispatch_fn dispatch_to_here, const void *arg, size_t size)
+{
+	if (size > THREADPOOL_INLINE_ARG)
+	{
+		printf("Argument too big to copy into the job\n");
+		return -1;
+	}
+	work_t job = { 0 };
+	job.routine = dispatch_to_here;
+	job.priority = THREADPOOL_PRIO_NORMAL;
+	//the job is copied by value from here on (a node, a ring slot), the flag finds the copy
+	job.flags = WORK_INLINE;
+	if (size)
+		memcpy(job.payload, arg, size);
+	return submit(from_me, &job, NULL);
+}
+
+//add a job, waiting at most timeout_ms for room in a full queue
+int try_dispatch(threadpool* from_me, dispatch_fn dispatch_to_here, void *arg, long timeout_ms)
+{
+	struct timespec deadline = deadline_after(timeout_ms);
+	work_t job = { 0 };
+	job.routine = dispatch_to_here;
+	job.arg = arg;
+	job.priority = THREADPOOL_PRIO_NORMAL;
+	return submit(from_me, &job, &deadline);
+}
+
+//add a job that runs in a blocking region, see threadpool_blocking_begin
+int dispatch_blocking(threadpool* from_me, dispatch_fn dispatch_to_here, void *arg)
+{
+	work_t job = { 0 };
+	job.routine = dispatch_to_here;
+	job.arg = arg;
+	job.priority = THREADPOOL_PRIO_NORMAL;
+	job.flags = WORK_BLOCKING;
+	return submit(from_me, &job, NULL);
+}
+
+/* the worker of this thread is about to block, it stops counting against
+max_threads. if jobs wait with no idle worker a stand-in is spawned now,
+the later dispatches spawn more up to max_blocking */
+void threadpool_blocking_begin(void)
+{
+	threadpool_worker *me = current_worker;
+	if (!me || current_fiber || me->blocking++)
 		return;
-	//end of critical section, give back the lock
-	pthread_mutex_unlock(&(from_me->qlock));
+	threadpool *pool = me->pool;
+	atomic_fetch_add(&(pool->blocked), 1);
+	if (pool->max_blocking && pool->qsize && !pool->idle_waiters)
+		grow(pool);
+}
+
+//the worker is back, a surplus stand-in retires when it next idles
+void threadpool_blocking_end(void)
+{
+	threadpool_worker *me = current_worker;
+	if (!me || current_fiber || !me->blocking || --me->blocking)
+		return;
+	atomic_fetch_sub(&(me->pool->blocked), 1);
+}
+
+/* lend the running job "size" bytes of the arena past what the jobs below
+it on this thread borrowed, run_work takes them back */
+void* threadpool_scratch(size_t size)
+{
+	threadpool_worker *me = current_worker;
+	if (!me || current_fiber)
+		return NULL;
+	if (!me->scratch)
+	{
+		//the worker's first touch places it on the worker's node
+		if (!me->pool->scratch_size || !(me->scratch = (char*)aligned_alloc(CACHE_LINE,
+			(me->pool->scratch_size + CACHE_LINE - 1) & ~(size_t)(CACHE_LINE - 1))))
+			return NULL;
+	}
+	size_t begin = (me->scratch_used + SCRATCH_ALIGN - 1) & ~(size_t)(SCRATCH_ALIGN - 1);
+	if (begin > me->pool->scratch_size || size > me->pool->scratch_size - begin)
+		return NULL;
+	me->scratch_used = begin + size;
+	return me->scratch + begin;
+}
+
+//add a job to a NUMA sub-pool
+int dispatch_on_node(threadpool* from_me, int node, dispatch_fn dispatch_to_here, void *arg)
+{
+	if (node == THREADPOOL_NODE_LOCAL)
+	{
+		int cpu = sched_getcpu();
+		node = from_me->numa && cpu >= 0 && cpu < CPU_SETSIZE? from_me->cpu_numa[cpu] : -1;
+	}
+	else if (node < 0 || (from_me->numa && node >= from_me->num_numa))
+	{
+		printf("Illegal node requested\n");
+		return -1;
+	}
+	work_t job = { 0 };
+	job.routine = dispatch_to_here;
+	job.arg = arg;
+	job.priority = THREADPOOL_PRIO_NORMAL;
+	if (node >= 0) //the template carries the node the way the slab nodes do
+		job.flags = (unsigned int)(node + 1) << WORK_NUMA_SHIFT;
+	return submit(from_me, &job, NULL);
+}
+
+//add a job with a priority class and an optional absolute deadline
+int dispatch_priority(threadpool* from_me, dispatch_fn dispatch_to_here, void *arg, int priority, long long deadline_ns)
+{
+	if (priority < THREADPOOL_PRIO_HIGH || priority >= THREADPOOL_PRIO_LEVELS)
+	{
+		printf("Illegal priority requested\n");
+		return -1;
+	}
+	work_t job = { 0 };
+	job.routine = dispatch_to_here;
+	job.arg = arg;
+	job.priority = priority;
+	job.deadline = deadline_ns;
+	return submit(from_me, &job, NULL);
+}
+
+//timeout_ms from now on the clock of the pool's condition variables
+static struct timespec deadline_after(long timeout_ms)
+{
+	struct timespec deadline;
+	clock_gettime(CLOCK_REALTIME, &deadline);
+	deadline.tv_sec += timeout_ms / 1000;
+	deadline.tv_nsec += (timeout_ms % 1000) * 1000000;
+	if (deadline.tv_nsec >= 1000000000)
+	{
+		deadline.tv_sec++;
+		deadline.tv_nsec -= 1000000000;
+	}
+	return deadline;
+}
+
+//the monotonic clock in nanoseconds, the clock of the deadlines
+long long threadpool_now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/* queue a copy of "job" in the queue of the pool's mode, every dispatch
+variant ends up here. "deadline" is NULL to handle a full queue with the
+pool's overflow policy, or the time try_dispatch gives up waiting for room.
+returns 0 if the job was queued (or ran on this thread), -1 if it wasn't */
+static int submit(threadpool* from_me, const work_t *job, const struct timespec *deadline)
+{
+#ifndef THREADPOOL_NO_TRACE
+	//a traced job gets its id here
+	work_t traced;
+	if (atomic_load_explicit(&(from_me->tracing), memory_order_relaxed))
+	{
+		traced = *job;
+		trace_record(from_me, TRACE_ENQUEUE, &traced);
+		job = &traced;
+	}
+#endif
+	int queued = queue_job(from_me, job, deadline);
+	//an elastic pool may need another thread for it
+	if (!queued && MAY_GROW(from_me))
+		grow(from_me);
+	return queued;
+}
+
+//queue the job by the pool's mode, see submit
+static int queue_job(threadpool* from_me, const work_t *job, const struct timespec *deadline)
+{
+	work_t *dropped = NULL;
+	int room;
+	
+	//destructor started and raised the flag "dont accept" (checked again under the lock)
+	if(from_me->dont_accept == DONT_ACCEPT)
+		return -1;
 	
 	/* if the parameter "dispatch_to_here" is NULL, there's a need to exit the program.
 	That parameter is a pointer to function that was sent from the main (its a constant).
 	if it was NULL, it will stay NULL, there's no reason letting the main thread continue
 	running. (the threadpool was already allocated, start destruction procedure) */
-	if (!dispatch_to_here)
+	if (!job->routine)
 	{
 		printf("Dispatch function not assigned correctly\n");
 		destroy_threadpool(from_me);
+		return -1;
 	}
 	
-	//initializing the new work
-	work_t *new_work = (work_t*)calloc(1, sizeof(work_t));
+	//the ring mode stores the job in a slot, no allocation
+	if (from_me->sched == THREADPOOL_SCHED_RING)
+		return ring_dispatch(from_me, job, deadline);
+	
+	//the NUMA sub-pool a job from outside the pool goes to, its node comes from that slab
+	int own = current_worker && current_worker->pool == from_me;
+	int numa = from_me->numa && !own? numa_target(from_me, job) : -1;
+	
+	//initializing the new work, a node of the slab
+	work_t *new_work = node_from(from_me, job, numa);
 	if (!new_work) //if allocating memory was unsuccessful
 	{
 		perror("Allocating memory for the request failed\n");
-		return;
+		return -1;
 	}
 	
-	//init the work fields
-	new_work->routine = dispatch_to_here;
-	new_work->arg = arg;
-	new_work->next = NULL;
+	//the sharded mode picks a shard, qlock is only taken when the queue is full
+	if (from_me->sched == THREADPOOL_SCHED_SHARDED)
+		return shard_push(from_me, new_work, deadline);
+	
+	//work stealing mode has its own queues
+	if (from_me->sched == THREADPOOL_SCHED_WORK_STEALING)
+	{
+		//a job dispatched by one of our workers goes to its own deque
+		if (own)
+		{
+			if (from_me->queue_capacity && from_me->qsize >= from_me->queue_capacity)
+			{
+				lock_queue(from_me);
+				room = room_locked(from_me, deadline, &dropped);
+				pthread_mutex_unlock(&(from_me->qlock));
+				discard_list(from_me, dropped);
+				if (room)
+					return overflowed(from_me, new_work, room);
+			}
+			from_me->qsize++; //counted first, a thief that takes it right away doesn't see the queue negative
+			if (!deque_push(current_worker, new_work))
+			{
+				wake_workers(from_me, 1); //a parked worker will steal the job
+				return 0;
+			}
+			job_taken(from_me); //not pushed, the queue below counts it
+			if (from_me->numa) //the deque can't grow, our node's queue takes it
+				return numa_push(from_me, current_worker->numa, new_work, deadline);
+		}
+		if (numa >= 0)
+			return numa_push(from_me, numa, new_work, deadline);
+		return injection_push(from_me, new_work, deadline);
+	}
 	
 	//critical section - addind a job to the queue
-	pthread_mutex_lock(&(from_me->qlock));
+	lock_queue(from_me);
 	
 	//check again if destructor started flag is up
 	if(from_me->dont_accept == DONT_ACCEPT)
 	{	
-		free(new_work);
-		return;
+		pthread_mutex_unlock(&(from_me->qlock));
+		slab_free(from_me, new_work);
+		return -1;
 	}
-	//add the job to the queue
-	if (!from_me->qsize)//the list is empty
+	//a bounded queue that is full, apply the overflow policy
+	room = room_locked(from_me, deadline, &dropped);
+	if (room)
 	{
-		from_me->qhead = new_work;
-		from_me->qtail = new_work;
+		pthread_mutex_unlock(&(from_me->qlock));
+		discard_list(from_me, dropped);
+		return overflowed(from_me, new_work, room);
+	}
+	//add the job to the queue
+	if (from_me->sched == THREADPOOL_SCHED_PRIORITY) //to the heap of its priority class
+	{
+		if (prio_push_locked(from_me, new_work) < 0)
+		{
+			pthread_mutex_unlock(&(from_me->qlock));
+			discard_list(from_me, dropped);
+			perror("Allocating memory for the request failed\n");
+			slab_free(from_me, new_work);
+			return -1;
+		}
+	}
+	else if (!from_me->qsize)//the list is empty
+	{
+		from_me->qhead = new_work;
+		from_me->qtail = new_work;
 	}
 	else//add to the queue at the end of the queue (FIFO) 
 	{
@@ -153,10 +1450,740 @@ void dispatch(threadpool* from_me, dispatch_fn dispatch_to_here, void *arg)
 		from_me->qtail = from_me->qtail->next;
 	}
 	from_me->qsize++; //increase the size of the queue
-	//signal the threads that the queue is not empty, one one them will take it
-	pthread_cond_signal(&(from_me->q_not_empty));
+	//signal the threads that the queue is not empty, one one them will take it (spinning workers see qsize)
+	if (from_me->idle_waiters)
+		pthread_cond_signal(&(from_me->q_not_empty));
 	//end of critical section, give back the lock
 	pthread_mutex_unlock(&(from_me->qlock));
+	discard_list(from_me, dropped);
+	return 0;
+}
+
+//what a producer does about a full queue, by the policy and who the producer is
+static int overflow_action(threadpool *pool, const struct timespec *deadline)
+{
+	//our own workers never wait for room, nobody might be left to make it
+	int own = current_worker && current_worker->pool == pool;
+	if (deadline) //try_dispatch
+		return own? OVERFLOW_REJECT : OVERFLOW_WAIT;
+	switch (pool->overflow)
+	{
+		case THREADPOOL_OVERFLOW_FAIL:
+			return OVERFLOW_REJECT;
+		case THREADPOOL_OVERFLOW_CALLER_RUNS:
+			return OVERFLOW_RUN;
+		case THREADPOOL_OVERFLOW_DISCARD_OLDEST:
+			return OVERFLOW_DISCARD;
+		default:
+			return own? OVERFLOW_RUN : OVERFLOW_WAIT;
+	}
+}
+
+/* make room in a full bounded queue, qlock is held (and released while
+waiting). dropped jobs are chained on *dropped for the caller to discard
+after unlocking. returns 0 when there's room, OVERFLOW_RUN if the caller
+runs the job itself and OVERFLOW_REJECT if the job is rejected */
+static int room_locked(threadpool *pool, const struct timespec *deadline, work_t **dropped)
+{
+	while (pool->queue_capacity && pool->qsize >= pool->queue_capacity)
+	{
+		switch (overflow_action(pool, deadline))
+		{
+			case OVERFLOW_REJECT:
+				return OVERFLOW_REJECT;
+			case OVERFLOW_RUN:
+				return OVERFLOW_RUN;
+			case OVERFLOW_DISCARD:
+			{
+				work_t *oldest = take_oldest_locked(pool);
+				if (!oldest) //everything queued is on its way to a worker
+					return 0;
+				oldest->next = *dropped;
+				*dropped = oldest;
+				break;
+			}
+			default: //wait for a worker to take a job
+			{
+				int timed_out = 0;
+				pool->full_waiters++;
+				if (deadline)
+					timed_out = pthread_cond_timedwait(&(pool->q_not_full), &(pool->qlock), deadline);
+				else
+					pthread_cond_wait(&(pool->q_not_full), &(pool->qlock));
+				pool->full_waiters--;
+				if (pool->dont_accept)
+					return OVERFLOW_REJECT;
+				if (timed_out && pool->qsize >= pool->queue_capacity)
+					return OVERFLOW_REJECT;
+			}
+		}
+	}
+	return 0;
+}
+
+//remove the oldest queued job, qlock is held. NULL if there is none to take
+static work_t* take_oldest_locked(threadpool *pool)
+{
+	int i, retry;
+	work_t *oldest = pool->qhead;
+	if (pool->sched == THREADPOOL_SCHED_PRIORITY)
+		oldest = prio_take_oldest_locked(pool);
+	else if (oldest)
+	{
+		pool->qhead = oldest->next;
+		if (!pool->qhead)
+			pool->qtail = NULL;
+		if (pool->sched == THREADPOOL_SCHED_WORK_STEALING)
+			pool->inject_size--;
+	}
+	else if (pool->sched == THREADPOOL_SCHED_WORK_STEALING)
+	{
+		//the injection queues of the NUMA sub-pools hold the jobs from outside
+		for (i = 0; i < pool->num_numa && !oldest; i++)
+		{
+			threadpool_numa *numa = &(pool->numa[i]);
+			pthread_mutex_lock(&(numa->lock));
+			oldest = numa->head;
+			if (oldest)
+			{
+				numa->head = oldest->next;
+				if (!numa->head)
+					numa->tail = NULL;
+				numa->size--;
+			}
+			pthread_mutex_unlock(&(numa->lock));
+		}
+		//the oldest jobs of a deque are on its top, where thieves take from
+		while (!oldest)
+		{
+			retry = 0;
+			for (i = 0; i < pool->num_slots && !oldest; i++)
+				oldest = deque_steal(&(pool->workers[i]), &retry);
+			if (!retry)
+				break;
+		}
+	}
+	else if (pool->sched == THREADPOOL_SCHED_SHARDED)
+	{
+		//the first job of a shard is the oldest there
+		for (i = 0; i < pool->num_shards && !oldest; i++)
+		{
+			queue_shard *shard = &(pool->shards[i]);
+			pthread_mutex_lock(&(shard->lock));
+			oldest = shard->head;
+			if (oldest)
+			{
+				shard->head = oldest->next;
+				if (!shard->head)
+					shard->tail = NULL;
+				shard->size--;
+			}
+			pthread_mutex_unlock(&(shard->lock));
+		}
+	}
+	if (oldest)
+		pool->qsize--;
+	return oldest;
+}
+
+//finish a job that didn't go into the queue, "room" is what room_locked said
+static int overflowed(threadpool *pool, work_t *work, int room)
+{
+	if (room == OVERFLOW_RUN)
+	{
+		pool->caller_runs++;
+		run_work(pool, work);
+		slab_free(pool, work);
+		return 0;
+	}
+	pool->rejected++;
+	slab_free(pool, work);
+	return -1;
+}
+
+//a queued job that will never run, the discard handler gets a chance to clean up
+static void discard_work(threadpool *pool, work_t *work)
+{
+	//a group's ticket isn't a job, the job it would have started is dropped
+	if (work->routine == group_run)
+	{
+		group_drop(pool, NULL);
+		return;
+	}
+	//a fiber that started can't be dropped, it's run to the end here
+	if (work->routine == fiber_run)
+	{
+		fiber_drop(pool, (fiber*)work->arg);
+		return;
+	}
+	pool->discarded++;
+	//the helper of a parallel loop only holds a reference, the caller runs its share
+	if (work->routine == parallel_helper)
+	{
+		parallel_put((parallel_loop*)work->arg);
+		return;
+	}
+	//a dropped task of a graph still releases the tasks waiting for it
+	if (work->routine == graph_task)
+	{
+		graph_task_done((threadpool_task_t*)work->arg, THREADPOOL_DISCARDED);
+		return;
+	}
+	//a dropped child of a fork/join scope still counts as finished
+	if (work->routine == join_child_run)
+	{
+		join_child *child = (join_child*)WORK_ARG(work);
+		if (pool->discard_handler)
+			pool->discard_handler(child->routine, child->arg);
+		join_done(child->join, THREADPOOL_DISCARDED);
+		join_put(child->join);
+		return;
+	}
+	//a dropped strand drops the jobs of its key
+	if (work->routine == strand_run)
+	{
+		discard_list(pool, strand_take_all((strand*)work->arg));
+		return;
+	}
+	if (pool->discard_handler)
+		pool->discard_handler(work->routine, WORK_ARG(work));
+	if (work->handle)
+		handle_complete(work->handle, THREADPOOL_DISCARDED);
+	if (work->token)
+		token_put(work->token);
+}
+
+//discard and free a chain of slab nodes
+static void discard_list(threadpool *pool, work_t *list)
+{
+	while (list)
+	{
+		work_t *next = list->next;
+		discard_work(pool, list);
+		slab_free(pool, list);
+		list = next;
+	}
+}
+
+/* a slab node holding a copy of "job", from the slab of NUMA sub-pool
+"numa" (-1 for the worker's or the pool's). NULL if there's no memory */
+static work_t* node_from(threadpool *pool, const work_t *job, int numa)
+{
+	work_t *node = slab_alloc(pool, numa);
+	if (node)
+	{
+		unsigned int flags = node->flags & ~WORK_CARRIED; //where the node goes back to
+		*node = *job;
+		node->next = NULL;
+		node->flags = flags | (job->flags & WORK_CARRIED);
+#ifndef THREADPOOL_NO_STATS
+		node->enqueued = threadpool_now_ns();
+#endif
+	}
+	return node;
+}
+
+/* run a job that was taken out of the queue. returns what the job
+returned, THREADPOOL_DISCARDED if it was dropped instead */
+static int run_work(threadpool *pool, work_t *work)
+{
+	//a job whose deadline passed while it was queued may be dropped
+	if (work->deadline && pool->discard_expired && threadpool_now_ns() > work->deadline)
+	{
+		pool->expired++;
+		discard_work(pool, work);
+		return THREADPOOL_DISCARDED;
+	}
+	//so is a job whose token was cancelled
+	if (work->token && work->token->cancelled)
+	{
+		pool->cancelled++;
+		discard_work(pool, work);
+		return THREADPOOL_DISCARDED;
+	}
+#ifndef THREADPOOL_NO_STATS
+	//the workers time their jobs, jobs the producers run inline aren't counted
+	threadpool_worker *me = current_worker && current_worker->pool == pool && !(work->flags & WORK_RELAY)? current_worker : NULL;
+	long long start = me? threadpool_now_ns() : 0;
+#endif
+	//what the job borrows from the scratch arena is taken back after it
+	threadpool_worker *self = current_worker;
+	size_t scratch_mark = self? self->scratch_used : 0;
+	TRACE(pool, TRACE_START, work);
+	if (work->flags & WORK_BLOCKING)
+		threadpool_blocking_begin();
+	int result = work->routine(WORK_ARG(work));
+	if (work->flags & WORK_BLOCKING)
+		threadpool_blocking_end();
+	TRACE(pool, TRACE_END, work);
+	if (self)
+		self->scratch_used = scratch_mark;
+#ifndef THREADPOOL_NO_STATS
+	if (me)
+	{
+		worker_stats *stats = &(me->stats);
+		long long end = threadpool_now_ns();
+		stat_add(&(stats->jobs), 1);
+		if (result < 0)
+			stat_add(&(stats->failed), 1);
+		stat_add(&(stats->busy_ns), end - start);
+		if (stats->last_end)
+			stat_add(&(stats->idle_ns), start - stats->last_end);
+		stats->last_end = end;
+		if (work->enqueued)
+			histogram_add(&(stats->queue_wait), start - work->enqueued);
+		histogram_add(&(stats->run_time), end - start);
+	}
+#endif
+	//the caller collects the result through the handle
+	if (work->handle)
+		handle_complete(work->handle, result);
+	else if (result < 0) //if failed, returns -1
+		printf("Processing the request failed\n");
+	if (work->token)
+		token_put(work->token);
+	return result;
+}
+
+//add a job to the strand of key
+int dispatch_keyed(threadpool* from_me, unsigned long key, dispatch_fn dispatch_to_here, void *arg)
+{
+	threadpool_strands *strands = from_me->strands;
+	strand *st;
+	if (!dispatch_to_here)
+	{
+		printf("Dispatch function not assigned correctly\n");
+		return -1;
+	}
+	if (from_me->dont_accept == DONT_ACCEPT)
+		return -1;
+	work_t job = { 0 };
+	job.routine = dispatch_to_here;
+	job.arg = arg;
+	job.priority = THREADPOOL_PRIO_NORMAL;
+	work_t *new_work = node_from(from_me, &job, -1);
+	if (!new_work)
+	{
+		perror("Allocating memory for the request failed\n");
+		return -1;
+	}
+	TRACE(from_me, TRACE_ENQUEUE, new_work);
+	
+	//the key's strand, if it has queued jobs
+	int bucket = (int)((key * 0x9E3779B97F4A7C15ULL) >> 32) & (STRAND_BUCKETS - 1);
+	strand_bucket *b = &(strands->buckets[bucket]);
+	pthread_mutex_lock(&(b->lock));
+	for (st = b->chain; st && st->key != key; st = st->next)
+		;
+	if (st) //its job will get to ours
+	{
+		//its job may have taken the last queued jobs and not seen the queue empty yet
+		if (st->tail)
+			st->tail->next = new_work;
+		else
+			st->head = new_work;
+		st->tail = new_work;
+		pthread_mutex_unlock(&(b->lock));
+		return 0;
+	}
+	
+	//the key is idle, it gets an entry and a job in the pool's queue
+	pthread_mutex_lock(&(strands->lock));
+	st = strands->free_list;
+	if (!st)
+	{
+		void **chunk = (void**)malloc(sizeof(void*) + STRAND_CHUNK * sizeof(strand));
+		if (chunk)
+		{
+			int i;
+			strand *entries = (strand*)(chunk + 1);
+			*chunk = strands->chunks;
+			strands->chunks = chunk;
+			for (i = 0; i < STRAND_CHUNK; i++)
+			{
+				entries[i].next = strands->free_list;
+				strands->free_list = &(entries[i]);
+			}
+			st = strands->free_list;
+		}
+	}
+	if (st)
+		strands->free_list = st->next;
+	pthread_mutex_unlock(&(strands->lock));
+	if (!st)
+	{
+		pthread_mutex_unlock(&(b->lock));
+		perror("Allocating memory for the strand failed\n");
+		slab_free(from_me, new_work);
+		return -1;
+	}
+	st->key = key;
+	st->head = st->tail = new_work;
+	st->strands = strands;
+	st->bucket = bucket;
+	st->next = b->chain;
+	b->chain = st;
+	pthread_mutex_unlock(&(b->lock));
+	
+	job.routine = strand_run;
+	job.arg = st;
+	job.flags = WORK_RELAY;
+	if (submit(from_me, &job, NULL) < 0)
+	{
+		//the queue won't take the strand, take our job back if nobody joined it
+		pthread_mutex_lock(&(b->lock));
+		if (st->head == new_work && !new_work->next)
+		{
+			strand_put(strands, st);
+			pthread_mutex_unlock(&(b->lock));
+			slab_free(from_me, new_work);
+			return -1;
+		}
+		pthread_mutex_unlock(&(b->lock));
+		//the jobs that joined were accepted, run the strand here
+		strand_run(st);
+	}
+	return 0;
+}
+
+//the task group "name" of the pool
+threadpool_group_t* threadpool_group_create(threadpool *pool, const char *name, int weight, int max_running)
+{
+	threadpool_groups *groups = pool->groups;
+	threadpool_group_t *group = NULL;
+	int i;
+	pthread_mutex_lock(&(groups->lock));
+	for (i = 0; i < groups->count && !group; i++)
+		if (!strncmp(groups->list[i]->name, name, THREADPOOL_GROUP_NAME - 1))
+			group = groups->list[i];
+	if (!group)
+	{
+		if (groups->count == groups->capacity)
+		{
+			int capacity = groups->capacity? groups->capacity * 2 : 8;
+			threadpool_group_t **list = (threadpool_group_t**)realloc(groups->list, capacity * sizeof(threadpool_group_t*));
+			if (!list)
+			{
+				pthread_mutex_unlock(&(groups->lock));
+				return NULL;
+			}
+			groups->list = list;
+			groups->capacity = capacity;
+		}
+		group = (threadpool_group_t*)calloc(1, sizeof(threadpool_group_t));
+		if (!group)
+		{
+			pthread_mutex_unlock(&(groups->lock));
+			return NULL;
+		}
+		strncpy(group->name, name, THREADPOOL_GROUP_NAME - 1);
+		group->cost_ns = GROUP_FIRST_COST_NS;
+		group->groups = groups;
+		groups->list[groups->count++] = group;
+	}
+	group->weight = weight < 1? 1 : weight;
+	group->max_running = max_running < 0? 0 : max_running;
+	//a higher cap may let queued jobs start
+	int add = groups_refill_locked(groups);
+	pthread_mutex_unlock(&(groups->lock));
+	groups_submit(groups, add);
+	return group;
+}
+
+//add a job to the queue of a group
+int dispatch_group(threadpool_group_t *group, dispatch_fn dispatch_to_here, void *arg)
+{
+	threadpool_groups *groups = group->groups;
+	threadpool *pool = groups->pool;
+	if (!dispatch_to_here)
+	{
+		printf("Dispatch function not assigned correctly\n");
+		return -1;
+	}
+	if (pool->dont_accept == DONT_ACCEPT)
+		return -1;
+	work_t job = { 0 };
+	job.routine = dispatch_to_here;
+	job.arg = arg;
+	job.priority = THREADPOOL_PRIO_NORMAL;
+	work_t *new_work = node_from(pool, &job, -1);
+	if (!new_work)
+	{
+		perror("Allocating memory for the request failed\n");
+		return -1;
+	}
+	TRACE(pool, TRACE_ENQUEUE, new_work);
+	pthread_mutex_lock(&(groups->lock));
+	if (group->tail)
+		group->tail->next = new_work;
+	else
+		group->head = new_work;
+	group->tail = new_work;
+	group->queued++;
+	group->dispatched++;
+	int add = groups_refill_locked(groups);
+	pthread_mutex_unlock(&(groups->lock));
+	groups_submit(groups, add);
+	return 0;
+}
+
+//the counters of a group
+void threadpool_group_stats(threadpool_group_t *group, threadpool_group_stats_t *stats)
+{
+	threadpool_groups *groups = group->groups;
+	memset(stats, 0, sizeof(threadpool_group_stats_t));
+	pthread_mutex_lock(&(groups->lock));
+	memcpy(stats->name, group->name, THREADPOOL_GROUP_NAME);
+	stats->weight = group->weight;
+	stats->max_running = group->max_running;
+	stats->queued = group->queued;
+	stats->running = group->running;
+	stats->dispatched = group->dispatched;
+	stats->completed = group->completed;
+	stats->failed = group->failed;
+	stats->discarded = group->discarded;
+#ifndef THREADPOOL_NO_STATS
+	histogram_merge(&(stats->queue_wait), &(group->queue_wait));
+	histogram_merge(&(stats->run_time), &(group->run_time));
+#endif
+	pthread_mutex_unlock(&(groups->lock));
+}
+
+//add a job in delay_ms
+long long dispatch_after(threadpool* from_me, long delay_ms, dispatch_fn dispatch_to_here, void *arg)
+{
+	return timer_arm(from_me, delay_ms, 0, dispatch_to_here, arg);
+}
+
+//add a job in delay_ms and then every period_ms
+long long dispatch_every(threadpool* from_me, long delay_ms, long period_ms, dispatch_fn dispatch_to_here, void *arg)
+{
+	if (period_ms < 1)
+	{
+		printf("Illegal timer period requested\n");
+		return -1;
+	}
+	return timer_arm(from_me, delay_ms, period_ms, dispatch_to_here, arg);
+}
+
+//disarm a timer
+int threadpool_timer_cancel(threadpool* pool, long long timer)
+{
+	threadpool_timers *timers = pool->timers;
+	int cancelled = -1;
+	pthread_mutex_lock(&(timers->lock));
+	wheel_timer *t = timer_lookup(timers, timer);
+	if (t && t->slot)
+	{
+		wheel_unlink(t);
+		cancelled = 0;
+		//the timer thread frees a timer it's dispatching
+		if (!t->firing)
+			timer_free(timers, t);
+	}
+	pthread_mutex_unlock(&(timers->lock));
+	return cancelled;
+}
+
+//add n jobs at once
+int dispatch_batch(threadpool* from_me, dispatch_fn *dispatch_to_here, void **args, int n)
+{
+	int i, queued = 0, pushed = 0;
+	if (from_me->dont_accept == DONT_ACCEPT || n < 1)
+		return 0;
+	for (i = 0; i < n; i++)
+	{
+		if (!dispatch_to_here[i])
+		{
+			printf("Dispatch function not assigned correctly\n");
+			return 0;
+		}
+	}
+	
+	//the ring has no lock to share, every job takes its own ticket
+	if (from_me->sched == THREADPOOL_SCHED_RING)
+	{
+		work_t job = { 0 };
+		for (i = 0; i < n; i++)
+		{
+			job.routine = dispatch_to_here[i];
+			job.arg = args[i];
+			TRACE(from_me, TRACE_ENQUEUE, &job);
+			if (!ring_dispatch(from_me, &job, NULL))
+				queued++;
+		}
+		if (queued && MAY_GROW(from_me))
+			grow(from_me);
+		return queued;
+	}
+	
+	//a bounded queue applies the overflow policy to every job, the priority mode orders every job
+	if (from_me->queue_capacity || from_me->sched == THREADPOOL_SCHED_PRIORITY)
+	{
+		work_t job = { 0 };
+		for (i = 0; i < n; i++)
+		{
+			job.routine = dispatch_to_here[i];
+			job.arg = args[i];
+			if (!submit(from_me, &job, NULL))
+				queued++;
+		}
+		return queued;
+	}
+	
+	//build the chain outside the lock, a batch from outside goes to one NUMA sub-pool
+	work_t *head = NULL, *tail = NULL, job = { 0 };
+	int own = current_worker && current_worker->pool == from_me;
+	int numa = from_me->numa? (own? current_worker->numa : numa_target(from_me, &job)) : -1;
+	for (i = 0; i < n; i++)
+	{
+		job.routine = dispatch_to_here[i];
+		job.arg = args[i];
+		TRACE(from_me, TRACE_ENQUEUE, &job);
+		work_t *new_work = node_from(from_me, &job, own? -1 : numa);
+		if (!new_work)
+		{
+			perror("Allocating memory for the request failed\n");
+			break;
+		}
+		if (!head)
+			head = new_work;
+		else
+			tail->next = new_work;
+		tail = new_work;
+		queued++;
+	}
+	if (!head)
+		return 0;
+	
+	//a worker of a work stealing pool pushes the chain to its own deque
+	if (from_me->sched == THREADPOOL_SCHED_WORK_STEALING && own)
+	{
+		from_me->qsize += queued; //counted first, a thief that takes one right away doesn't see the queue negative
+		while (head)
+		{
+			work_t *next = head->next;
+			if (deque_push(current_worker, head) < 0)
+				break; //the deque can't grow, the rest goes to the injection queue
+			head = next;
+			pushed++;
+		}
+		wake_workers(from_me, pushed);
+		if (!head)
+		{
+			if (MAY_GROW(from_me))
+				grow(from_me);
+			return pushed;
+		}
+		//the queue below counts the rest again
+		for (i = pushed; i < queued; i++)
+			job_taken(from_me);
+	}
+	
+	int chained = queued - pushed;
+	for (tail = head; tail->next; tail = tail->next)
+		;
+	//so does a shard in the sharded mode
+	if (from_me->sched == THREADPOOL_SCHED_SHARDED)
+	{
+		from_me->qsize += chained;
+		shard_append(&(from_me->shards[shard_pick(from_me)]), head, tail, chained);
+		wake_workers(from_me, chained);
+		if (MAY_GROW(from_me))
+			grow(from_me);
+		return queued;
+	}
+	//the injection queue of the sub-pool takes the chain under its own lock
+	if (numa >= 0)
+	{
+		from_me->qsize += chained;
+		numa_append(&(from_me->numa[numa]), head, tail, chained);
+		wake_workers(from_me, chained);
+		if (MAY_GROW(from_me))
+			grow(from_me);
+		return queued;
+	}
+	
+	//critical section - one lock acquisition for the whole chain
+	lock_queue(from_me);
+	if (from_me->dont_accept == DONT_ACCEPT)
+	{
+		pthread_mutex_unlock(&(from_me->qlock));
+		while (head)
+		{
+			work_t *next = head->next;
+			slab_free(from_me, head);
+			head = next;
+		}
+		return pushed;
+	}
+	if (!from_me->qhead)
+		from_me->qhead = head;
+	else
+		from_me->qtail->next = head;
+	from_me->qtail = tail;
+	if (from_me->sched == THREADPOOL_SCHED_WORK_STEALING)
+		from_me->inject_size += chained;
+	from_me->qsize += chained;
+	//wake min(n, idle) workers
+	int wake = chained < from_me->idle_waiters? chained : from_me->idle_waiters;
+	for (i = 0; i < wake; i++)
+		pthread_cond_signal(&(from_me->q_not_empty));
+	pthread_mutex_unlock(&(from_me->qlock));
+	if (MAY_GROW(from_me))
+		grow(from_me);
+	return queued;
+}
+
+//the start routine of the pool threads, binds the worker to its thread
+static void* worker_main(void* p)
+{
+	threadpool_worker *worker = (threadpool_worker*)p;
+	current_worker = worker;
+	if (worker->pool->sched_policy != SCHED_OTHER && worker->pool->sched_policy != SCHED_FIFO
+		&& worker->pool->sched_policy != SCHED_RR)
+	{
+		struct sched_param param = { .sched_priority = worker->pool->sched_priority };
+		pthread_setschedparam(pthread_self(), worker->pool->sched_policy, &param);
+	}
+	void *status = do_work(worker->pool);
+	//the slot may get a new thread, give the cached nodes back to the slab
+	slab_flush_cache(worker->pool, worker);
+	return status;
+}
+
+//start the thread of worker slot i on the cpus place_workers chose, returns 0 on success
+static int start_worker(threadpool *pool, int i)
+{
+	threadpool_worker *worker = &(pool->workers[i]);
+	pthread_attr_t attr;
+	cpu_set_t cpus;
+	int failed;
+	if (pthread_attr_init(&attr))
+		return -1;
+	if (worker->cpu >= 0)
+	{
+		CPU_ZERO(&cpus);
+		CPU_SET(worker->cpu, &cpus);
+		pthread_attr_setaffinity_np(&attr, sizeof(cpu_set_t), &cpus);
+	}
+	else if (pool->numa)
+		pthread_attr_setaffinity_np(&attr, sizeof(cpu_set_t), &(pool->numa[worker->numa].cpus));
+	if (pool->stack_size)
+		pthread_attr_setstacksize(&attr, pool->stack_size);
+	if (pool->guard_size)
+		pthread_attr_setguardsize(&attr, pool->guard_size);
+	//the attr takes only the real time policies, the others are set by worker_main
+	if (pool->sched_policy == SCHED_FIFO || pool->sched_policy == SCHED_RR)
+	{
+		struct sched_param param = { .sched_priority = pool->sched_priority };
+		pthread_attr_setinheritsched(&attr, PTHREAD_EXPLICIT_SCHED);
+		pthread_attr_setschedpolicy(&attr, pool->sched_policy);
+		pthread_attr_setschedparam(&attr, &param);
+	}
+	failed = pthread_create(&(pool->threads[i]), &attr, worker_main, worker);
+	pthread_attr_destroy(&attr);
+	return failed;
 }
 
 //the threads function 
@@ -164,10 +2191,20 @@ void* do_work(void* p)
 {	
 	//casting before going to work
 	threadpool *thread_pool = (threadpool*)p;
+	if (thread_pool->sched == THREADPOOL_SCHED_WORK_STEALING)
+		return work_stealing_loop(thread_pool, current_worker);
+	if (thread_pool->sched == THREADPOOL_SCHED_RING)
+		return ring_loop(thread_pool);
+	if (thread_pool->sched == THREADPOOL_SCHED_SHARDED)
+		return sharded_loop(thread_pool, current_worker);
 	while (1)
 	{
+		//the idle policy, before taking the lock
+		if (!thread_pool->qsize)
+			idle_wait(thread_pool);
+		
 		//critical section - checking the object
-		pthread_mutex_lock(&(thread_pool->qlock));
+		lock_queue(thread_pool);
 		
 		//check if destructor has started
 		if(thread_pool->shutdown) 
@@ -178,72 +2215,3973 @@ void* do_work(void* p)
 		}
 		
 		//while the queue is empty
-		while (!thread_pool->qsize)
-		{		
-			/*all threads will wait for the condition to flip, and when it happens 
-			(the mutex is unlocked) only a single thread passes and lock the mutex */
-			pthread_cond_wait(&(thread_pool->q_not_empty),&(thread_pool->qlock));
-			if (thread_pool->shutdown) //check again if destructor has started
-			{
-				//return the lock before ending
+		if (!thread_pool->qsize)
+		{
+			//an elastic pool retires a thread idle for keep_alive
+			int elastic = (thread_pool->max_threads > thread_pool->min_threads || thread_pool->max_blocking) && current_worker;
+			//a stand-in isn't needed once the blocked workers are back
+			if (elastic && thread_pool->num_threads - thread_pool->blocked > thread_pool->max_threads
+				&& retire_locked(thread_pool))
+			{
 				pthread_mutex_unlock(&(thread_pool->qlock));
 				return NULL;
 			}
-		}	
-		//if a thread reached here he's about to take a job
-		thread_pool->qsize--; //decrease the queue size
-		work_t *temp = thread_pool->qhead; //pull the first job (FIFO)
-		if (!thread_pool->qsize) //if the queue is empty, initialize it again
-		{
-			thread_pool->qhead = NULL;
-			thread_pool->qtail = NULL;
-			//queue is empty, check again if the destructor wants to start
-			if (thread_pool->dont_accept) //signal the distructor
-				pthread_cond_signal(&(thread_pool->q_empty));
+			struct timespec idle_until;
+			if (elastic)
+			{
+				thread_pool->backlog_since = 0;
+				idle_until = idle_deadline(thread_pool);
+			}
+			while (!thread_pool->qsize)
+			{
+				/*all threads will wait for the condition to flip, and when it happens 
+				(the mutex is unlocked) only a single thread passes and lock the mutex */
+				int timed_out = 0;
+				thread_pool->idle_waiters++;
+				thread_pool->parks++;
+				if (elastic)
+					timed_out = pthread_cond_timedwait(&(thread_pool->q_not_empty),&(thread_pool->qlock), &idle_until);
+				else
+					pthread_cond_wait(&(thread_pool->q_not_empty),&(thread_pool->qlock));
+				thread_pool->idle_waiters--;
+				//check again if destructor has started, or if this thread isn't needed
+				if (thread_pool->shutdown || (timed_out && !thread_pool->qsize && retire_locked(thread_pool)))
+				{
+					//return the lock before ending
+					pthread_mutex_unlock(&(thread_pool->qlock));
+					return NULL;
+				}
+			}
 		}
-		else //advance the head to the next node
-			thread_pool->qhead = thread_pool->qhead->next;
+
+		//if a thread reached here he's about to take up to batch_size jobs
+		work_t *temp = queue_take_locked(thread_pool, thread_pool->batch_size);
 		//end of critival section, give the lock back
 		pthread_mutex_unlock(&(thread_pool->qlock));
+#ifndef THREADPOOL_NO_TRACE
+		work_t *last;
+		if (atomic_load_explicit(&(thread_pool->tracing), memory_order_relaxed))
+			for (last = temp; last; last = last->next)
+				trace_record(thread_pool, TRACE_DEQUEUE, last);
+#endif
 		
-		//doing the job 
-		if (temp->routine(temp->arg) < 0) //if failed, returns -1
-			printf("Processing the request failed\n");
-		free(temp);
+		//doing the jobs
+		while (temp)
+		{
+			work_t *next = temp->next;
+			run_work(thread_pool, temp);
+			slab_free(thread_pool, temp);
+			temp = next;
+		}
 	}
 	return NULL;
 }
 
+/* take up to "max" jobs off the queue of the FIFO mode (one, the most
+urgent, in the priority mode). qlock is held and the queue isn't empty,
+returns the chain */
+static work_t* queue_take_locked(threadpool *pool, int max)
+{
+	int take = pool->qsize < max? pool->qsize : max;
+	int i;
+	work_t *temp, *last;
+	if (pool->sched == THREADPOOL_SCHED_PRIORITY) //one job, the most urgent
+	{
+		temp = last = prio_pop_locked(pool);
+		take = 1;
+	}
+	else
+	{
+		temp = last = pool->qhead; //pull the first jobs (FIFO)
+		for (i = 1; i < take; i++)
+			last = last->next;
+		//advance the head past the jobs we took
+		pool->qhead = last->next;
+		if (!pool->qhead) //if the queue is empty, initialize it again
+			pool->qtail = NULL;
+	}
+	last->next = NULL;
+	pool->qsize -= take; //decrease the queue size
+	//producers wait for room in a bounded queue
+	for (i = 0; i < pool->full_waiters && i < take; i++)
+		pthread_cond_signal(&(pool->q_not_full));
+	//queue is empty, check again if the destructor wants to start
+	if (!pool->qsize && pool->dont_accept) //signal the distructor
+		pthread_cond_signal(&(pool->q_empty));
+	return temp;
+}
+
+/* run a queued job on a worker waiting in threadpool_join, the way its
+loop would take it. returns 0 if there was none */
+static int help_run(threadpool *pool)
+{
+	threadpool_worker *me = current_worker;
+	work_t *temp = NULL, job;
+	int i, retry = 0;
+	if (pool->sched == THREADPOOL_SCHED_RING)
+	{
+		if (!ring_pop(pool->ring, &job))
+			return 0;
+		job_taken(pool);
+		TRACE(pool, TRACE_DEQUEUE, &job);
+		run_work(pool, &job);
+		return 1;
+	}
+	if (pool->sched == THREADPOOL_SCHED_WORK_STEALING)
+	{
+		//the newest job of our own deque is likely a child we wait for
+		temp = deque_take(me);
+		if (!temp)
+			temp = injection_pop(pool, me);
+		if (!temp)
+			temp = steal_work(pool, me, &retry);
+	}
+	else if (pool->sched == THREADPOOL_SCHED_SHARDED)
+	{
+		int home = me->id % pool->num_shards;
+		for (i = 0; !temp && i < pool->num_shards; i++)
+			temp = shard_pop(pool, &(pool->shards[(home + i) % pool->num_shards]));
+	}
+	else if (pool->qsize)
+	{
+		lock_queue(pool);
+		if (pool->qsize)
+			temp = queue_take_locked(pool, 1);
+		pthread_mutex_unlock(&(pool->qlock));
+	}
+	if (!temp)
+		return 0;
+	//a shard hands out a chain, the FIFO and stealing modes take their share out of qsize already
+	while (temp)
+	{
+		work_t *next = temp->next;
+		if (pool->sched == THREADPOOL_SCHED_WORK_STEALING || pool->sched == THREADPOOL_SCHED_SHARDED)
+			job_taken(pool);
+		TRACE(pool, TRACE_DEQUEUE, temp);
+		run_work(pool, temp);
+		slab_free(pool, temp);
+		temp = next;
+	}
+	return 1;
+}
+
 //destroy the thread pool
 void destroy_threadpool(threadpool* destroyme)
 {
+	destroy_pool(destroyme, 0, NULL, NULL);
+}
+
+//destroy the thread pool without running the queued jobs
+int destroy_threadpool_now(threadpool* destroyme, work_t **pending)
+{
+	return destroy_pool(destroyme, 1, NULL, pending);
+}
+
+//destroy the thread pool, running the queued jobs for up to timeout_ms
+int destroy_threadpool_drain(threadpool* destroyme, long timeout_ms, work_t **pending)
+{
+	struct timespec deadline = deadline_after(timeout_ms);
+	return destroy_pool(destroyme, 1, &deadline, pending);
+}
+
+/* the destructors: with "drop" the jobs still queued at "deadline" (NULL
+for right away) are dropped to *pending or the discard handler, else the
+workers run them all. returns the number of jobs in *pending, or of the
+dropped jobs without "pending" */
+static int destroy_pool(threadpool* destroyme, int drop, const struct timespec *deadline, work_t **pending)
+{
+	dropped_jobs dropped = { NULL, 0, 0, pending != NULL };
+	work_t *work, *list = NULL, *last = NULL, job;
+	//no timer fires from now on, the armed ones are dropped
+	timers_stop(destroyme, &dropped);
+	//nor does a fiber wait once the fibers had their time, the suspended ones run to the end
+	fibers_stop(destroyme, drop, deadline);
 	//critical section - locking the mutex
-	pthread_mutex_lock(&(destroyme->qlock));
+	lock_queue(destroyme);
 	//raise don't accept new jobs flag
 	destroyme->dont_accept = DONT_ACCEPT;
-	//wait for the threads to finish all the jobs
-	while (destroyme->qsize)
-		pthread_cond_wait(&(destroyme->q_empty),&(destroyme->qlock));
-	//raise shutdown has began flag
-	destroyme->shutdown = DONT_ACCEPT;
-	//all the threads waiting in do_work wake up and see the shut downflag
-	pthread_cond_broadcast(&(destroyme->q_not_empty)); //tell them to continue
-	
+	//producers blocked on a full ring give up
+	pthread_cond_broadcast(&(destroyme->q_not_full));
+	if (drop)
+	{
+		//the workers run what they can until the deadline
+		int timed_out = 0;
+		while (deadline && destroyme->qsize && !timed_out)
+			timed_out = pthread_cond_timedwait(&(destroyme->q_empty), &(destroyme->qlock), deadline);
+		//a running strand stops taking its key's jobs too
+		destroyme->dropping = 1;
+		//take the rest out of the queues, the oldest first
+		while ((work = take_oldest_locked(destroyme)))
+		{
+			work->next = NULL;
+			if (last)
+				last->next = work;
+			else
+				list = work;
+			last = work;
+		}
+		pthread_mutex_unlock(&(destroyme->qlock));
+		while (list)
+		{
+			work = list;
+			list = list->next;
+			drop_job(destroyme, work, &dropped);
+			slab_free(destroyme, work);
+		}
+		//the ring has no lock, its jobs are popped like a worker does
+		while (destroyme->ring && ring_pop(destroyme->ring, &job))
+		{
+			destroyme->qsize--;
+			drop_job(destroyme, &job, &dropped);
+		}
+		//and the jobs of the groups that had no ticket, waiting for their cap
+		groups_drop(destroyme, &dropped);
+		lock_queue(destroyme);
+	}
+	//wait for the threads to finish all the jobs (the ones on their way to a worker when dropping)
+	while (destroyme->qsize)
+		pthread_cond_wait(&(destroyme->q_empty),&(destroyme->qlock));
+	//raise shutdown has began flag
+	destroyme->shutdown = DONT_ACCEPT;
+	//all the threads waiting in do_work wake up and see the shut downflag
+	pthread_cond_broadcast(&(destroyme->q_not_empty)); //tell them to continue
+	
 	//end of critical section, give the lock back
 	pthread_mutex_unlock(&(destroyme->qlock));
 	
 	/* this join loop will make the main thread wait for all the
 	threads that are still working, if there are any at all */
 	int i; void *status;
-	for (i = 0; i < destroyme->num_threads; i++)
-		pthread_join(destroyme->threads[i], &status);
+	for (i = 0; i < destroyme->num_slots; i++)
+		if (destroyme->workers[i].state != WORKER_UNUSED)
+			pthread_join(destroyme->threads[i], &status);
 	
 	//free the mutex, conditions and the object itself
 	pthread_mutex_destroy(&(destroyme->qlock));
 	pthread_cond_destroy(&(destroyme->q_empty));
 	pthread_cond_destroy(&(destroyme->q_not_empty));
+	pthread_cond_destroy(&(destroyme->q_not_full));
+	free_pool_state(destroyme);
 	free(destroyme->threads);
 	free(destroyme);
+	if (pending)
+	{
+		for (i = 0; i < dropped.count; i++)
+			if (dropped.jobs[i].flags & WORK_INLINE)
+				dropped.jobs[i].arg = dropped.jobs[i].payload;
+		*pending = dropped.jobs;
+	}
+	return dropped.count;
+}
+
+/* a job that was queued and will never run: to the caller's array of
+destroy_threadpool_now, or to the discard handler */
+static void drop_job(threadpool *pool, work_t *work, dropped_jobs *dropped)
+{
+	//a group's ticket isn't a job, the job it would have started is dropped
+	if (work->routine == group_run)
+	{
+		group_drop(pool, dropped);
+		return;
+	}
+	//a fiber that didn't start is dropped as its job
+	if (work->routine == fiber_run && !((fiber*)work->arg)->started)
+	{
+		fiber *f = (fiber*)work->arg;
+		work_t job = { 0 };
+		job.routine = f->routine;
+		job.arg = f->arg;
+		job.priority = THREADPOOL_PRIO_NORMAL;
+		fiber_free(pool->fibers, f);
+		drop_job(pool, &job, dropped);
+		return;
+	}
+	//the jobs queued on a strand are dropped one by one
+	if (work->routine == strand_run)
+	{
+		work_t *list = strand_take_all((strand*)work->arg);
+		while (list)
+		{
+			work_t *next = list->next;
+			drop_job(pool, list, dropped);
+			slab_free(pool, list);
+			list = next;
+		}
+		return;
+	}
+	//the jobs of the pool's own loops, graphs, fibers and fork/join scopes end through discard_work
+	if (dropped->collect && work->routine != parallel_helper && work->routine != graph_task
+		&& work->routine != fiber_run && work->routine != join_child_run)
+	{
+		if (dropped->count == dropped->capacity)
+		{
+			int capacity = dropped->capacity? dropped->capacity * 2 : 64;
+			work_t *jobs = (work_t*)realloc(dropped->jobs, capacity * sizeof(work_t));
+			if (jobs)
+			{
+				dropped->jobs = jobs;
+				dropped->capacity = capacity;
+			}
+		}
+		if (dropped->count < dropped->capacity)
+		{
+			work_t *copy = &(dropped->jobs[dropped->count++]);
+			memset(copy, 0, sizeof(work_t));
+			copy->routine = work->routine;
+			copy->arg = work->arg;
+			if (work->flags & WORK_INLINE) //arg is set when the array stops moving
+			{
+				copy->flags = WORK_INLINE;
+				memcpy(copy->payload, work->payload, THREADPOOL_INLINE_ARG);
+			}
+			copy->priority = work->priority;
+			copy->deadline = work->deadline;
+			//the caller cleans it up instead of the discard handler
+			pool->discarded++;
+			if (work->handle)
+				handle_complete(work->handle, THREADPOOL_DISCARDED);
+			if (work->token)
+				token_put(work->token);
+			return;
+		}
+		perror("Allocating memory for the dropped jobs failed\n");
+	}
+	else if (!dropped->collect)
+		dropped->count++;
+	discard_work(pool, work);
+}
+
+//the worker loop of the work stealing mode
+static void* work_stealing_loop(threadpool *thread_pool, threadpool_worker *me)
+{
+	int retry;
+	work_t *temp;
+	while (1)
+	{
+		//first our own deque (LIFO, the cache is still hot), then the injection queue
+		temp = deque_take(me);
+		if (!temp)
+			temp = injection_pop(thread_pool, me);
+		//then steal from the peers
+		retry = 0;
+		if (!temp)
+			temp = steal_work(thread_pool, me, &retry);
+		
+		if (temp)
+		{
+			job_taken(thread_pool);
+			TRACE(thread_pool, TRACE_DEQUEUE, temp);
+			//doing the job 
+			run_work(thread_pool, temp);
+			slab_free(thread_pool, temp);
+			continue;
+		}
+		
+		//lost a race with another thief or a job is on its way, look again
+		if (retry || thread_pool->qsize)
+		{
+			sched_yield();
+			continue;
+		}
+		
+		//nothing to do, spin and park until a job arrives or the pool shuts down
+		if (!idle_wait(thread_pool) && park_worker(thread_pool))
+			return NULL;
+	}
+	return NULL;
+}
+
+//the worker loop of the ring mode, qlock is only taken to park
+static void* ring_loop(threadpool *thread_pool)
+{
+	work_t job;
+	while (1)
+	{
+		if (ring_pop(thread_pool->ring, &job))
+		{
+			job_taken(thread_pool);
+			TRACE(thread_pool, TRACE_DEQUEUE, &job);
+			//doing the job 
+			run_work(thread_pool, &job);
+			continue;
+		}
+		//a producer took a ticket but didn't publish the slot yet
+		if (thread_pool->qsize)
+		{
+			sched_yield();
+			continue;
+		}
+		if (!idle_wait(thread_pool) && park_worker(thread_pool))
+			return NULL;
+	}
+	return NULL;
+}
+
+//the worker loop of the sharded mode, the home shard first and then the others
+static void* sharded_loop(threadpool *thread_pool, threadpool_worker *me)
+{
+	int i, home = me->id % thread_pool->num_shards;
+	work_t *temp;
+	while (1)
+	{
+		temp = shard_pop(thread_pool, &(thread_pool->shards[home]));
+		for (i = 1; !temp && i < thread_pool->num_shards; i++)
+			temp = shard_pop(thread_pool, &(thread_pool->shards[(home + i) % thread_pool->num_shards]));
+		
+		if (temp)
+		{
+#ifndef THREADPOOL_NO_TRACE
+			work_t *last;
+			if (atomic_load_explicit(&(thread_pool->tracing), memory_order_relaxed))
+				for (last = temp; last; last = last->next)
+					trace_record(thread_pool, TRACE_DEQUEUE, last);
+#endif
+			//doing the jobs
+			while (temp)
+			{
+				work_t *next = temp->next;
+				job_taken(thread_pool);
+				run_work(thread_pool, temp);
+				slab_free(thread_pool, temp);
+				temp = next;
+			}
+			continue;
+		}
+		
+		//a job is on its way to a shard we already looked at
+		if (thread_pool->qsize)
+		{
+			sched_yield();
+			continue;
+		}
+		if (!idle_wait(thread_pool) && park_worker(thread_pool))
+			return NULL;
+	}
+	return NULL;
+}
+
+/* producers call it after counting n new jobs in qsize, it wakes up to n
+parked workers. the idle_waiters check is ordered after the qsize increment
+and park_worker does the opposite, so either the parked worker sees the job
+or we see the worker and signal */
+static void wake_workers(threadpool *pool, int n)
+{
+	if (n > 0 && pool->idle_waiters)
+	{
+		lock_queue(pool);
+		int wake = n < pool->idle_waiters? n : pool->idle_waiters;
+		while (wake-- > 0)
+			pthread_cond_signal(&(pool->q_not_empty));
+		pthread_mutex_unlock(&(pool->qlock));
+	}
+}
+
+//workers call it after taking a job out of the lock free queues
+static void job_taken(threadpool *pool)
+{
+	int left = atomic_fetch_sub(&(pool->qsize), 1) - 1;
+	//a producer waits for room in a bounded queue
+	if (pool->full_waiters)
+	{
+		lock_queue(pool);
+		pthread_cond_signal(&(pool->q_not_full));
+		pthread_mutex_unlock(&(pool->qlock));
+	}
+	//the job left the queues, the destructor waits for the last one
+	if (!left && pool->dont_accept)
+	{
+		lock_queue(pool);
+		pthread_cond_signal(&(pool->q_empty));
+		pthread_mutex_unlock(&(pool->qlock));
+	}
+}
+
+/* park an idle worker until qsize is positive, returns 1 if the worker
+should exit: the pool shuts down or an elastic pool retires it */
+static int park_worker(threadpool *pool)
+{
+	int done, timed_out = 0;
+	int elastic = (pool->max_threads > pool->min_threads || pool->max_blocking) && current_worker;
+	struct timespec idle_until;
+	lock_queue(pool);
+	//a stand-in isn't needed once the blocked workers are back
+	if (elastic && pool->num_threads - pool->blocked > pool->max_threads && !pool->qsize && retire_locked(pool))
+	{
+		pthread_mutex_unlock(&(pool->qlock));
+		return 1;
+	}
+	if (elastic)
+	{
+		pool->backlog_since = 0;
+		idle_until = idle_deadline(pool);
+	}
+	pool->idle_waiters++;
+	pool->parks++;
+	while (!pool->qsize && !pool->shutdown && !timed_out)
+	{
+		if (elastic)
+			timed_out = pthread_cond_timedwait(&(pool->q_not_empty), &(pool->qlock), &idle_until);
+		else
+			pthread_cond_wait(&(pool->q_not_empty), &(pool->qlock));
+	}
+	pool->idle_waiters--;
+	done = pool->shutdown && !pool->qsize;
+	if (!done && timed_out && !pool->qsize)
+		done = retire_locked(pool);
+	pthread_mutex_unlock(&(pool->qlock));
+	return done;
+}
+
+/* the idle policy of a worker that found no job: check qsize idle_spin
+times with a cpu pause in between, then idle_yield times giving the cpu
+away. returns 1 if a job showed up, 0 if the worker should park (the
+pool shutting down ends the wait too, parking tells the worker to exit).
+a spinning worker isn't counted in idle_waiters, so producers don't pay
+for a wakeup it doesn't need */
+static int idle_wait(threadpool *pool)
+{
+	int i;
+	for (i = 0; i < pool->idle_spin && !pool->shutdown; i++)
+	{
+		if (pool->qsize)
+			return 1;
+		CPU_RELAX();
+	}
+	for (i = 0; i < pool->idle_yield && !pool->shutdown; i++)
+	{
+		if (pool->qsize)
+			return 1;
+		sched_yield();
+	}
+	return pool->qsize != 0;
+}
+
+/* called after a dispatch of an elastic pool, spawns a thread when jobs
+wait with no idle worker and either spawn_depth of them are queued or they
+waited spawn_wait. a blocked worker raises the cap by a stand-in, which is
+spawned at once while the unblocked threads are below min_threads. the
+checks before taking qlock keep it cheap */
+static void grow(threadpool *pool)
+{
+	int blocked = pool->blocked;
+	int cap = pool->max_threads + (blocked < pool->max_blocking? blocked : pool->max_blocking);
+	if (pool->num_threads >= cap || pool->idle_waiters || !pool->qsize)
+		return;
+	if (pool->num_threads - blocked >= pool->min_threads && pool->qsize < pool->spawn_depth)
+	{
+		//the backlog clock starts when a producer first sees it
+		long long since = pool->backlog_since, now = threadpool_now_ns();
+		if (!since)
+		{
+			atomic_compare_exchange_strong(&(pool->backlog_since), &since, now);
+			if (pool->spawn_wait_ns)
+				return;
+		}
+		else if (now - since < pool->spawn_wait_ns)
+			return;
+	}
+	lock_queue(pool);
+	if (!pool->dont_accept && !pool->idle_waiters && pool->num_threads < cap && !spawn_locked(pool))
+		pool->backlog_since = threadpool_now_ns(); //the next spawn waits for the new thread to fall behind too
+	pthread_mutex_unlock(&(pool->qlock));
+}
+
+/* start a thread in a free slot, qlock is held. a retired thread is joined
+first, it doesn't need qlock to finish. returns 0 on success */
+static int spawn_locked(threadpool *pool)
+{
+	int i;
+	void *status;
+	for (i = 0; i < pool->num_slots; i++)
+		if (pool->workers[i].state != WORKER_RUNNING)
+			break;
+	if (i == pool->num_slots)
+		return -1;
+	threadpool_worker *worker = &(pool->workers[i]);
+	if (worker->state == WORKER_EXITED)
+	{
+		pthread_join(pool->threads[i], &status);
+		worker->state = WORKER_UNUSED;
+	}
+	//the deque of the slot is empty and keeps its ring, thieves may still read it
+	if (start_worker(pool, i))
+	{
+		perror("Thread initializing failed\n");
+		return -1;
+	}
+	worker->state = WORKER_RUNNING;
+	pool->num_threads++;
+	pool->spawned++;
+	if (pool->num_threads > pool->peak_threads)
+		pool->peak_threads = pool->num_threads;
+	return 0;
+}
+
+/* the worker of this thread idled for keep_alive, qlock is held. returns
+1 if it retires, 0 if the pool is at min_threads or shutting down */
+static int retire_locked(threadpool *pool)
+{
+	if (pool->shutdown || pool->num_threads <= pool->min_threads)
+		return 0;
+	pool->num_threads--;
+	pool->retired++;
+	current_worker->state = WORKER_EXITED;
+	return 1;
+}
+
+//keep_alive from now, on the clock of q_not_empty
+static struct timespec idle_deadline(threadpool *pool)
+{
+	struct timespec until;
+	clock_gettime(CLOCK_REALTIME, &until);
+	until.tv_sec += pool->keep_alive_ns / 1000000000LL;
+	until.tv_nsec += pool->keep_alive_ns % 1000000000LL;
+	if (until.tv_nsec >= 1000000000)
+	{
+		until.tv_sec++;
+		until.tv_nsec -= 1000000000;
+	}
+	return until;
+}
+
+//allocate a ring of at least "capacity" slots (rounded up to a power of two)
+static threadpool_ring* ring_create(size_t capacity)
+{
+	size_t size = 2, i;
+	while (size < capacity)
+		size <<= 1;
+	threadpool_ring *ring = (threadpool_ring*)aligned_alloc(CACHE_LINE,
+		sizeof(threadpool_ring) + size * sizeof(ring_slot));
+	if (!ring)
+		return NULL;
+	atomic_init(&(ring->enqueue_pos), 0);
+	atomic_init(&(ring->dequeue_pos), 0);
+	ring->mask = size - 1;
+	for (i = 0; i < size; i++)
+		atomic_init(&(ring->slots[i].seq), i);
+	return ring;
+}
+
+//store a copy of the job in the ring, returns 0 if the ring is full
+static int ring_push(threadpool_ring *ring, const work_t *job)
+{
+	ring_slot *slot;
+	size_t pos = atomic_load_explicit(&(ring->enqueue_pos), memory_order_relaxed);
+	while (1)
+	{
+		slot = &(ring->slots[pos & ring->mask]);
+		size_t seq = atomic_load_explicit(&(slot->seq), memory_order_acquire);
+		long dif = (long)seq - (long)pos;
+		if (!dif) //the slot is free, take the ticket
+		{
+			if (atomic_compare_exchange_weak_explicit(&(ring->enqueue_pos), &pos, pos + 1,
+				memory_order_relaxed, memory_order_relaxed))
+				break;
+		}
+		else if (dif < 0) //the consumer of the previous lap didn't free it yet
+			return 0;
+		else //another producer took this ticket
+			pos = atomic_load_explicit(&(ring->enqueue_pos), memory_order_relaxed);
+	}
+	slot->work = *job;
+	slot->work.next = NULL;
+#ifndef THREADPOOL_NO_STATS
+	slot->work.enqueued = threadpool_now_ns();
+#endif
+	atomic_store_explicit(&(slot->seq), pos + 1, memory_order_release);
+	return 1;
+}
+
+//copy the oldest job of the ring into "job", returns 0 if the ring is empty
+static int ring_pop(threadpool_ring *ring, work_t *job)
+{
+	ring_slot *slot;
+	size_t pos = atomic_load_explicit(&(ring->dequeue_pos), memory_order_relaxed);
+	while (1)
+	{
+		slot = &(ring->slots[pos & ring->mask]);
+		size_t seq = atomic_load_explicit(&(slot->seq), memory_order_acquire);
+		long dif = (long)seq - (long)(pos + 1);
+		if (!dif) //the slot is published, take the ticket
+		{
+			if (atomic_compare_exchange_weak_explicit(&(ring->dequeue_pos), &pos, pos + 1,
+				memory_order_relaxed, memory_order_relaxed))
+				break;
+		}
+		else if (dif < 0) //nothing published yet
+			return 0;
+		else //another consumer took this ticket
+			pos = atomic_load_explicit(&(ring->dequeue_pos), memory_order_relaxed);
+	}
+	*job = slot->work;
+	//free the slot for the producer of the next lap
+	atomic_store_explicit(&(slot->seq), pos + ring->mask + 1, memory_order_release);
+	return 1;
+}
+
+/* add a job to the ring. a full ring is handled by the overflow policy,
+or waited on until "deadline" for try_dispatch. -1 if the job wasn't queued */
+static int ring_dispatch(threadpool *pool, const work_t *job, const struct timespec *deadline)
+{
+	work_t oldest;
+	for (;;)
+	{
+		pool->qsize++; //counted first, a worker that takes it right away doesn't see the queue negative
+		if (ring_push(pool->ring, job))
+			break;
+		job_taken(pool); //not queued after all, the destructor may be waiting for this count
+		switch (overflow_action(pool, deadline))
+		{
+			case OVERFLOW_REJECT:
+				pool->rejected++;
+				return -1;
+			case OVERFLOW_RUN:
+			{
+				work_t copy = *job;
+				pool->caller_runs++;
+				run_work(pool, &copy);
+				return 0;
+			}
+			case OVERFLOW_DISCARD:
+				if (ring_pop(pool->ring, &oldest))
+				{
+					job_taken(pool);
+					discard_work(pool, &oldest);
+				}
+				break;
+			default: //full, wait for a worker to take a job (job_taken signals q_not_full)
+			{
+				int timed_out = 0;
+				lock_queue(pool);
+				pool->full_waiters++;
+				while (pool->qsize >= pool->queue_capacity && !pool->dont_accept && !timed_out)
+				{
+					if (deadline)
+						timed_out = pthread_cond_timedwait(&(pool->q_not_full), &(pool->qlock), deadline);
+					else
+						pthread_cond_wait(&(pool->q_not_full), &(pool->qlock));
+				}
+				pool->full_waiters--;
+				pthread_mutex_unlock(&(pool->qlock));
+				if (pool->dont_accept || timed_out)
+				{
+					pool->rejected++;
+					return -1;
+				}
+			}
+		}
+	}
+	wake_workers(pool, 1);
+	return 0;
+}
+
+/* add a job from outside the pool to the injection queue, a full bounded
+queue is handled like in submit. -1 if the job wasn't queued */
+static int injection_push(threadpool *pool, work_t *work, const struct timespec *deadline)
+{
+	work_t *dropped = NULL;
+	lock_queue(pool);
+	if (pool->dont_accept == DONT_ACCEPT)
+	{
+		pthread_mutex_unlock(&(pool->qlock));
+		slab_free(pool, work);
+		return -1;
+	}
+	int room = room_locked(pool, deadline, &dropped);
+	if (room)
+	{
+		pthread_mutex_unlock(&(pool->qlock));
+		discard_list(pool, dropped);
+		return overflowed(pool, work, room);
+	}
+	if (!pool->qhead)
+		pool->qhead = work;
+	else
+		pool->qtail->next = work;
+	pool->qtail = work;
+	pool->inject_size++;
+	pool->qsize++;
+	if (pool->idle_waiters)
+		pthread_cond_signal(&(pool->q_not_empty));
+	pthread_mutex_unlock(&(pool->qlock));
+	discard_list(pool, dropped);
+	return 0;
+}
+
+/* take the first job of the injection queue, NULL if it is empty. a share
+of the jobs behind it is moved to our deque in the same critical section,
+so a burst from outside costs one lock trip per batch and the rest of the
+workers can steal from us */
+static work_t* injection_pop(threadpool *pool, threadpool_worker *me)
+{
+	if (pool->numa)
+		return numa_pop(pool, &(pool->numa[me->numa]), me);
+	//unlocked peek, a job we miss here is found by the qsize check of the loop
+	if (!pool->inject_size)
+		return NULL;
+	lock_queue(pool);
+	work_t *work = pool->qhead;
+	if (work)
+	{
+		int batch = pool->inject_size / pool->num_threads;
+		if (batch > INJECTION_BATCH)
+			batch = INJECTION_BATCH;
+		pool->qhead = work->next;
+		pool->inject_size--;
+		while (batch-- > 0 && pool->qhead)
+		{
+			work_t *next = pool->qhead;
+			if (deque_push(me, next) < 0)
+				break;
+			pool->qhead = next->next;
+			pool->inject_size--;
+		}
+		if (!pool->qhead)
+			pool->qtail = NULL;
+	}
+	pthread_mutex_unlock(&(pool->qlock));
+	return work;
+}
+
+/* look for a job of another worker, starting from a random peer. with NUMA
+sub-pools the peers of our node go first, then the injection queues of the
+other nodes, then their workers. retired slots have empty deques, they're
+skipped quickly */
+static work_t* steal_work(threadpool *pool, threadpool_worker *me, int *retry)
+{
+	int i, pass, passes = pool->numa? 2 : 1;
+	work_t *work = NULL;
+	me->seed = me->seed * 1103515245u + 12345u;
+	int start = (me->seed >> 16) % pool->num_slots;
+	for (pass = 0; pass < passes && !work; pass++)
+	{
+		for (i = 0; i < pool->num_slots && !work; i++)
+		{
+			threadpool_worker *victim = &(pool->workers[(start + i) % pool->num_slots]);
+			int remote = victim->numa != me->numa;
+			if (victim != me && remote == pass)
+				work = deque_steal(victim, retry);
+		}
+		for (i = 0; !pass && i < pool->num_numa && !work; i++)
+			if (i != me->numa)
+				work = numa_pop(pool, &(pool->numa[i]), me);
+	}
+	return work;
+}
+
+/* queue a job from outside the pool on the injection queue of NUMA
+sub-pool "numa". only a full bounded queue takes qlock */
+static int numa_push(threadpool *pool, int numa, work_t *work, const struct timespec *deadline)
+{
+	if (pool->queue_capacity && pool->qsize >= pool->queue_capacity)
+	{
+		work_t *dropped = NULL;
+		lock_queue(pool);
+		int room = room_locked(pool, deadline, &dropped);
+		pthread_mutex_unlock(&(pool->qlock));
+		discard_list(pool, dropped);
+		if (room)
+			return overflowed(pool, work, room);
+	}
+	pool->qsize++; //counted first, like in shard_push
+	numa_append(&(pool->numa[numa]), work, work, 1);
+	wake_workers(pool, 1);
+	return 0;
+}
+
+//link a chain of n jobs at the end of the injection queue of a NUMA sub-pool
+static void numa_append(threadpool_numa *numa, work_t *head, work_t *tail, int n)
+{
+	tail->next = NULL;
+	pthread_mutex_lock(&(numa->lock));
+	if (!numa->head)
+		numa->head = head;
+	else
+		numa->tail->next = head;
+	numa->tail = tail;
+	numa->size += n;
+	pthread_mutex_unlock(&(numa->lock));
+}
+
+//injection_pop on the queue of a NUMA sub-pool, the batch goes to our deque
+static work_t* numa_pop(threadpool *pool, threadpool_numa *numa, threadpool_worker *me)
+{
+	if (!numa->size)
+		return NULL;
+	pthread_mutex_lock(&(numa->lock));
+	work_t *work = numa->head;
+	if (work)
+	{
+		int batch = numa->size / pool->num_threads;
+		if (batch > INJECTION_BATCH)
+			batch = INJECTION_BATCH;
+		numa->head = work->next;
+		numa->size--;
+		while (batch-- > 0 && numa->head)
+		{
+			work_t *next = numa->head;
+			if (deque_push(me, next) < 0)
+				break;
+			numa->head = next->next;
+			numa->size--;
+		}
+		if (!numa->head)
+			numa->tail = NULL;
+	}
+	pthread_mutex_unlock(&(numa->lock));
+	return work;
+}
+
+//the NUMA sub-pool of a job from outside the pool: the one dispatch_on_node chose, or the next in turn
+static int numa_target(threadpool *pool, const work_t *job)
+{
+	int numa = WORK_NUMA(job);
+	if (numa >= 0 && numa < pool->num_numa)
+		return numa;
+	return numa_turn++ % pool->num_numa;
+}
+
+/* queue a job on the shorter of two random shards. only a full bounded
+queue takes qlock */
+static int shard_push(threadpool *pool, work_t *work, const struct timespec *deadline)
+{
+	if (pool->queue_capacity && pool->qsize >= pool->queue_capacity)
+	{
+		work_t *dropped = NULL;
+		lock_queue(pool);
+		int room = room_locked(pool, deadline, &dropped);
+		pthread_mutex_unlock(&(pool->qlock));
+		discard_list(pool, dropped);
+		if (room)
+			return overflowed(pool, work, room);
+	}
+	pool->qsize++; //counted first, a worker that takes it right away doesn't see the queue negative
+	shard_append(&(pool->shards[shard_pick(pool)]), work, work, 1);
+	wake_workers(pool, 1);
+	return 0;
+}
+
+//link a chain of n jobs at the end of a shard
+static void shard_append(queue_shard *shard, work_t *head, work_t *tail, int n)
+{
+	tail->next = NULL;
+	pthread_mutex_lock(&(shard->lock));
+	if (!shard->head)
+		shard->head = head;
+	else
+		shard->tail->next = head;
+	shard->tail = tail;
+	shard->size += n;
+	pthread_mutex_unlock(&(shard->lock));
+}
+
+//take up to batch_size jobs off a shard, NULL if it is empty
+static work_t* shard_pop(threadpool *pool, queue_shard *shard)
+{
+	int i;
+	//unlocked peek, a job we miss here is found by the qsize check of the loop
+	if (!shard->size)
+		return NULL;
+	pthread_mutex_lock(&(shard->lock));
+	work_t *work = shard->head, *last = work;
+	if (work)
+	{
+		for (i = 1; i < pool->batch_size && last->next; i++)
+			last = last->next;
+		shard->head = last->next;
+		if (!shard->head)
+			shard->tail = NULL;
+		last->next = NULL;
+		shard->size -= i;
+	}
+	pthread_mutex_unlock(&(shard->lock));
+	return work;
 }
 
+//the power of two choices: the shorter of two random shards
+static int shard_pick(threadpool *pool)
+{
+	if (pool->num_shards == 1)
+		return 0;
+	if (!shard_seed) //a different sequence per thread
+		shard_seed = (unsigned int)(size_t)&shard_seed | 1;
+	shard_seed ^= shard_seed << 13;
+	shard_seed ^= shard_seed >> 17;
+	shard_seed ^= shard_seed << 5;
+	int a = (int)(shard_seed % (unsigned int)pool->num_shards);
+	int b = (int)((shard_seed >> 16) % (unsigned int)pool->num_shards);
+	return pool->shards[b].size < pool->shards[a].size? b : a;
+}
+
+/* give every worker slot a cpu (attr->affinity) and a NUMA sub-pool
+(attr->numa), the pool's numa array is built here. returns -1 if the
+options can't be met */
+static int place_workers(threadpool *pool, const threadpool_attr_t *attr)
+{
+	int i, w, n, nodes = 0;
+	int node_ids[CPU_SETSIZE];
+	if (attr->affinity < THREADPOOL_AFFINITY_NONE || attr->affinity > THREADPOOL_AFFINITY_SCATTER
+		|| (attr->numa && pool->sched != THREADPOOL_SCHED_WORK_STEALING))
+		return -1;
+	if (attr->affinity == THREADPOOL_AFFINITY_NONE && !attr->numa)
+		return 0;
+	cpu_place *places = (cpu_place*)malloc(CPU_SETSIZE * sizeof(cpu_place));
+	if (!places)
+		return -1;
+	n = read_topology(attr, places);
+	if (n < 1)
+	{
+		free(places);
+		return -1;
+	}
+	switch (attr->affinity)
+	{
+		case THREADPOOL_AFFINITY_CORE:
+			qsort(places, n, sizeof(cpu_place), by_core);
+			break;
+		case THREADPOOL_AFFINITY_SCATTER:
+			qsort(places, n, sizeof(cpu_place), by_scatter);
+			break;
+		default:
+			qsort(places, n, sizeof(cpu_place), by_compact);
+	}
+	//the nodes in the order the workers fill them
+	for (i = 0; i < n; i++)
+	{
+		for (w = 0; w < nodes && node_ids[w] != places[i].node; w++)
+			;
+		if (w == nodes)
+			node_ids[nodes++] = places[i].node;
+	}
+	//slot w runs on the w'th cpu of the order, or on any cpu of the w'th node in turn
+	int *slot_node = (int*)malloc(pool->num_slots * sizeof(int));
+	if (!slot_node)
+	{
+		free(places);
+		return -1;
+	}
+	for (w = 0; w < pool->num_slots; w++)
+	{
+		if (attr->affinity != THREADPOOL_AFFINITY_NONE)
+		{
+			pool->workers[w].cpu = places[w % n].cpu;
+			slot_node[w] = places[w % n].node;
+		}
+		else
+			slot_node[w] = node_ids[w % nodes];
+	}
+	if (attr->numa)
+	{
+		//a sub-pool per node that has a worker slot
+		int used = 0;
+		for (i = 0; i < nodes; i++)
+			for (w = 0; w < pool->num_slots; w++)
+				if (slot_node[w] == node_ids[i])
+				{
+					node_ids[used++] = node_ids[i];
+					break;
+				}
+		pool->numa = (threadpool_numa*)aligned_alloc(CACHE_LINE, used * sizeof(threadpool_numa));
+		pool->cpu_numa = (int*)malloc(CPU_SETSIZE * sizeof(int));
+		if (!pool->numa || !pool->cpu_numa)
+		{
+			free(slot_node);
+			free(places);
+			return -1;
+		}
+		for (i = 0; i < CPU_SETSIZE; i++)
+			pool->cpu_numa[i] = -1;
+		for (i = 0; i < used; i++)
+		{
+			threadpool_numa *numa = &(pool->numa[i]);
+			pthread_mutex_init(&(numa->lock), NULL);
+			numa->head = NULL;
+			numa->tail = NULL;
+			atomic_init(&(numa->size), 0);
+			numa->slab = NULL;
+			numa->id = node_ids[i];
+			CPU_ZERO(&(numa->cpus));
+			pool->num_numa++;
+		}
+		for (i = 0; i < n; i++)
+			for (w = 0; w < used; w++)
+				if (places[i].node == node_ids[w])
+				{
+					CPU_SET(places[i].cpu, &(pool->numa[w].cpus));
+					pool->cpu_numa[places[i].cpu] = w;
+				}
+		for (w = 0; w < pool->num_slots; w++)
+			for (i = 0; i < used; i++)
+				if (slot_node[w] == node_ids[i])
+					pool->workers[w].numa = i;
+	}
+	free(slot_node);
+	free(places);
+	return 0;
+}
 
+/* the cpus workers may run on with their node and core, from sysfs. a
+system without the node directories is one node. returns their number */
+static int read_topology(const threadpool_attr_t *attr, cpu_place *places)
+{
+	unsigned char allowed[CPU_SETSIZE] = { 0 }, set[CPU_SETSIZE], nodes[CPU_SETSIZE] = { 0 };
+	int node_of[CPU_SETSIZE] = { 0 };
+	char path[128];
+	int cpu, node, i, j, n = 0;
+	if (attr->cpus)
+	{
+		for (i = 0; i < attr->num_cpus; i++)
+			if (attr->cpus[i] >= 0 && attr->cpus[i] < CPU_SETSIZE)
+				allowed[attr->cpus[i]] = 1;
+	}
+	else
+	{
+		cpu_set_t mask;
+		if (sched_getaffinity(0, sizeof(mask), &mask))
+			return -1;
+		for (cpu = 0; cpu < CPU_SETSIZE; cpu++)
+			allowed[cpu] = CPU_ISSET(cpu, &mask) != 0;
+	}
+	if (read_cpulist("/sys/devices/system/node/online", nodes) > 0)
+	{
+		for (node = 0; node < CPU_SETSIZE; node++)
+		{
+			if (!nodes[node])
+				continue;
+			memset(set, 0, sizeof(set));
+			snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+			if (read_cpulist(path, set) > 0)
+				for (cpu = 0; cpu < CPU_SETSIZE; cpu++)
+					if (set[cpu])
+						node_of[cpu] = node;
+		}
+	}
+	for (cpu = 0; cpu < CPU_SETSIZE; cpu++)
+	{
+		if (!allowed[cpu])
+			continue;
+		cpu_place *place = &(places[n++]);
+		place->cpu = cpu;
+		place->node = node_of[cpu];
+		place->core = cpu;
+		place->rank = 0;
+		memset(set, 0, sizeof(set));
+		snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/topology/thread_siblings_list", cpu);
+		if (read_cpulist(path, set) > 0)
+		{
+			for (i = 0; i < CPU_SETSIZE && !set[i]; i++)
+				;
+			place->core = i;
+			for (; i < cpu; i++)
+				place->rank += set[i];
+		}
+	}
+	//number the cores of every node
+	for (i = 0; i < n; i++)
+	{
+		places[i].core_rank = 0;
+		for (j = 0; j < n; j++)
+			if (places[j].node == places[i].node && places[j].core < places[i].core && !places[j].rank)
+				places[i].core_rank++;
+	}
+	return n;
+}
+
+/* mark the cpus (or nodes) of a sysfs list such as "0-3,8-11" in "set",
+returns how many there are or -1 if the file can't be read */
+static int read_cpulist(const char *path, unsigned char *set)
+{
+	FILE *file = fopen(path, "r");
+	int first, last, count = 0;
+	char sep = ',';
+	if (!file)
+		return -1;
+	while (sep == ',' && fscanf(file, "%d", &first) == 1)
+	{
+		last = first;
+		if (fscanf(file, "%c", &sep) != 1)
+			sep = '\n';
+		if (sep == '-')
+		{
+			if (fscanf(file, "%d", &last) != 1)
+				break;
+			if (fscanf(file, "%c", &sep) != 1)
+				sep = '\n';
+		}
+		for (; first <= last && first < CPU_SETSIZE; first++)
+		{
+			if (first >= 0)
+			{
+				set[first] = 1;
+				count++;
+			}
+		}
+	}
+	fclose(file);
+	return count;
+}
+
+//node, core, hyperthread: the hyperthreads of a core and the cores of a node are neighbours
+static int by_compact(const void *a, const void *b)
+{
+	const cpu_place *x = (const cpu_place*)a, *y = (const cpu_place*)b;
+	if (x->node != y->node)
+		return x->node - y->node;
+	if (x->core != y->core)
+		return x->core - y->core;
+	return x->cpu - y->cpu;
+}
+
+//a hyperthread of every core before the second ones, compact otherwise
+static int by_core(const void *a, const void *b)
+{
+	const cpu_place *x = (const cpu_place*)a, *y = (const cpu_place*)b;
+	if (x->rank != y->rank)
+		return x->rank - y->rank;
+	return by_compact(a, b);
+}
+
+//the n'th core of every node before the n+1'th, a hyperthread of every core first
+static int by_scatter(const void *a, const void *b)
+{
+	const cpu_place *x = (const cpu_place*)a, *y = (const cpu_place*)b;
+	if (x->rank != y->rank)
+		return x->rank - y->rank;
+	if (x->core_rank != y->core_rank)
+		return x->core_rank - y->core_rank;
+	return by_compact(a, b);
+}
+
+//allocate a deque ring of "size" slots
+static deque_ring* deque_ring_create(long size)
+{
+	deque_ring *ring = (deque_ring*)calloc(1, sizeof(deque_ring) + size * sizeof(work_t*));
+	if (ring)
+		ring->size = size;
+	return ring;
+}
+
+//owner only - push a job to the bottom of the deque, grows the ring if it is full
+static int deque_push(threadpool_worker *w, work_t *work)
+{
+	long b = atomic_load_explicit(&(w->bottom), memory_order_relaxed);
+	long t = atomic_load_explicit(&(w->top), memory_order_acquire);
+	deque_ring *ring = atomic_load_explicit(&(w->ring), memory_order_relaxed);
+	if (b - t > ring->size - 1)
+	{
+		deque_ring *bigger = deque_ring_create(ring->size * 2);
+		if (!bigger) //can't grow, the caller keeps the job somewhere else
+			return -1;
+		long i;
+		for (i = t; i < b; i++)
+			atomic_store_explicit(&(bigger->buf[i & (bigger->size - 1)]),
+				atomic_load_explicit(&(ring->buf[i & (ring->size - 1)]), memory_order_relaxed),
+				memory_order_relaxed);
+		bigger->prev = ring;
+		atomic_store_explicit(&(w->ring), bigger, memory_order_release);
+		ring = bigger;
+	}
+	atomic_store_explicit(&(ring->buf[b & (ring->size - 1)]), work, memory_order_relaxed);
+	atomic_store_explicit(&(w->bottom), b + 1, memory_order_release);
+	return 0;
+}
+
+//owner only - take a job from the bottom of the deque, NULL if it is empty
+static work_t* deque_take(threadpool_worker *w)
+{
+	long b = atomic_load_explicit(&(w->bottom), memory_order_relaxed) - 1;
+	deque_ring *ring = atomic_load_explicit(&(w->ring), memory_order_relaxed);
+	atomic_store_explicit(&(w->bottom), b, memory_order_relaxed);
+	atomic_thread_fence(memory_order_seq_cst);
+	long t = atomic_load_explicit(&(w->top), memory_order_relaxed);
+	work_t *work = NULL;
+	if (t <= b)
+	{
+		work = atomic_load_explicit(&(ring->buf[b & (ring->size - 1)]), memory_order_relaxed);
+		if (t == b) //the last job, race the thieves for it
+		{
+			if (!atomic_compare_exchange_strong_explicit(&(w->top), &t, t + 1,
+				memory_order_seq_cst, memory_order_relaxed))
+				work = NULL;
+			atomic_store_explicit(&(w->bottom), b + 1, memory_order_relaxed);
+		}
+	}
+	else //empty
+		atomic_store_explicit(&(w->bottom), b + 1, memory_order_relaxed);
+	return work;
+}
+
+//any thread - steal a job from the top of the deque, sets *retry if it lost a race
+static work_t* deque_steal(threadpool_worker *w, int *retry)
+{
+	long t = atomic_load_explicit(&(w->top), memory_order_acquire);
+	atomic_thread_fence(memory_order_seq_cst);
+	long b = atomic_load_explicit(&(w->bottom), memory_order_acquire);
+	if (t >= b)
+		return NULL;
+	deque_ring *ring = atomic_load_explicit(&(w->ring), memory_order_acquire);
+	work_t *work = atomic_load_explicit(&(ring->buf[t & (ring->size - 1)]), memory_order_relaxed);
+	if (!atomic_compare_exchange_strong_explicit(&(w->top), &t, t + 1,
+		memory_order_seq_cst, memory_order_relaxed))
+	{
+		*retry = 1;
+		return NULL;
+	}
+	return work;
+}
+
+//take qlock, counting the acquisitions and the time blocked on it for the stats
+static void lock_queue(threadpool *pool)
+{
+#ifndef THREADPOOL_NO_STATS
+	if (pthread_mutex_trylock(&(pool->qlock)))
+	{
+		long long start = threadpool_now_ns();
+		pthread_mutex_lock(&(pool->qlock));
+		if (current_worker && current_worker->pool == pool)
+			stat_add(&(current_worker->stats.lock_wait_ns), threadpool_now_ns() - start);
+		else
+			pool->lock_wait_ns += threadpool_now_ns() - start;
+	}
+#else
+	pthread_mutex_lock(&(pool->qlock));
+#endif
+	pool->qlock_acquisitions++;
+}
+
+//free the per worker state, the deque rings, the ring queue, the sub-pools, the slabs, the heaps and the handles
+static void free_pool_state(threadpool *pool)
+{
+	int i;
+	for (i = 0; i < pool->num_slots; i++)
+	{
+		deque_ring *ring = atomic_load(&(pool->workers[i].ring));
+		while (ring)
+		{
+			deque_ring *prev = ring->prev;
+			free(ring);
+			ring = prev;
+		}
+	}
+	for (i = 0; i < pool->num_slots; i++)
+		free(pool->workers[i].scratch);
+	free(pool->workers);
+	free(pool->ring);
+	for (i = 0; i < pool->num_shards; i++)
+		pthread_mutex_destroy(&(pool->shards[i].lock));
+	free(pool->shards);
+	if (pool->numa) //the slab of the first sub-pool is pool->slab
+	{
+		for (i = 0; i < pool->num_numa; i++)
+		{
+			slab_destroy(pool->numa[i].slab);
+			pthread_mutex_destroy(&(pool->numa[i].lock));
+		}
+		free(pool->numa);
+	}
+	else
+		slab_destroy(pool->slab);
+	free(pool->cpu_numa);
+	if (pool->prio)
+	{
+		int level;
+		for (level = 0; level < THREADPOOL_PRIO_LEVELS; level++)
+			free(pool->prio->heaps[level].items);
+		free(pool->prio);
+	}
+	if (pool->handles)
+	{
+		threadpool_handles *handles = pool->handles;
+		while (handles->chunks)
+		{
+			handle_chunk *next = handles->chunks->next;
+			free(handles->chunks);
+			handles->chunks = next;
+		}
+		pthread_mutex_destroy(&(handles->lock));
+		free(handles);
+	}
+	if (pool->timers)
+		timers_free(pool->timers);
+	if (pool->strands)
+		strands_free(pool->strands);
+	if (pool->groups)
+		groups_free(pool->groups);
+	if (pool->fibers)
+		fibers_free(pool->fibers);
+	if (pool->trace)
+		trace_free(pool->trace);
+}
+
+
+
+/* allocate a slab with one chunk of "chunk_nodes" work_t nodes, bound to
+NUMA node "node" (-1 for none). "home" are the WORK_NUMA bits of its nodes */
+static threadpool_slab* slab_create(int chunk_nodes, int node, unsigned int home)
+{
+	threadpool_slab *slab = (threadpool_slab*)aligned_alloc(CACHE_LINE, sizeof(threadpool_slab));
+	if (!slab)
+		return NULL;
+	if (pthread_mutex_init(&(slab->lock), NULL))
+	{
+		free(slab);
+		return NULL;
+	}
+	atomic_init(&(slab->returned), NULL);
+	slab->free_list = NULL;
+	slab->chunks = NULL;
+	slab->chunk_nodes = chunk_nodes;
+	slab->node = node;
+	slab->home = home;
+	slab->id = atomic_fetch_add(&next_slab_id, 1);
+	atomic_init(&(slab->hits), 0);
+	atomic_init(&(slab->fallbacks), 0);
+	atomic_init(&(slab->chunks_allocated), 0);
+	//preallocate the first chunk
+	pthread_mutex_lock(&(slab->lock));
+	work_t *first = slab_refill(slab);
+	if (first)
+	{
+		first->next = slab->free_list;
+		slab->free_list = first;
+	}
+	pthread_mutex_unlock(&(slab->lock));
+	if (!first)
+	{
+		pthread_mutex_destroy(&(slab->lock));
+		free(slab);
+		return NULL;
+	}
+	pthread_mutex_lock(&live_slabs_lock);
+	slab->next_live = live_slabs;
+	live_slabs = slab;
+	pthread_mutex_unlock(&live_slabs_lock);
+	return slab;
+}
+
+/* take up to SLAB_REFILL nodes off the free list, growing the slab by a
+chunk if the list is empty. the caller holds slab->lock. returns the nodes
+as a list, NULL if a chunk couldn't be allocated */
+static work_t* slab_refill(threadpool_slab *slab)
+{
+	int i;
+	if (!slab->free_list)
+	{
+		slab_chunk *chunk;
+		if (slab->node >= 0) //fresh pages, bound before they're touched
+		{
+			chunk = (slab_chunk*)mmap(NULL, sizeof(slab_chunk) + slab->chunk_nodes * sizeof(work_t),
+				PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+			if (chunk == MAP_FAILED)
+				return NULL;
+			numa_bind(chunk, sizeof(slab_chunk) + slab->chunk_nodes * sizeof(work_t), slab->node);
+		}
+		else
+			chunk = (slab_chunk*)malloc(sizeof(slab_chunk) + slab->chunk_nodes * sizeof(work_t));
+		if (!chunk)
+			return NULL;
+		chunk->next = slab->chunks;
+		slab->chunks = chunk;
+		for (i = 0; i < slab->chunk_nodes; i++)
+		{
+			chunk->nodes[i].next = (i + 1 < slab->chunk_nodes)? &(chunk->nodes[i + 1]) : NULL;
+			chunk->nodes[i].flags = slab->home;
+		}
+		slab->free_list = chunk->nodes;
+		slab->chunks_allocated++;
+	}
+	work_t *list = slab->free_list, *last = list;
+	for (i = 1; i < SLAB_REFILL && last->next; i++)
+		last = last->next;
+	slab->free_list = last->next;
+	last->next = NULL;
+	return list;
+}
+
+/* get a work_t node: from the worker's (or producer thread's) own cache,
+then from the nodes returned by other threads, then from the free list
+under the lock. calloc is the fallback when the slab can't grow. a worker
+uses the slab of its NUMA sub-pool, other threads the one of sub-pool
+"numa" (-1 for the first) */
+static work_t* slab_alloc(threadpool *pool, int numa)
+{
+	threadpool_slab *slab = pool->slab;
+	work_t **cache, *work;
+	threadpool_worker *me = current_worker;
+	if (me && me->pool == pool)
+	{
+		cache = &(me->cache);
+		if (pool->numa)
+			slab = pool->numa[me->numa].slab;
+	}
+	else
+	{
+		int entry = 0;
+		if (pool->numa && numa >= 0)
+		{
+			slab = pool->numa[numa].slab;
+			entry = numa % PRODUCER_CACHES;
+		}
+		//the nodes of another (maybe destroyed) pool go back to their slab
+		if (producer_cache[entry].slab_id != slab->id)
+		{
+			slab_give_back(producer_cache[entry].slab_id, producer_cache[entry].list);
+			producer_cache[entry].slab_id = slab->id;
+			producer_cache[entry].list = NULL;
+		}
+		cache = &(producer_cache[entry].list);
+	}
+	
+	if (!*cache) //take everything other threads returned
+		*cache = atomic_exchange_explicit(&(slab->returned), NULL, memory_order_acquire);
+	if (!*cache)
+	{
+		pthread_mutex_lock(&(slab->lock));
+		*cache = slab_refill(slab);
+		pthread_mutex_unlock(&(slab->lock));
+	}
+	if (!*cache)
+	{
+		slab->fallbacks++;
+		work = (work_t*)calloc(1, sizeof(work_t));
+		if (work)
+			work->flags = WORK_FROM_HEAP;
+		return work;
+	}
+	
+	work = *cache;
+	*cache = work->next;
+	if (me && me->pool == pool && me->cache_count > 0)
+		me->cache_count--;
+	atomic_fetch_add_explicit(&(slab->hits), 1, memory_order_relaxed);
+	work->next = NULL;
+	return work;
+}
+
+/* give a node back. a worker keeps up to SLAB_CACHE_MAX nodes for its own
+dispatches, the rest go to the lock free stack for the producers */
+static void slab_free(threadpool *pool, work_t *work)
+{
+	threadpool_worker *me = current_worker;
+	if (work->flags & WORK_FROM_HEAP)
+	{
+		free(work);
+		return;
+	}
+	if (me && me->pool == pool && me->cache_count < SLAB_CACHE_MAX)
+	{
+		work->next = me->cache;
+		me->cache = work;
+		me->cache_count++;
+		return;
+	}
+	//the slab the node came from, its NUMA sub-pool's
+	slab_return(pool->numa? pool->numa[WORK_NUMA(work)].slab : pool->slab, work);
+}
+
+//push a node on the lock free stack of its slab
+static void slab_return(threadpool_slab *slab, work_t *work)
+{
+	work_t *head = atomic_load_explicit(&(slab->returned), memory_order_relaxed);
+	do
+		work->next = head;
+	while (!atomic_compare_exchange_weak_explicit(&(slab->returned), &head, work,
+		memory_order_release, memory_order_relaxed));
+}
+
+/* push the list of nodes a producer_cache holds on the stack of slab "id".
+if the slab was destroyed its chunks are gone, the nodes are just forgotten.
+live_slabs_lock keeps the slab from being destroyed meanwhile */
+static void slab_give_back(unsigned int id, work_t *list)
+{
+	threadpool_slab *slab;
+	if (!list)
+		return;
+	pthread_mutex_lock(&live_slabs_lock);
+	for (slab = live_slabs; slab && slab->id != id; slab = slab->next_live)
+		;
+	if (slab)
+	{
+		work_t *last = list;
+		while (last->next)
+			last = last->next;
+		work_t *head = atomic_load_explicit(&(slab->returned), memory_order_relaxed);
+		do
+			last->next = head;
+		while (!atomic_compare_exchange_weak_explicit(&(slab->returned), &head, list,
+			memory_order_release, memory_order_relaxed));
+	}
+	pthread_mutex_unlock(&live_slabs_lock);
+}
+
+//give the work_t cache of an exiting worker back to the slabs
+static void slab_flush_cache(threadpool *pool, threadpool_worker *me)
+{
+	while (me->cache)
+	{
+		work_t *work = me->cache;
+		me->cache = work->next;
+		slab_return(pool->numa? pool->numa[WORK_NUMA(work)].slab : pool->slab, work);
+	}
+	me->cache_count = 0;
+}
+
+//free a slab and its chunks
+static void slab_destroy(threadpool_slab *slab)
+{
+	threadpool_slab **link;
+	if (!slab)
+		return;
+	pthread_mutex_lock(&live_slabs_lock);
+	for (link = &live_slabs; *link != slab; link = &((*link)->next_live))
+		;
+	*link = slab->next_live;
+	pthread_mutex_unlock(&live_slabs_lock);
+	while (slab->chunks)
+	{
+		slab_chunk *next = slab->chunks->next;
+		if (slab->node >= 0)
+			munmap(slab->chunks, sizeof(slab_chunk) + slab->chunk_nodes * sizeof(work_t));
+		else
+			free(slab->chunks);
+		slab->chunks = next;
+	}
+	pthread_mutex_destroy(&(slab->lock));
+	free(slab);
+}
+
+/* prefer the memory of NUMA node "node" for [addr, addr + size), before
+its pages are touched. best effort, without NUMA support it's a no-op */
+static void numa_bind(void *addr, size_t size, int node)
+{
+	unsigned long mask[CPU_SETSIZE / (8 * sizeof(unsigned long))] = { 0 };
+	if (node < 0 || node >= CPU_SETSIZE)
+		return;
+	mask[node / (8 * sizeof(unsigned long))] = 1UL << (node % (8 * sizeof(unsigned long)));
+	syscall(SYS_mbind, addr, size, MPOL_PREFERRED, mask, (unsigned long)CPU_SETSIZE + 1, 0);
+}
+
+//the counters of the pool
+void threadpool_get_stats(threadpool *pool, threadpool_stats_t *stats)
+{
+	int i;
+	stats->slab_hits = pool->slab->hits;
+	stats->slab_fallbacks = pool->slab->fallbacks;
+	stats->slab_chunks = pool->slab->chunks_allocated;
+	for (i = 1; i < pool->num_numa; i++) //the slabs of the other sub-pools
+	{
+		stats->slab_hits += pool->numa[i].slab->hits;
+		stats->slab_fallbacks += pool->numa[i].slab->fallbacks;
+		stats->slab_chunks += pool->numa[i].slab->chunks_allocated;
+	}
+	stats->nodes = pool->num_numa;
+	stats->rejected = pool->rejected;
+	stats->discarded = pool->discarded;
+	stats->caller_runs = pool->caller_runs;
+	stats->expired = pool->expired;
+	stats->cancelled = pool->cancelled;
+	stats->spawned = pool->spawned;
+	stats->retired = pool->retired;
+	stats->blocked = pool->blocked;
+	lock_queue(pool);
+	stats->threads = pool->num_threads;
+	stats->peak_threads = pool->peak_threads;
+	stats->qlock_acquisitions = pool->qlock_acquisitions - 1; //not counting this one
+	stats->parks = pool->parks;
+	pthread_mutex_unlock(&(pool->qlock));
+}
+
+//a new cancel token
+threadpool_token_t* threadpool_token_create(void)
+{
+	threadpool_token_t *token = (threadpool_token_t*)malloc(sizeof(threadpool_token_t));
+	if (!token)
+		return NULL;
+	atomic_init(&(token->cancelled), 0);
+	atomic_init(&(token->refs), 1);
+	return token;
+}
+
+//cancel the jobs of the token
+void threadpool_token_cancel(threadpool_token_t *token)
+{
+	atomic_store(&(token->cancelled), 1);
+}
+
+//1 if the token was cancelled
+int threadpool_token_cancelled(threadpool_token_t *token)
+{
+	return atomic_load_explicit(&(token->cancelled), memory_order_relaxed);
+}
+
+//give the token up
+void threadpool_token_release(threadpool_token_t *token)
+{
+	token_put(token);
+}
+
+//add a job the token can cancel
+int dispatch_with_token(threadpool* from_me, threadpool_token_t *token, dispatch_fn dispatch_to_here, void *arg)
+{
+	work_t job = { 0 };
+	job.routine = dispatch_to_here;
+	job.arg = arg;
+	job.priority = THREADPOOL_PRIO_NORMAL;
+	job.token = token;
+	//the queued job holds a reference, a job that wasn't queued gives it back
+	atomic_fetch_add_explicit(&(token->refs), 1, memory_order_relaxed);
+	if (submit(from_me, &job, NULL) < 0)
+	{
+		token_put(token);
+		return -1;
+	}
+	return 0;
+}
+
+//drop a reference to the token, the last one frees it
+static void token_put(threadpool_token_t *token)
+{
+	if (atomic_fetch_sub_explicit(&(token->refs), 1, memory_order_acq_rel) == 1)
+		free(token);
+}
+
+//add a job whose result the caller collects through the returned handle
+threadpool_handle_t* dispatch_with_handle(threadpool* from_me, dispatch_fn dispatch_to_here, void *arg)
+{
+	threadpool_handles *handles = from_me->handles;
+	if (!dispatch_to_here)
+	{
+		printf("Dispatch function not assigned correctly\n");
+		return NULL;
+	}
+	pthread_mutex_lock(&(handles->lock));
+	if (!handles->free_list && handles_grow(handles) < 0)
+	{
+		pthread_mutex_unlock(&(handles->lock));
+		perror("Allocating memory for the handle failed\n");
+		return NULL;
+	}
+	threadpool_handle_t *handle = handles->free_list;
+	handles->free_list = handle->next;
+	pthread_mutex_unlock(&(handles->lock));
+	
+	atomic_store_explicit(&(handle->state), HANDLE_PENDING, memory_order_relaxed);
+	atomic_store_explicit(&(handle->refs), 2, memory_order_relaxed);
+	handle->pool = from_me;
+	handle->next = NULL;
+	
+	work_t job = { 0 };
+	job.routine = dispatch_to_here;
+	job.arg = arg;
+	job.priority = THREADPOOL_PRIO_NORMAL;
+	job.handle = handle;
+	if (submit(from_me, &job, NULL) < 0)
+	{
+		//the job will never complete, drop its reference and ours
+		handle_put(handle);
+		handle_put(handle);
+		return NULL;
+	}
+	return handle;
+}
+
+//wait for the job of the handle and return its result
+int threadpool_wait(threadpool_handle_t *handle)
+{
+	int i;
+	//jobs are often short, look a few times before going to sleep
+	for (i = 0; i < HANDLE_SPIN; i++)
+		if (atomic_load_explicit(&(handle->state), memory_order_acquire) == HANDLE_DONE)
+			return handle->result;
+	while (1)
+	{
+		int state = HANDLE_PENDING;
+		//tell the worker somebody sleeps on the handle
+		if (!atomic_compare_exchange_strong(&(handle->state), &state, HANDLE_WAITED)
+			&& state == HANDLE_DONE)
+			break;
+		futex_wait(&(handle->state), HANDLE_WAITED);
+		if (atomic_load_explicit(&(handle->state), memory_order_acquire) == HANDLE_DONE)
+			break;
+	}
+	return handle->result;
+}
+
+//the result of the job if it already ran
+int threadpool_try_get(threadpool_handle_t *handle, int *result)
+{
+	if (atomic_load_explicit(&(handle->state), memory_order_acquire) != HANDLE_DONE)
+		return 0;
+	*result = handle->result;
+	return 1;
+}
+
+//wait for all the handles, returns the number of failed jobs
+int threadpool_wait_all(threadpool_handle_t **handles, int n)
+{
+	int i, failed = 0;
+	for (i = 0; i < n; i++)
+		if (threadpool_wait(handles[i]) < 0)
+			failed++;
+	return failed;
+}
+
+//wait for one of the handles, returns its index
+int threadpool_wait_any(threadpool_handle_t **handles, int n)
+{
+	int i, result;
+	if (n < 1)
+		return -1;
+	threadpool_handles *pool_handles = handles[0]->pool->handles;
+	for (i = 0; i < n; i++)
+		if (threadpool_try_get(handles[i], &result))
+			return i;
+	
+	atomic_fetch_add(&(pool_handles->epoch_waiters), 1);
+	while (1)
+	{
+		/* read the epoch first, mark every handle as waited on and check them
+		again. a job completing after the check moves the epoch, so the
+		futex wait returns right away instead of missing it */
+		int epoch = atomic_load(&(pool_handles->epoch));
+		for (i = 0; i < n; i++)
+		{
+			int state = HANDLE_PENDING;
+			if (!atomic_compare_exchange_strong(&(handles[i]->state), &state, HANDLE_WAITED)
+				&& state == HANDLE_DONE)
+			{
+				atomic_fetch_sub(&(pool_handles->epoch_waiters), 1);
+				return i;
+			}
+		}
+		futex_wait(&(pool_handles->epoch), epoch);
+	}
+}
+
+//give the handle back to the pool
+void threadpool_handle_release(threadpool_handle_t *handle)
+{
+	handle_put(handle);
+}
+
+//allocate the handles of a pool with one chunk
+static threadpool_handles* handles_create(void)
+{
+	threadpool_handles *handles = (threadpool_handles*)aligned_alloc(CACHE_LINE, sizeof(threadpool_handles));
+	if (!handles)
+		return NULL;
+	if (pthread_mutex_init(&(handles->lock), NULL))
+	{
+		free(handles);
+		return NULL;
+	}
+	handles->free_list = NULL;
+	handles->chunks = NULL;
+	atomic_init(&(handles->epoch), 0);
+	atomic_init(&(handles->epoch_waiters), 0);
+	if (handles_grow(handles) < 0)
+	{
+		pthread_mutex_destroy(&(handles->lock));
+		free(handles);
+		return NULL;
+	}
+	return handles;
+}
+
+//add a chunk of handles to the free list, the caller holds the lock (or owns the handles)
+static int handles_grow(threadpool_handles *handles)
+{
+	int i;
+	handle_chunk *chunk = (handle_chunk*)malloc(sizeof(handle_chunk));
+	if (!chunk)
+		return -1;
+	chunk->next = handles->chunks;
+	handles->chunks = chunk;
+	for (i = 0; i < HANDLE_CHUNK; i++)
+	{
+		atomic_init(&(chunk->handles[i].state), HANDLE_PENDING);
+		atomic_init(&(chunk->handles[i].refs), 0);
+		chunk->handles[i].next = handles->free_list;
+		handles->free_list = &(chunk->handles[i]);
+	}
+	return 0;
+}
+
+//the worker stores the result and wakes the waiters, if there are any
+static void handle_complete(threadpool_handle_t *handle, int result)
+{
+	threadpool_handles *handles = handle->pool->handles;
+	handle->result = result;
+	if (atomic_exchange(&(handle->state), HANDLE_DONE) == HANDLE_WAITED)
+	{
+		futex_wake(&(handle->state), INT_MAX);
+		atomic_fetch_add(&(handles->epoch), 1);
+		if (atomic_load(&(handles->epoch_waiters)))
+			futex_wake(&(handles->epoch), INT_MAX);
+	}
+	handle_put(handle);
+}
+
+//drop a reference to the handle, the last one puts it back on the free list
+static void handle_put(threadpool_handle_t *handle)
+{
+	if (atomic_fetch_sub_explicit(&(handle->refs), 1, memory_order_acq_rel) != 1)
+		return;
+	threadpool_handles *handles = handle->pool->handles;
+	pthread_mutex_lock(&(handles->lock));
+	handle->next = handles->free_list;
+	handles->free_list = handle;
+	pthread_mutex_unlock(&(handles->lock));
+}
+
+//sleep while *addr == val (or until woken)
+static void futex_wait(atomic_int *addr, int val)
+{
+	syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, val, NULL, NULL, 0);
+}
+
+//wake up to n threads sleeping on addr
+static void futex_wake(atomic_int *addr, int n)
+{
+	syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, n, NULL, NULL, 0);
+}
+
+//add a job to the heap of its class, qlock is held. -1 if the heap can't grow
+static int prio_push_locked(threadpool *pool, work_t *work)
+{
+	prio_heap *heap = &(pool->prio->heaps[work->priority]);
+	if (heap->size == heap->capacity)
+	{
+		int capacity = heap->capacity? heap->capacity * 2 : PRIO_HEAP_INITIAL;
+		work_t **items = (work_t**)realloc(heap->items, capacity * sizeof(work_t*));
+		if (!items)
+			return -1;
+		heap->items = items;
+		heap->capacity = capacity;
+	}
+	//the aging of a class starts when it gets work
+	if (!heap->size)
+		heap->last_served = threadpool_now_ns();
+	work->seq = pool->prio->seq++;
+	heap->items[heap->size] = work;
+	prio_sift_up(heap, heap->size++);
+	return 0;
+}
+
+/* take the next job, qlock is held and qsize is positive. the most urgent
+non empty class wins, unless a less urgent class waited aging_ns for every
+class it is behind since it was last served; the class that waited the
+longest of those goes first, so no class starves */
+static work_t* prio_pop_locked(threadpool *pool)
+{
+	threadpool_prio *prio = pool->prio;
+	long long now = threadpool_now_ns();
+	int level, best = -1, pick = -1;
+	for (level = 0; level < THREADPOOL_PRIO_LEVELS; level++)
+	{
+		prio_heap *heap = &(prio->heaps[level]);
+		if (!heap->size)
+			continue;
+		if (best < 0)
+			best = pick = level;
+		else if (prio->aging_ns && now - heap->last_served > prio->aging_ns * (level - best)
+			&& heap->last_served < prio->heaps[pick].last_served)
+			pick = level;
+	}
+	prio_heap *heap = &(prio->heaps[pick]);
+	work_t *work = heap->items[0];
+	heap->items[0] = heap->items[--heap->size];
+	prio_sift_down(heap, 0);
+	heap->last_served = now;
+	return work;
+}
+
+//remove the job that arrived first to the least urgent non empty class, qlock is held
+static work_t* prio_take_oldest_locked(threadpool *pool)
+{
+	int level, i, oldest = 0;
+	for (level = THREADPOOL_PRIO_LEVELS - 1; level >= 0; level--)
+	{
+		prio_heap *heap = &(pool->prio->heaps[level]);
+		if (!heap->size)
+			continue;
+		for (i = 1; i < heap->size; i++)
+			if (heap->items[i]->seq < heap->items[oldest]->seq)
+				oldest = i;
+		work_t *work = heap->items[oldest];
+		heap->items[oldest] = heap->items[--heap->size];
+		if (oldest < heap->size)
+		{
+			prio_sift_down(heap, oldest);
+			prio_sift_up(heap, oldest);
+		}
+		return work;
+	}
+	return NULL;
+}
+
+//heap order: earlier deadline first (none is the latest), then arrival order
+static int prio_before(const work_t *a, const work_t *b)
+{
+	long long da = a->deadline? a->deadline : LLONG_MAX;
+	long long db = b->deadline? b->deadline : LLONG_MAX;
+	if (da != db)
+		return da < db;
+	return a->seq < b->seq;
+}
+
+static void prio_sift_up(prio_heap *heap, int i)
+{
+	work_t *work = heap->items[i];
+	while (i > 0 && prio_before(work, heap->items[(i - 1) / 2]))
+	{
+		heap->items[i] = heap->items[(i - 1) / 2];
+		i = (i - 1) / 2;
+	}
+	heap->items[i] = work;
+}
+
+static void prio_sift_down(prio_heap *heap, int i)
+{
+	work_t *work = heap->items[i];
+	while (1)
+	{
+		int child = 2 * i + 1;
+		if (child >= heap->size)
+			break;
+		if (child + 1 < heap->size && prio_before(heap->items[child + 1], heap->items[child]))
+			child++;
+		if (!prio_before(heap->items[child], work))
+			break;
+		heap->items[i] = heap->items[child];
+		i = child;
+	}
+	heap->items[i] = work;
+}
+
+//run fn over begin..end-1 on the workers and this thread
+int threadpool_parallel_for(threadpool *pool, long begin, long end, long grain, threadpool_range_fn fn, void *ctx)
+{
+	if (!fn)
+	{
+		printf("Dispatch function not assigned correctly\n");
+		return -1;
+	}
+	return parallel_loop_start(pool, begin, end, grain, fn, NULL, NULL, NULL, 0, ctx);
+}
+
+//fold begin..end-1 into *result on the workers and this thread
+int threadpool_parallel_reduce(threadpool *pool, long begin, long end, long grain, threadpool_fold_fn fn,
+	threadpool_combine_fn combine, void *result, size_t size, void *ctx)
+{
+	if (!fn || !combine || !result)
+	{
+		printf("Dispatch function not assigned correctly\n");
+		return -1;
+	}
+	return parallel_loop_start(pool, begin, end, grain, NULL, fn, combine, result, size, ctx);
+}
+
+/* the body of both parallel loops: queue the helpers, claim chunks until
+the range runs out, wait for the chunks the helpers still run and merge the
+accumulators */
+static int parallel_loop_start(threadpool *pool, long begin, long end, long grain, threadpool_range_fn range,
+	threadpool_fold_fn fold, threadpool_combine_fn combine, void *result, size_t size, void *ctx)
+{
+	int i, helpers;
+	if (end <= begin)
+		return 0;
+	unsigned long n = (unsigned long)end - (unsigned long)begin;
+	unsigned long chunk = grain > 0? (unsigned long)grain : 1;
+	//a helper per worker, but no more than there are chunks for (a worker calling us is one of them)
+	helpers = pool->num_threads;
+	if (current_worker && current_worker->pool == pool)
+		helpers--;
+	if ((unsigned long)helpers > (n - 1) / chunk)
+		helpers = (int)((n - 1) / chunk);
+	if (pool->dont_accept) //we run it all
+		helpers = 0;
+	
+	size_t stride = fold? (size + CACHE_LINE - 1) / CACHE_LINE * CACHE_LINE : 0;
+	parallel_loop *loop = (parallel_loop*)aligned_alloc(CACHE_LINE, sizeof(parallel_loop) + (helpers + 1) * stride);
+	if (!loop)
+	{
+		perror("Allocating memory for the request failed\n");
+		return -1;
+	}
+	atomic_init(&(loop->next), 0);
+	atomic_init(&(loop->left), n);
+	atomic_init(&(loop->state), HANDLE_PENDING);
+	atomic_init(&(loop->refs), 1 + helpers);
+	atomic_init(&(loop->failed), 0);
+	atomic_init(&(loop->slots_used), 0);
+	loop->begin = begin;
+	loop->n = n;
+	loop->grain = chunk;
+	loop->participants = helpers + 1;
+	loop->range = range;
+	loop->fold = fold;
+	loop->ctx = ctx;
+	loop->identity = result; //not written before the end
+	loop->size = size;
+	loop->stride = stride;
+	
+	/* the helpers must not make us wait for room: a full queue rejects them
+	right away and we run their share */
+	struct timespec now;
+	clock_gettime(CLOCK_REALTIME, &now);
+	work_t job = { 0 };
+	job.routine = parallel_helper;
+	job.arg = loop;
+	job.priority = THREADPOOL_PRIO_NORMAL;
+	for (i = 0; i < helpers; i++)
+		if (submit(pool, &job, &now) < 0)
+			parallel_put(loop);
+	
+	parallel_run(loop);
+	
+	//the chunks the helpers claimed are running, wait for the last one like a handle
+	for (i = 0; i < HANDLE_SPIN; i++)
+		if (atomic_load_explicit(&(loop->state), memory_order_acquire) == HANDLE_DONE)
+			break;
+	while (atomic_load_explicit(&(loop->state), memory_order_acquire) != HANDLE_DONE)
+	{
+		int state = HANDLE_PENDING;
+		if (!atomic_compare_exchange_strong(&(loop->state), &state, HANDLE_WAITED)
+			&& state == HANDLE_DONE)
+			break;
+		futex_wait(&(loop->state), HANDLE_WAITED);
+	}
+	
+	//every accumulator was filled before its chunks were counted in "left"
+	int used = atomic_load(&(loop->slots_used));
+	for (i = 0; i < used; i++)
+		combine(result, loop->slots + i * stride, ctx);
+	int failed = atomic_load(&(loop->failed));
+	parallel_put(loop);
+	return failed? -1 : 0;
+}
+
+//the job of a helper of a parallel loop
+static int parallel_helper(void *arg)
+{
+	parallel_loop *loop = (parallel_loop*)arg;
+	parallel_run(loop);
+	parallel_put(loop);
+	return 0;
+}
+
+//run chunks of the loop until none is left to claim
+static void parallel_run(parallel_loop *loop)
+{
+	void *acc = NULL;
+	unsigned long take;
+	long first;
+	while ((take = parallel_claim(loop, &first)))
+	{
+		int result;
+		if (loop->fold)
+		{
+			//an accumulator only for participants that got a chunk
+			if (!acc)
+			{
+				acc = loop->slots + atomic_fetch_add(&(loop->slots_used), 1) * loop->stride;
+				memcpy(acc, loop->identity, loop->size);
+			}
+			result = loop->fold(first, first + (long)take, acc, loop->ctx);
+		}
+		else
+			result = loop->range(first, first + (long)take, loop->ctx);
+		if (result < 0)
+			loop->failed = 1;
+		//the last chunk to finish tells the caller
+		if (atomic_fetch_sub_explicit(&(loop->left), take, memory_order_acq_rel) == take
+			&& atomic_exchange(&(loop->state), HANDLE_DONE) == HANDLE_WAITED)
+			futex_wake(&(loop->state), 1);
+	}
+}
+
+/* claim the next chunk: half a participant's share of what's left, but at
+least grain indices. returns its size and stores its first index, 0 when
+the range ran out */
+static unsigned long parallel_claim(parallel_loop *loop, long *first)
+{
+	unsigned long start = atomic_load_explicit(&(loop->next), memory_order_relaxed), take;
+	do
+	{
+		if (start >= loop->n)
+			return 0;
+		unsigned long left = loop->n - start;
+		take = left / (2 * loop->participants);
+		if (take < loop->grain)
+			take = loop->grain;
+		if (take > left)
+			take = left;
+	} while (!atomic_compare_exchange_weak_explicit(&(loop->next), &start, start + take,
+		memory_order_relaxed, memory_order_relaxed));
+	*first = loop->begin + (long)start;
+	return take;
+}
+
+//drop a reference to the loop, the last one frees it
+static void parallel_put(parallel_loop *loop)
+{
+	if (atomic_fetch_sub_explicit(&(loop->refs), 1, memory_order_acq_rel) == 1)
+		free(loop);
+}
+
+//the keys of a new pool
+static threadpool_strands* strands_create(threadpool *pool)
+{
+	int i;
+	threadpool_strands *strands = (threadpool_strands*)aligned_alloc(CACHE_LINE, sizeof(threadpool_strands));
+	if (!strands)
+		return NULL;
+	if (pthread_mutex_init(&(strands->lock), NULL))
+	{
+		free(strands);
+		return NULL;
+	}
+	for (i = 0; i < STRAND_BUCKETS; i++)
+	{
+		if (pthread_mutex_init(&(strands->buckets[i].lock), NULL))
+		{
+			while (i-- > 0)
+				pthread_mutex_destroy(&(strands->buckets[i].lock));
+			pthread_mutex_destroy(&(strands->lock));
+			free(strands);
+			return NULL;
+		}
+		strands->buckets[i].chain = NULL;
+	}
+	strands->pool = pool;
+	strands->free_list = NULL;
+	strands->chunks = NULL;
+	return strands;
+}
+
+//free the keys of a pool, no strand is left
+static void strands_free(threadpool_strands *strands)
+{
+	int i;
+	while (strands->chunks)
+	{
+		void **next = (void**)*(strands->chunks);
+		free(strands->chunks);
+		strands->chunks = next;
+	}
+	for (i = 0; i < STRAND_BUCKETS; i++)
+		pthread_mutex_destroy(&(strands->buckets[i].lock));
+	pthread_mutex_destroy(&(strands->lock));
+	free(strands);
+}
+
+/* the job of a key: run up to STRAND_BATCH of its jobs in order, then queue
+itself again if more arrived, so other keys and jobs get the worker too.
+if the queue won't take it (full, or shutting down and running what's
+queued) it keeps going here. once the destructor drops the queued jobs,
+the key's jobs are dropped with them */
+static int strand_run(void *arg)
+{
+	strand *st = (strand*)arg;
+	threadpool_strands *strands = st->strands;
+	threadpool *pool = strands->pool;
+	strand_bucket *b = &(strands->buckets[st->bucket]);
+	work_t *batch, *last;
+	int i;
+	while (1)
+	{
+		pthread_mutex_lock(&(b->lock));
+		batch = last = st->head;
+		for (i = 1; i < STRAND_BATCH && last->next; i++)
+			last = last->next;
+		st->head = last->next;
+		if (!st->head)
+			st->tail = NULL;
+		last->next = NULL;
+		pthread_mutex_unlock(&(b->lock));
+		
+		while (batch)
+		{
+			work_t *next = batch->next;
+			TRACE(pool, TRACE_DEQUEUE, batch);
+			run_work(pool, batch);
+			slab_free(pool, batch);
+			batch = next;
+		}
+		
+		//the key is idle again once its queue is empty
+		pthread_mutex_lock(&(b->lock));
+		if (!st->head)
+		{
+			strand_put(strands, st);
+			pthread_mutex_unlock(&(b->lock));
+			return 0;
+		}
+		pthread_mutex_unlock(&(b->lock));
+		
+		//our own workers never wait for room, others don't wait here either
+		struct timespec now = deadline_after(0);
+		work_t job = { 0 };
+		job.routine = strand_run;
+		job.arg = st;
+		job.priority = THREADPOOL_PRIO_NORMAL;
+		job.flags = WORK_RELAY;
+		if (!submit(pool, &job, &now))
+			return 0;
+		if (pool->dropping)
+		{
+			discard_list(pool, strand_take_all(st));
+			return 0;
+		}
+	}
+}
+
+//remove the strand from the pool and return its queued jobs, for a strand that won't run
+static work_t* strand_take_all(strand *st)
+{
+	threadpool_strands *strands = st->strands;
+	strand_bucket *b = &(strands->buckets[st->bucket]);
+	pthread_mutex_lock(&(b->lock));
+	work_t *list = st->head;
+	strand_put(strands, st);
+	pthread_mutex_unlock(&(b->lock));
+	return list;
+}
+
+//take the strand out of its bucket and free it, the bucket's lock is held
+static void strand_put(threadpool_strands *strands, strand *st)
+{
+	strand **link = &(strands->buckets[st->bucket].chain);
+	while (*link != st)
+		link = &((*link)->next);
+	*link = st->next;
+	pthread_mutex_lock(&(strands->lock));
+	st->next = strands->free_list;
+	strands->free_list = st;
+	pthread_mutex_unlock(&(strands->lock));
+}
+
+//the task groups of a new pool
+static threadpool_groups* groups_create(threadpool *pool)
+{
+	threadpool_groups *groups = (threadpool_groups*)calloc(1, sizeof(threadpool_groups));
+	if (!groups)
+		return NULL;
+	if (pthread_mutex_init(&(groups->lock), NULL))
+	{
+		free(groups);
+		return NULL;
+	}
+	groups->pool = pool;
+	return groups;
+}
+
+//free the groups of a pool, their queues are empty
+static void groups_free(threadpool_groups *groups)
+{
+	int i;
+	for (i = 0; i < groups->count; i++)
+		free(groups->list[i]);
+	free(groups->list);
+	pthread_mutex_destroy(&(groups->lock));
+	free(groups);
+}
+
+/* the job of a ticket: start the job of the group whose turn it is, time
+it and charge the group for it. the job's end may let more jobs start */
+static int group_run(void *arg)
+{
+	threadpool_groups *groups = (threadpool_groups*)arg;
+	threadpool_group_t *group;
+	work_t *work = NULL;
+	long long start = threadpool_now_ns();
+	pthread_mutex_lock(&(groups->lock));
+	groups->tickets--;
+	group = group_pick_locked(groups);
+	if (group)
+	{
+		work = group_take_locked(group);
+		group->running++;
+		group->deficit -= group->cost_ns;
+#ifndef THREADPOOL_NO_STATS
+		if (work->enqueued)
+			histogram_add(&(group->queue_wait), start - work->enqueued);
+#endif
+	}
+	pthread_mutex_unlock(&(groups->lock));
+	if (!work) //another ticket took the job, or its group reached the cap meanwhile
+		return 0;
+	
+	TRACE(groups->pool, TRACE_DEQUEUE, work);
+	int result = run_work(groups->pool, work);
+	long long ran = threadpool_now_ns() - start;
+	pthread_mutex_lock(&(groups->lock));
+	group->running--;
+	if (result == THREADPOOL_DISCARDED)
+		group->discarded++;
+	else
+	{
+		group->completed++;
+		if (result < 0)
+			group->failed++;
+	}
+	//the charge becomes the real run time, the next jobs are charged the new average
+	group->deficit += group->cost_ns - ran;
+	group->cost_ns += (ran - group->cost_ns) / 8;
+#ifndef THREADPOOL_NO_STATS
+	histogram_add(&(group->run_time), ran);
+#endif
+	int add = groups_refill_locked(groups);
+	pthread_mutex_unlock(&(groups->lock));
+	slab_free(groups->pool, work);
+	groups_submit(groups, add);
+	return result;
+}
+
+//1 if the group has a job it may start
+static int group_ready(const threadpool_group_t *group)
+{
+	return group->head && (!group->max_running || group->running < group->max_running);
+}
+
+/* deficit round robin: the group whose turn it is keeps it while it has
+credit left, the next ready group then gets a quantum of weight *
+GROUP_QUANTUM_NS. the lock is held, NULL if no group is ready */
+static threadpool_group_t* group_pick_locked(threadpool_groups *groups)
+{
+	int i, visits = 0;
+	threadpool_group_t *group;
+	for (i = 0; i < groups->count && !group_ready(groups->list[i]); i++)
+		;
+	if (i == groups->count)
+		return NULL;
+	while (1)
+	{
+		group = groups->list[groups->cursor];
+		if (group_ready(group) && group->deficit > 0)
+			return group;
+		groups->cursor = (groups->cursor + 1) % groups->count;
+		group = groups->list[groups->cursor];
+		if (group_ready(group))
+			group->deficit += group->weight * (long long)GROUP_QUANTUM_NS;
+		//a whole round without credit (long jobs ran), add the rounds it takes at once
+		if (++visits > groups->count)
+		{
+			long long rounds = -1;
+			for (i = 0; i < groups->count; i++)
+			{
+				group = groups->list[i];
+				long long need = -group->deficit / (group->weight * (long long)GROUP_QUANTUM_NS) + 1;
+				if (group_ready(group) && (rounds < 0 || need < rounds))
+					rounds = need;
+			}
+			for (i = 0; i < groups->count; i++)
+				if (group_ready(groups->list[i]))
+					groups->list[i]->deficit += rounds * groups->list[i]->weight * GROUP_QUANTUM_NS;
+			visits = 0;
+		}
+	}
+}
+
+//take the group's oldest job, the lock is held. an idle group keeps no credit
+static work_t* group_take_locked(threadpool_group_t *group)
+{
+	work_t *work = group->head;
+	group->head = work->next;
+	if (!group->head)
+	{
+		group->tail = NULL;
+		if (group->deficit > 0)
+			group->deficit = 0;
+	}
+	work->next = NULL;
+	group->queued--;
+	return work;
+}
+
+/* count the tickets missing for the jobs the groups may start now, the
+caller queues them once the lock is released */
+static int groups_refill_locked(threadpool_groups *groups)
+{
+	int i;
+	long startable = 0;
+	for (i = 0; i < groups->count; i++)
+	{
+		threadpool_group_t *group = groups->list[i];
+		long slots = group->max_running? group->max_running - group->running : group->queued;
+		startable += slots < group->queued? (slots > 0? slots : 0) : group->queued;
+	}
+	if (startable <= groups->tickets)
+		return 0;
+	int add = (int)(startable - groups->tickets);
+	groups->tickets += add;
+	return add;
+}
+
+/* queue n tickets. our own workers never wait for room, a ticket the
+queue won't take (full or shutting down) runs here */
+static void groups_submit(threadpool_groups *groups, int n)
+{
+	threadpool *pool = groups->pool;
+	int own = current_worker && current_worker->pool == pool;
+	work_t job = { 0 };
+	job.routine = group_run;
+	job.arg = groups;
+	job.priority = THREADPOOL_PRIO_NORMAL;
+	job.flags = WORK_RELAY;
+	while (n-- > 0)
+	{
+		struct timespec now = deadline_after(0);
+		if (submit(pool, &job, own? &now : NULL) < 0)
+			group_run(groups);
+	}
+}
+
+//a ticket that won't run drops the job it would have started, to "dropped" or the discard handler
+static void group_drop(threadpool *pool, dropped_jobs *dropped)
+{
+	threadpool_groups *groups = pool->groups;
+	threadpool_group_t *group;
+	work_t *work = NULL;
+	pthread_mutex_lock(&(groups->lock));
+	groups->tickets--;
+	group = group_pick_locked(groups);
+	if (group)
+	{
+		work = group_take_locked(group);
+		group->discarded++;
+	}
+	pthread_mutex_unlock(&(groups->lock));
+	if (!work)
+		return;
+	if (dropped)
+		drop_job(pool, work, dropped);
+	else
+		discard_work(pool, work);
+	slab_free(pool, work);
+}
+
+//drop the jobs left in the groups' queues, the pool shuts down
+static void groups_drop(threadpool *pool, dropped_jobs *dropped)
+{
+	threadpool_groups *groups = pool->groups;
+	work_t *list = NULL, *last = NULL;
+	int i;
+	pthread_mutex_lock(&(groups->lock));
+	for (i = 0; i < groups->count; i++)
+	{
+		threadpool_group_t *group = groups->list[i];
+		if (!group->head)
+			continue;
+		if (last)
+			last->next = group->head;
+		else
+			list = group->head;
+		last = group->tail;
+		group->discarded += group->queued;
+		group->head = group->tail = NULL;
+		group->queued = 0;
+	}
+	pthread_mutex_unlock(&(groups->lock));
+	while (list)
+	{
+		work_t *next = list->next;
+		drop_job(pool, list, dropped);
+		slab_free(pool, list);
+		list = next;
+	}
+}
+
+//an empty task graph
+threadpool_graph_t* threadpool_graph_create(void)
+{
+	threadpool_graph_t *graph = (threadpool_graph_t*)aligned_alloc(CACHE_LINE, sizeof(threadpool_graph_t));
+	if (!graph)
+		return NULL;
+	graph->chunks = NULL;
+	graph->count = 0;
+	graph->checked = 1;
+	graph->pool = NULL;
+	atomic_init(&(graph->left), 0);
+	atomic_init(&(graph->failed), 0);
+	atomic_init(&(graph->state), HANDLE_DONE);
+	atomic_init(&(graph->finishing), 0);
+	return graph;
+}
+
+//add a task to the graph
+threadpool_task_t* threadpool_graph_add(threadpool_graph_t *graph, dispatch_fn routine, void *arg)
+{
+	if (!routine)
+	{
+		printf("Dispatch function not assigned correctly\n");
+		return NULL;
+	}
+	if (atomic_load(&(graph->state)) != HANDLE_DONE)
+		return NULL;
+	task_chunk *chunk = graph->chunks;
+	if (!chunk || chunk->used == GRAPH_CHUNK)
+	{
+		chunk = (task_chunk*)malloc(sizeof(task_chunk));
+		if (!chunk)
+		{
+			perror("Allocating memory for the task failed\n");
+			return NULL;
+		}
+		chunk->next = graph->chunks;
+		chunk->used = 0;
+		graph->chunks = chunk;
+	}
+	threadpool_task_t *task = &(chunk->tasks[chunk->used++]);
+	task->routine = routine;
+	task->arg = arg;
+	atomic_init(&(task->pending), 0);
+	task->deps = 0;
+	task->succ = NULL;
+	task->num_succ = 0;
+	task->succ_capacity = 0;
+	task->graph = graph;
+	graph->count++;
+	return task;
+}
+
+//make "task" wait for "before"
+int threadpool_graph_depend(threadpool_task_t *task, threadpool_task_t *before)
+{
+	threadpool_graph_t *graph = task->graph;
+	if (before->graph != graph)
+	{
+		printf("Tasks of different graphs\n");
+		return -1;
+	}
+	if (atomic_load(&(graph->state)) != HANDLE_DONE)
+		return -1;
+	if (before->num_succ == before->succ_capacity)
+	{
+		int capacity = before->succ_capacity? before->succ_capacity * 2 : GRAPH_SUCC_INITIAL;
+		threadpool_task_t **succ = (threadpool_task_t**)realloc(before->succ, capacity * sizeof(threadpool_task_t*));
+		if (!succ)
+		{
+			perror("Allocating memory for the task failed\n");
+			return -1;
+		}
+		before->succ = succ;
+		before->succ_capacity = capacity;
+	}
+	before->succ[before->num_succ++] = task;
+	task->deps++;
+	graph->checked = 0;
+	return 0;
+}
+
+//queue the tasks that wait for nothing, the rest follow as they become ready
+int threadpool_graph_run(threadpool *pool, threadpool_graph_t *graph)
+{
+	task_chunk *chunk;
+	int i, state = HANDLE_DONE;
+	//the last task of the previous run may still be waking its waiter
+	while (atomic_load(&(graph->finishing)))
+		sched_yield();
+	if (!atomic_compare_exchange_strong(&(graph->state), &state, HANDLE_PENDING))
+		return -1;
+	if (!graph->checked && !graph_acyclic(graph))
+	{
+		printf("The task graph has a cycle\n");
+		atomic_store(&(graph->state), HANDLE_DONE);
+		return -1;
+	}
+	graph->checked = 1;
+	if (!graph->count)
+	{
+		atomic_store(&(graph->state), HANDLE_DONE);
+		return 0;
+	}
+	
+	//every count is set before the first task can complete
+	graph->pool = pool;
+	atomic_store(&(graph->failed), 0);
+	atomic_store(&(graph->left), graph->count);
+	for (chunk = graph->chunks; chunk; chunk = chunk->next)
+		for (i = 0; i < chunk->used; i++)
+			atomic_store_explicit(&(chunk->tasks[i].pending), chunk->tasks[i].deps, memory_order_relaxed);
+	for (chunk = graph->chunks; chunk; chunk = chunk->next)
+		for (i = 0; i < chunk->used; i++)
+			if (!chunk->tasks[i].deps)
+				graph_queue(&(chunk->tasks[i]));
+	return 0;
+}
+
+//wait for the run of the graph, returns the number of failed tasks
+int threadpool_graph_wait(threadpool_graph_t *graph)
+{
+	int i;
+	for (i = 0; i < HANDLE_SPIN; i++)
+		if (atomic_load_explicit(&(graph->state), memory_order_acquire) == HANDLE_DONE)
+			break;
+	while (atomic_load_explicit(&(graph->state), memory_order_acquire) != HANDLE_DONE)
+	{
+		int state = HANDLE_PENDING;
+		if (!atomic_compare_exchange_strong(&(graph->state), &state, HANDLE_WAITED)
+			&& state == HANDLE_DONE)
+			break;
+		futex_wait(&(graph->state), HANDLE_WAITED);
+	}
+	//the graph may be freed once the last task stopped touching it
+	while (atomic_load(&(graph->finishing)))
+		sched_yield();
+	return atomic_load(&(graph->failed));
+}
+
+//free the graph and its tasks
+void threadpool_graph_destroy(threadpool_graph_t *graph)
+{
+	int i;
+	threadpool_graph_wait(graph);
+	while (graph->chunks)
+	{
+		task_chunk *next = graph->chunks->next;
+		for (i = 0; i < graph->chunks->used; i++)
+			free(graph->chunks->tasks[i].succ);
+		free(graph->chunks);
+		graph->chunks = next;
+	}
+	free(graph);
+}
+
+//the job of a graph task
+static int graph_task(void *arg)
+{
+	threadpool_task_t *task = (threadpool_task_t*)arg;
+	int result = task->routine(task->arg);
+	graph_task_done(task, result);
+	return result;
+}
+
+//a task completed: queue the successors it was the last predecessor of, the last task ends the run
+static void graph_task_done(threadpool_task_t *task, int result)
+{
+	threadpool_graph_t *graph = task->graph;
+	int i;
+	if (result < 0)
+		atomic_fetch_add(&(graph->failed), 1);
+	for (i = 0; i < task->num_succ; i++)
+		if (atomic_fetch_sub_explicit(&(task->succ[i]->pending), 1, memory_order_acq_rel) == 1)
+			graph_queue(task->succ[i]);
+	if (atomic_fetch_sub_explicit(&(graph->left), 1, memory_order_acq_rel) != 1)
+		return;
+	atomic_store(&(graph->finishing), 1);
+	if (atomic_exchange(&(graph->state), HANDLE_DONE) == HANDLE_WAITED)
+		futex_wake(&(graph->state), INT_MAX);
+	atomic_store_explicit(&(graph->finishing), 0, memory_order_release);
+}
+
+/* queue a ready task. a task the queue rejects runs on this thread, or is
+discarded once the pool stopped accepting jobs. the successors they release
+go on graph_ready and are handled by the same loop, so a long chain of
+rejected tasks doesn't grow the stack */
+static void graph_queue(threadpool_task_t *task)
+{
+	task->next_ready = graph_ready;
+	graph_ready = task;
+	if (graph_draining)
+		return;
+	graph_draining = 1;
+	while (graph_ready)
+	{
+		task = graph_ready;
+		graph_ready = task->next_ready;
+		threadpool *pool = task->graph->pool;
+		//the pool shuts down, the rest of the graph is dropped like its queued tasks
+		if (pool->dont_accept == DONT_ACCEPT)
+		{
+			pool->discarded++;
+			graph_task_done(task, THREADPOOL_DISCARDED);
+			continue;
+		}
+		work_t job = { 0 };
+		job.routine = graph_task;
+		job.arg = task;
+		job.priority = THREADPOOL_PRIO_NORMAL;
+		if (submit(pool, &job, NULL) < 0)
+			graph_task(task);
+	}
+	graph_draining = 0;
+}
+
+//1 if the graph has no cycle (Kahn's algorithm, "pending" is free while it doesn't run)
+static int graph_acyclic(threadpool_graph_t *graph)
+{
+	task_chunk *chunk;
+	int i, head = 0, tail = 0;
+	threadpool_task_t **ready = (threadpool_task_t**)malloc(graph->count * sizeof(threadpool_task_t*));
+	if (!ready)
+		return 0;
+	for (chunk = graph->chunks; chunk; chunk = chunk->next)
+		for (i = 0; i < chunk->used; i++)
+		{
+			threadpool_task_t *task = &(chunk->tasks[i]);
+			atomic_store_explicit(&(task->pending), task->deps, memory_order_relaxed);
+			if (!task->deps)
+				ready[tail++] = task;
+		}
+	while (head < tail)
+	{
+		threadpool_task_t *task = ready[head++];
+		for (i = 0; i < task->num_succ; i++)
+			if (atomic_fetch_sub_explicit(&(task->succ[i]->pending), 1, memory_order_relaxed) == 1)
+				ready[tail++] = task->succ[i];
+	}
+	free(ready);
+	return tail == graph->count;
+}
+
+//a new fork/join scope
+threadpool_join_t* threadpool_join_create(threadpool *pool)
+{
+	threadpool_join_t *join = (threadpool_join_t*)aligned_alloc(CACHE_LINE, sizeof(threadpool_join_t));
+	if (!join)
+		return NULL;
+	join->pool = pool;
+	atomic_init(&(join->pending), 0);
+	atomic_init(&(join->waiting), 0);
+	atomic_init(&(join->failed), 0);
+	atomic_init(&(join->refs), 1);
+	return join;
+}
+
+//queue a child job of the scope, or run it here
+int threadpool_fork(threadpool_join_t *join, dispatch_fn routine, void *arg)
+{
+	threadpool *pool = join->pool;
+	join_child child = { routine, arg, join };
+	work_t job = { 0 };
+	job.routine = join_child_run;
+	job.priority = THREADPOOL_PRIO_NORMAL;
+	job.flags = WORK_INLINE;
+	memcpy(job.payload, &child, sizeof(child));
+	//a worker blocked on a full queue may be the one that would empty it
+	struct timespec now = deadline_after(0);
+	int own = current_worker && current_worker->pool == pool;
+	atomic_fetch_add(&(join->pending), 1);
+	atomic_fetch_add_explicit(&(join->refs), 1, memory_order_relaxed);
+	if (submit(pool, &job, own? &now : NULL) < 0)
+	{
+		atomic_fetch_sub(&(join->refs), 1);
+		join_done(join, routine(arg));
+	}
+	return 0;
+}
+
+//wait for the children, running queued jobs meanwhile on a worker
+int threadpool_join(threadpool_join_t *join)
+{
+	threadpool *pool = join->pool;
+	//a fiber's stack is too small for other jobs
+	int help = current_worker && current_worker->pool == pool && !current_fiber;
+	int pending, spins = 0;
+	while ((pending = atomic_load(&(join->pending))))
+	{
+		if (help && help_run(pool))
+			continue;
+		//a job is on its way, or the children are running elsewhere and may fork more
+		if ((help && pool->qsize) || spins++ < HANDLE_SPIN)
+		{
+			sched_yield();
+			continue;
+		}
+		//the child that brings pending to 0 sees the flag, or we see the 0
+		atomic_store(&(join->waiting), 1);
+		if ((pending = atomic_load(&(join->pending))))
+			futex_wait(&(join->pending), pending);
+		atomic_store(&(join->waiting), 0);
+		spins = 0;
+	}
+	return atomic_exchange(&(join->failed), 0);
+}
+
+//give the scope up
+void threadpool_join_release(threadpool_join_t *join)
+{
+	join_put(join);
+}
+
+//the job of a child, its argument is the join_child in the job
+static int join_child_run(void *arg)
+{
+	join_child *child = (join_child*)arg;
+	threadpool_join_t *join = child->join;
+	int result = child->routine(child->arg);
+	join_done(join, result);
+	join_put(join);
+	return result;
+}
+
+//a child ended, the last one wakes the joiner
+static void join_done(threadpool_join_t *join, int result)
+{
+	if (result < 0)
+		atomic_fetch_add(&(join->failed), 1);
+	if (atomic_fetch_sub(&(join->pending), 1) == 1 && atomic_load(&(join->waiting)))
+		futex_wake(&(join->pending), INT_MAX);
+}
+
+//drop a reference to the scope, the last one frees it
+static void join_put(threadpool_join_t *join)
+{
+	if (atomic_fetch_sub_explicit(&(join->refs), 1, memory_order_acq_rel) == 1)
+		free(join);
+}
+
+//the timers of a new pool, no thread yet
+static threadpool_timers* timers_create(void)
+{
+	pthread_condattr_t attr;
+	threadpool_timers *timers = (threadpool_timers*)calloc(1, sizeof(threadpool_timers));
+	if (!timers)
+		return NULL;
+	if (pthread_mutex_init(&(timers->lock), NULL))
+	{
+		free(timers);
+		return NULL;
+	}
+	//the wakeups are ticks of the monotonic clock
+	if (pthread_condattr_init(&attr))
+	{
+		pthread_mutex_destroy(&(timers->lock));
+		free(timers);
+		return NULL;
+	}
+	pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+	if (pthread_cond_init(&(timers->changed), &attr))
+	{
+		pthread_condattr_destroy(&attr);
+		pthread_mutex_destroy(&(timers->lock));
+		free(timers);
+		return NULL;
+	}
+	pthread_condattr_destroy(&attr);
+	timers->base = threadpool_now_ns();
+	timers->wake = ULLONG_MAX;
+	return timers;
+}
+
+//stop the timer thread and drop the armed timers, before the pool stops accepting jobs
+static void timers_stop(threadpool *pool, dropped_jobs *dropped)
+{
+	threadpool_timers *timers = pool->timers;
+	work_t job = { 0 };
+	int i, level;
+	pthread_mutex_lock(&(timers->lock));
+	timers->stop = 1;
+	pthread_cond_signal(&(timers->changed));
+	pthread_mutex_unlock(&(timers->lock));
+	if (timers->started)
+		pthread_join(timers->thread, NULL);
+	
+	//the jobs of the armed timers will never be entered
+	for (i = 0; i <= WHEEL_ROOT_MASK; i++)
+		for (; timers->root[i]; timers->root[i] = timers->root[i]->next)
+		{
+			job.routine = timers->root[i]->routine;
+			job.arg = timers->root[i]->arg;
+			drop_job(pool, &job, dropped);
+		}
+	for (level = 0; level < WHEEL_LEVELS; level++)
+		for (i = 0; i <= WHEEL_MASK; i++)
+			for (; timers->levels[level][i]; timers->levels[level][i] = timers->levels[level][i]->next)
+			{
+				job.routine = timers->levels[level][i]->routine;
+				job.arg = timers->levels[level][i]->arg;
+				drop_job(pool, &job, dropped);
+			}
+}
+
+//free the timers of a pool, its thread was stopped
+static void timers_free(threadpool_timers *timers)
+{
+	int i;
+	for (i = 0; i < timers->num_chunks; i++)
+		free(timers->chunks[i]);
+	free(timers->chunks);
+	pthread_cond_destroy(&(timers->changed));
+	pthread_mutex_destroy(&(timers->lock));
+	free(timers);
+}
+
+/* arm a timer for dispatch_after/dispatch_every, "period_ms" is 0 for a
+one shot timer. returns its id or -1 */
+static long long timer_arm(threadpool *pool, long delay_ms, long period_ms, dispatch_fn routine, void *arg)
+{
+	threadpool_timers *timers = pool->timers;
+	int i;
+	if (!routine)
+	{
+		printf("Dispatch function not assigned correctly\n");
+		return -1;
+	}
+	if (delay_ms < 0)
+	{
+		printf("Illegal timer delay requested\n");
+		return -1;
+	}
+	//the tick it's due in, rounded up so it never fires early
+	unsigned long long expires = (threadpool_now_ns() - timers->base + delay_ms * 1000000LL + WHEEL_TICK_NS - 1) / WHEEL_TICK_NS;
+	
+	pthread_mutex_lock(&(timers->lock));
+	if (timers->stop || pool->dont_accept)
+	{
+		pthread_mutex_unlock(&(timers->lock));
+		return -1;
+	}
+	//a chunk of timers at a time, never an allocation per timer
+	if (!timers->free_list)
+	{
+		wheel_timer **chunks = (wheel_timer**)realloc(timers->chunks, (timers->num_chunks + 1) * sizeof(wheel_timer*));
+		wheel_timer *chunk = chunks? (wheel_timer*)calloc(TIMER_CHUNK, sizeof(wheel_timer)) : NULL;
+		if (chunks)
+			timers->chunks = chunks;
+		if (!chunk)
+		{
+			pthread_mutex_unlock(&(timers->lock));
+			perror("Allocating memory for the timer failed\n");
+			return -1;
+		}
+		for (i = TIMER_CHUNK - 1; i >= 0; i--)
+		{
+			chunk[i].index = timers->num_chunks * TIMER_CHUNK + i;
+			chunk[i].next = timers->free_list;
+			timers->free_list = &(chunk[i]);
+		}
+		timers->chunks[timers->num_chunks++] = chunk;
+	}
+	//the thread that fires them starts with the first timer
+	if (!timers->started)
+	{
+		if (pthread_create(&(timers->thread), NULL, timer_main, pool))
+		{
+			pthread_mutex_unlock(&(timers->lock));
+			perror("Timer thread initializing failed\n");
+			return -1;
+		}
+		timers->started = 1;
+	}
+	
+	wheel_timer *timer = timers->free_list;
+	timers->free_list = timer->next;
+	do //a reused timer gets a new id
+		timer->gen = atomic_fetch_add(&next_timer_gen, 1) & INT_MAX;
+	while (!timer->gen);
+	//an empty wheel skips the ticks it slept through
+	if (!timers->count && timers->tick < wheel_now(timers))
+		timers->tick = wheel_now(timers);
+	timers->count++;
+	timer->routine = routine;
+	timer->arg = arg;
+	timer->period = (unsigned long long)period_ms * 1000000ULL / WHEEL_TICK_NS;
+	timer->expires = expires;
+	timer->firing = 0;
+	wheel_insert(timers, timer);
+	//the thread sleeps past it, wake it up to sleep less
+	if (timer->expires < timers->wake)
+		pthread_cond_signal(&(timers->changed));
+	long long id = ((long long)timer->gen << 32) | timer->index;
+	pthread_mutex_unlock(&(timers->lock));
+	return id;
+}
+
+//the timer of an id, NULL if it's stale. the lock is held
+static wheel_timer* timer_lookup(threadpool_timers *timers, long long id)
+{
+	int index = (int)(id & 0xffffffff);
+	if (id < 0 || index >= timers->num_chunks * TIMER_CHUNK)
+		return NULL;
+	wheel_timer *timer = &(timers->chunks[index / TIMER_CHUNK][index % TIMER_CHUNK]);
+	return timer->gen == (unsigned int)(id >> 32)? timer : NULL;
+}
+
+//put a timer that isn't armed back on the free list, the lock is held
+static void timer_free(threadpool_timers *timers, wheel_timer *timer)
+{
+	timer->gen = 0;
+	timers->count--;
+	timer->next = timers->free_list;
+	timers->free_list = timer;
+}
+
+/* the timer thread: expire the due ticks, enter their jobs without holding
+the lock, and sleep until the next slot that has timers */
+static void* timer_main(void *p)
+{
+	threadpool *pool = (threadpool*)p;
+	threadpool_timers *timers = pool->timers;
+	wheel_timer *fired, *last, *timer;
+	pthread_mutex_lock(&(timers->lock));
+	while (!timers->stop)
+	{
+		unsigned long long now = wheel_now(timers);
+		fired = last = NULL;
+		while (timers->tick <= now)
+			wheel_advance(timers, &fired, &last);
+		if (fired)
+		{
+			pthread_mutex_unlock(&(timers->lock));
+			for (timer = fired; timer; timer = timer->fired_next)
+				dispatch(pool, timer->routine, timer->arg);
+			pthread_mutex_lock(&(timers->lock));
+			//a one shot timer, or a periodic one cancelled meanwhile
+			for (timer = fired; timer; timer = timer->fired_next)
+			{
+				timer->firing = 0;
+				if (!timer->slot)
+					timer_free(timers, timer);
+			}
+			continue;
+		}
+		
+		//nothing armed, sleep until a timer is
+		if (!timers->count)
+		{
+			pthread_cond_wait(&(timers->changed), &(timers->lock));
+			continue;
+		}
+		timers->wake = wheel_next(timers);
+		struct timespec until;
+		long long ns = timers->base + (long long)timers->wake * WHEEL_TICK_NS;
+		until.tv_sec = ns / 1000000000LL;
+		until.tv_nsec = ns % 1000000000LL;
+		pthread_cond_timedwait(&(timers->changed), &(timers->lock), &until);
+		timers->wake = ULLONG_MAX;
+	}
+	pthread_mutex_unlock(&(timers->lock));
+	return NULL;
+}
+
+//the current tick
+static unsigned long long wheel_now(threadpool_timers *timers)
+{
+	return (unsigned long long)(threadpool_now_ns() - timers->base) / WHEEL_TICK_NS;
+}
+
+/* the tick the timer thread can sleep until: the next root slot with
+timers, or the end of the root's turn, when the next level moves down */
+static unsigned long long wheel_next(threadpool_timers *timers)
+{
+	unsigned long long tick, turn_end = (timers->tick | WHEEL_ROOT_MASK) + 1;
+	for (tick = timers->tick; tick < turn_end; tick++)
+		if (timers->root[tick & WHEEL_ROOT_MASK])
+			return tick;
+	return turn_end;
+}
+
+/* expire tick "tick" and move to the next, the due timers are appended to
+the fired list. when the root starts a new turn a slot of the next level
+moves down, and so on up the levels */
+static void wheel_advance(threadpool_timers *timers, wheel_timer **fired, wheel_timer **last)
+{
+	int level, index = (int)(timers->tick & WHEEL_ROOT_MASK);
+	if (!index)
+	{
+		for (level = 0; level < WHEEL_LEVELS; level++)
+		{
+			int slot = (int)((timers->tick >> WHEEL_SHIFT(level)) & WHEEL_MASK);
+			wheel_timer *list = timers->levels[level][slot];
+			timers->levels[level][slot] = NULL;
+			while (list)
+			{
+				wheel_timer *next = list->next;
+				wheel_insert(timers, list);
+				list = next;
+			}
+			if (slot)
+				break;
+		}
+	}
+	timers->tick++;
+	
+	wheel_timer *list = timers->root[index];
+	timers->root[index] = NULL;
+	while (list)
+	{
+		wheel_timer *timer = list;
+		list = list->next;
+		timer->slot = NULL;
+		//a periodic timer is armed again right away, so it can be cancelled while it runs
+		if (timer->period)
+		{
+			timer->expires += timer->period;
+			wheel_insert(timers, timer);
+		}
+		timer->firing = 1;
+		timer->fired_next = NULL;
+		if (*last)
+			(*last)->fired_next = timer;
+		else
+			*fired = timer;
+		*last = timer;
+	}
+}
+
+/* put a timer in the slot of its expiry: the root if it's due within a
+turn of the root, else the first level whose turn reaches it. a timer past
+the last level waits in its furthest slot and is placed again from there */
+static void wheel_insert(threadpool_timers *timers, wheel_timer *timer)
+{
+	wheel_timer **slot;
+	int level;
+	if (timer->expires < timers->tick) //overdue, the next tick fires it
+		timer->expires = timers->tick;
+	unsigned long long delta = timer->expires - timers->tick;
+	if (delta <= WHEEL_ROOT_MASK)
+		slot = &(timers->root[timer->expires & WHEEL_ROOT_MASK]);
+	else
+	{
+		unsigned long long at = timer->expires;
+		for (level = 0; level < WHEEL_LEVELS - 1; level++)
+			if (delta < 1ULL << WHEEL_SHIFT(level + 1))
+				break;
+		if (delta >= 1ULL << WHEEL_SHIFT(WHEEL_LEVELS))
+			at = timers->tick + (1ULL << WHEEL_SHIFT(WHEEL_LEVELS)) - 1;
+		slot = &(timers->levels[level][(at >> WHEEL_SHIFT(level)) & WHEEL_MASK]);
+	}
+	timer->prev = NULL;
+	timer->next = *slot;
+	if (*slot)
+		(*slot)->prev = timer;
+	*slot = timer;
+	timer->slot = slot;
+}
+
+//take an armed timer out of its slot
+static void wheel_unlink(wheel_timer *timer)
+{
+	if (timer->prev)
+		timer->prev->next = timer->next;
+	else
+		*(timer->slot) = timer->next;
+	if (timer->next)
+		timer->next->prev = timer->prev;
+	timer->slot = NULL;
+}
+
+//add a job that runs on a stack of its own
+int dispatch_fiber(threadpool* from_me, dispatch_fn dispatch_to_here, void *arg)
+{
+	if (!dispatch_to_here)
+	{
+		printf("Dispatch function not assigned correctly\n");
+		return -1;
+	}
+	if (from_me->dont_accept == DONT_ACCEPT)
+		return -1;
+	fiber *f = fiber_alloc(from_me->fibers);
+	if (!f)
+	{
+		perror("Allocating memory for the fiber failed\n");
+		return -1;
+	}
+	f->routine = dispatch_to_here;
+	f->arg = arg;
+	work_t job = { 0 };
+	job.routine = fiber_run;
+	job.arg = f;
+	job.priority = THREADPOOL_PRIO_NORMAL;
+	if (submit(from_me, &job, NULL) < 0)
+	{
+		fiber_free(from_me->fibers, f);
+		return -1;
+	}
+	return 0;
+}
+
+//wait until fd is ready, a fiber suspends and gives its worker back meanwhile
+int threadpool_wait_fd(int fd, int events)
+{
+	fiber *f = current_fiber;
+	if (!(events & (THREADPOOL_WAIT_READ | THREADPOOL_WAIT_WRITE)))
+		return -EINVAL;
+	//not a fiber, the thread itself waits
+	if (!f)
+	{
+		struct pollfd p = { fd, 0, 0 };
+		int n;
+		if (events & THREADPOOL_WAIT_READ)
+			p.events |= POLLIN;
+		if (events & THREADPOOL_WAIT_WRITE)
+			p.events |= POLLOUT;
+		while ((n = poll(&p, 1, -1)) < 0 && errno == EINTR)
+			;
+		return n < 0? -errno : 0;
+	}
+	f->fd = fd;
+	f->events = events;
+	f->error = 0;
+	//fiber_run puts it on the reactor's list once we're off its stack
+	swapcontext(&(f->context), f->back);
+	//maybe another thread from here on, so the error isn't left in errno
+	return -f->error;
+}
+
+//the fibers of a new pool, no stack is allocated yet
+static threadpool_fibers* fibers_create(threadpool *pool, size_t stack_size)
+{
+	threadpool_fibers *fibers = (threadpool_fibers*)calloc(1, sizeof(threadpool_fibers));
+	if (!fibers)
+		return NULL;
+	if (pthread_mutex_init(&(fibers->lock), NULL))
+	{
+		free(fibers);
+		return NULL;
+	}
+	if (pthread_cond_init(&(fibers->idle), NULL))
+	{
+		pthread_mutex_destroy(&(fibers->lock));
+		free(fibers);
+		return NULL;
+	}
+	fibers->pool = pool;
+	fibers->guard = (size_t)sysconf(_SC_PAGESIZE);
+	if (!stack_size)
+		stack_size = FIBER_DEFAULT_STACK;
+	fibers->stack_size = (stack_size + fibers->guard - 1) / fibers->guard * fibers->guard;
+	fibers->epoll_fd = -1;
+	fibers->wake_fd = -1;
+	return fibers;
+}
+
+/* stop the reactor thread, before the pool stops accepting jobs. the
+fibers get to end first like the queued jobs: all of them, or with "drop"
+the ones that end by "deadline" (NULL for none). then the fibers it was
+waiting for resume here with ECANCELED and run to the end, from now on a
+wait fails at once */
+static void fibers_stop(threadpool *pool, int drop, const struct timespec *deadline)
+{
+	threadpool_fibers *fibers = pool->fibers;
+	unsigned long long one = 1;
+	int timed_out = 0;
+	pthread_mutex_lock(&(fibers->lock));
+	while (fibers->live && (!drop || deadline) && !timed_out)
+	{
+		if (deadline)
+			timed_out = pthread_cond_timedwait(&(fibers->idle), &(fibers->lock), deadline);
+		else
+			pthread_cond_wait(&(fibers->idle), &(fibers->lock));
+	}
+	fibers->stop = 1;
+	pthread_mutex_unlock(&(fibers->lock));
+	if (fibers->started)
+	{
+		if (write(fibers->wake_fd, &one, sizeof(one)) < 0)
+			perror("Waking the reactor failed\n");
+		pthread_join(fibers->thread, NULL);
+	}
+	
+	pthread_mutex_lock(&(fibers->lock));
+	fiber *list = fibers->waiting, *f;
+	fibers->waiting = NULL;
+	for (f = list; f; f = f->next)
+		epoll_ctl(fibers->epoll_fd, EPOLL_CTL_DEL, f->fd, NULL);
+	pthread_mutex_unlock(&(fibers->lock));
+	while (list)
+	{
+		fiber *next = list->next;
+		list->error = ECANCELED;
+		fiber_run(list);
+		list = next;
+	}
+}
+
+//free the fibers of a pool, none is left but the ones on the free list
+static void fibers_free(threadpool_fibers *fibers)
+{
+	while (fibers->free_list)
+	{
+		fiber *next = fibers->free_list->next;
+		munmap(fibers->free_list->stack, fibers->stack_size + fibers->guard);
+		free(fibers->free_list);
+		fibers->free_list = next;
+	}
+	if (fibers->epoll_fd >= 0)
+		close(fibers->epoll_fd);
+	if (fibers->wake_fd >= 0)
+		close(fibers->wake_fd);
+	pthread_cond_destroy(&(fibers->idle));
+	pthread_mutex_destroy(&(fibers->lock));
+	free(fibers);
+}
+
+/* a fiber set to start at fiber_entry, an ended one with its stack if
+there is, else a new stack. only the pages it touches are backed */
+static fiber* fiber_alloc(threadpool_fibers *fibers)
+{
+	pthread_mutex_lock(&(fibers->lock));
+	fiber *f = fibers->free_list;
+	if (f)
+	{
+		fibers->free_list = f->next;
+		fibers->num_free--;
+	}
+	fibers->live++;
+	pthread_mutex_unlock(&(fibers->lock));
+	if (!f)
+	{
+		f = (fiber*)calloc(1, sizeof(fiber));
+		if (f)
+			f->stack = mmap(NULL, fibers->stack_size + fibers->guard, PROT_READ | PROT_WRITE,
+				MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK, -1, 0);
+		if (!f || f->stack == MAP_FAILED)
+		{
+			free(f);
+			pthread_mutex_lock(&(fibers->lock));
+			if (!--fibers->live)
+				pthread_cond_broadcast(&(fibers->idle));
+			pthread_mutex_unlock(&(fibers->lock));
+			return NULL;
+		}
+		//an overflow faults on the guard page instead of writing over memory
+		mprotect(f->stack, fibers->guard, PROT_NONE);
+		f->fibers = fibers;
+	}
+	if (getcontext(&(f->context)) < 0)
+	{
+		fiber_free(fibers, f);
+		return NULL;
+	}
+	f->context.uc_stack.ss_sp = (char*)f->stack + fibers->guard;
+	f->context.uc_stack.ss_size = fibers->stack_size;
+	f->context.uc_link = NULL;
+	makecontext(&(f->context), fiber_entry, 0);
+	f->started = 0;
+	f->done = 0;
+	f->error = 0;
+	f->fd = -1;
+	return f;
+}
+
+//an ended fiber keeps its stack for the next one, up to FIBER_CACHE_MAX of them
+static void fiber_free(threadpool_fibers *fibers, fiber *f)
+{
+	pthread_mutex_lock(&(fibers->lock));
+	if (!--fibers->live)
+		pthread_cond_broadcast(&(fibers->idle));
+	if (fibers->num_free < FIBER_CACHE_MAX)
+	{
+		f->next = fibers->free_list;
+		fibers->free_list = f;
+		fibers->num_free++;
+		f = NULL;
+	}
+	pthread_mutex_unlock(&(fibers->lock));
+	if (f)
+	{
+		munmap(f->stack, fibers->stack_size + fibers->guard);
+		free(f);
+	}
+}
+
+//the bottom of a fiber's stack: runs its job and leaves for good
+static void fiber_entry(void)
+{
+	fiber *f = current_fiber;
+	f->result = f->routine(f->arg);
+	f->done = 1;
+	setcontext(f->back);
+}
+
+/* the job of a fiber: run it on this thread until it ends or suspends in
+threadpool_wait_fd, then hand its fd to the reactor. returns the result of
+its routine when it ended, 0 when it suspended */
+static int fiber_run(void *arg)
+{
+	fiber *f = (fiber*)arg;
+	threadpool_fibers *fibers = f->fibers;
+	fiber *outer = current_fiber; //a fiber's job may run a fiber inline, e.g. caller runs
+	ucontext_t back;
+	while (1)
+	{
+		f->back = &back;
+		f->started = 1;
+		current_fiber = f;
+		swapcontext(&back, &(f->context));
+		current_fiber = outer;
+		if (f->done)
+		{
+			int result = f->result;
+			fiber_free(fibers, f);
+			return result;
+		}
+		if (!fiber_watch(fibers, f))
+			return 0;
+		//the wait failed, it goes on with the error
+	}
+}
+
+/* put a fiber that suspended on the reactor's list and its fd in the epoll
+set, starting the reactor with the first one. returns 0, or 1 if it can't
+wait (f->error is the errno why) */
+static int fiber_watch(threadpool_fibers *fibers, fiber *f)
+{
+	struct epoll_event ev = { 0 };
+	pthread_mutex_lock(&(fibers->lock));
+	if (fibers->stop)
+		f->error = ECANCELED;
+	else if (!fibers->started)
+	{
+		fibers->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+		fibers->wake_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+		ev.events = EPOLLIN;
+		ev.data.ptr = NULL;
+		if (fibers->epoll_fd < 0 || fibers->wake_fd < 0
+			|| epoll_ctl(fibers->epoll_fd, EPOLL_CTL_ADD, fibers->wake_fd, &ev) < 0
+			|| (errno = pthread_create(&(fibers->thread), NULL, reactor_main, fibers)))
+		{
+			f->error = errno;
+			perror("Reactor initializing failed\n");
+			if (fibers->epoll_fd >= 0)
+				close(fibers->epoll_fd);
+			if (fibers->wake_fd >= 0)
+				close(fibers->wake_fd);
+			fibers->epoll_fd = fibers->wake_fd = -1;
+		}
+		else
+			fibers->started = 1;
+	}
+	if (!f->error)
+	{
+		//one shot, the reactor takes the fd out of the set when it fires
+		ev.events = EPOLLONESHOT;
+		if (f->events & THREADPOOL_WAIT_READ)
+			ev.events |= EPOLLIN;
+		if (f->events & THREADPOOL_WAIT_WRITE)
+			ev.events |= EPOLLOUT;
+		ev.data.ptr = f;
+		if (epoll_ctl(fibers->epoll_fd, EPOLL_CTL_ADD, f->fd, &ev) < 0)
+			f->error = errno;
+		else
+		{
+			f->prev = NULL;
+			f->next = fibers->waiting;
+			if (fibers->waiting)
+				fibers->waiting->prev = f;
+			fibers->waiting = f;
+		}
+	}
+	pthread_mutex_unlock(&(fibers->lock));
+	return f->error != 0;
+}
+
+/* a fiber's job that won't be taken by a worker: one that didn't start is
+discarded like its job, a suspended one finishes here */
+static void fiber_drop(threadpool *pool, fiber *f)
+{
+	if (f->started)
+	{
+		fiber_run(f);
+		return;
+	}
+	pool->discarded++;
+	if (pool->discard_handler)
+		pool->discard_handler(f->routine, f->arg);
+	fiber_free(pool->fibers, f);
+}
+
+/* the reactor thread: wait for the fds of the suspended fibers and queue
+every fiber whose fd is ready. a fiber the queue won't take runs here */
+static void* reactor_main(void *p)
+{
+	threadpool_fibers *fibers = (threadpool_fibers*)p;
+	struct epoll_event events[REACTOR_EVENTS];
+	fiber *ready, *f;
+	int i, n;
+	while (1)
+	{
+		n = epoll_wait(fibers->epoll_fd, events, REACTOR_EVENTS, -1);
+		if (n < 0 && errno != EINTR)
+		{
+			perror("Reactor wait failed\n");
+			return NULL;
+		}
+		ready = NULL;
+		pthread_mutex_lock(&(fibers->lock));
+		if (fibers->stop)
+		{
+			//fibers_stop takes the waiting ones
+			pthread_mutex_unlock(&(fibers->lock));
+			return NULL;
+		}
+		for (i = 0; i < n; i++)
+		{
+			f = (fiber*)events[i].data.ptr;
+			if (!f)
+				continue;
+			epoll_ctl(fibers->epoll_fd, EPOLL_CTL_DEL, f->fd, NULL);
+			if (f->prev)
+				f->prev->next = f->next;
+			else
+				fibers->waiting = f->next;
+			if (f->next)
+				f->next->prev = f->prev;
+			f->next = ready;
+			ready = f;
+		}
+		pthread_mutex_unlock(&(fibers->lock));
+		
+		while (ready)
+		{
+			f = ready;
+			ready = ready->next;
+			//the reactor never waits for room in the queue
+			struct timespec now = deadline_after(0);
+			work_t job = { 0 };
+			job.routine = fiber_run;
+			job.arg = f;
+			job.priority = THREADPOOL_PRIO_NORMAL;
+			if (submit(fibers->pool, &job, &now) < 0)
+				fiber_run(f);
+		}
+	}
+}
+
+//record the jobs of the pool from now on
+int threadpool_trace_start(threadpool *pool, int events_per_thread)
+{
+	threadpool_trace *trace = pool->trace;
+	unsigned long capacity = 1;
+	if (events_per_thread < 0)
+	{
+		printf("Illegal trace size requested\n");
+		return -1;
+	}
+	if (!events_per_thread)
+		events_per_thread = TRACE_DEFAULT_EVENTS;
+	while (capacity < (unsigned long)events_per_thread)
+		capacity <<= 1;
+	pthread_mutex_lock(&(trace->lock));
+	trace->capacity = capacity;
+	trace->clock0 = trace_clock();
+	trace->ns0 = threadpool_now_ns();
+	atomic_fetch_add(&(trace->session), 1);
+	pthread_mutex_unlock(&(trace->lock));
+	pool->tracing = 1;
+	return 0;
+}
+
+//stop recording
+void threadpool_trace_stop(threadpool *pool)
+{
+	pool->tracing = 0;
+}
+
+//write the events of the last start as Chrome trace JSON
+int threadpool_trace_dump(threadpool *pool, const char *path)
+{
+	threadpool_trace *trace = pool->trace;
+	trace_ring *ring;
+	trace_event *events = NULL;
+	unsigned long i, head, first, valid;
+	int pid = (int)getpid(), written = 0;
+	FILE *out = fopen(path, "w");
+	if (!out)
+	{
+		perror("Opening the trace file failed\n");
+		return -1;
+	}
+	fprintf(out, "{\"traceEvents\":[\n");
+	pthread_mutex_lock(&(trace->lock));
+	unsigned long session = trace->session;
+	//the cycles per microsecond, from the time since the start
+	long long elapsed = threadpool_now_ns() - trace->ns0;
+	double ticks_per_us = elapsed > 0? (double)(trace_clock() - trace->clock0) * 1000.0 / elapsed : 1000.0;
+	if (ticks_per_us <= 0)
+		ticks_per_us = 1000.0;
+	for (ring = trace->rings; ring; ring = ring->next)
+	{
+		if (atomic_load_explicit(&(ring->session), memory_order_acquire) != session)
+			continue;
+		trace_event *copy = (trace_event*)realloc(events, ring->capacity * sizeof(trace_event));
+		if (!copy)
+		{
+			perror("Allocating memory for the trace failed\n");
+			break;
+		}
+		events = copy;
+		//copy what's there, then leave out what the owner wrote over meanwhile
+		head = atomic_load_explicit(&(ring->head), memory_order_acquire);
+		first = head > ring->capacity? head - ring->capacity : 0;
+		for (i = first; i < head; i++)
+			events[i - first] = ring->events[i & (ring->capacity - 1)];
+		atomic_thread_fence(memory_order_acquire);
+		valid = atomic_load_explicit(&(ring->head), memory_order_relaxed);
+		valid = valid > ring->capacity? valid - ring->capacity : 0;
+		if (atomic_load_explicit(&(ring->session), memory_order_relaxed) != session)
+			continue;
+		
+		if (ring->worker >= 0)
+			fprintf(out, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%ld,\"args\":{\"name\":\"worker %d\"}}",
+				written? ",\n" : "", pid, ring->tid, ring->worker);
+		else
+			fprintf(out, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%ld,\"args\":{\"name\":\"thread %ld\"}}",
+				written? ",\n" : "", pid, ring->tid, ring->tid);
+		written++;
+		for (i = first > valid? first : valid; i < head; i++)
+		{
+			trace_event *e = &(events[i - first]);
+			double ts = (double)(long long)(e->clock - trace->clock0) / ticks_per_us;
+			switch (e->kind)
+			{
+				case TRACE_ENQUEUE: //and the start of the arrow to the job's slice
+					fprintf(out, ",\n{\"name\":\"dispatch\",\"cat\":\"threadpool\",\"ph\":\"i\",\"s\":\"t\",\"ts\":%.3f,\"pid\":%d,\"tid\":%ld,"
+						"\"args\":{\"job\":%lu,\"routine\":\"%p\"}}", ts, pid, ring->tid, e->job, (void*)e->routine);
+					fprintf(out, ",\n{\"name\":\"queued\",\"cat\":\"threadpool\",\"ph\":\"s\",\"id\":%lu,\"ts\":%.3f,\"pid\":%d,\"tid\":%ld}",
+						e->job, ts, pid, ring->tid);
+					break;
+				case TRACE_DEQUEUE:
+					fprintf(out, ",\n{\"name\":\"dequeue\",\"cat\":\"threadpool\",\"ph\":\"i\",\"s\":\"t\",\"ts\":%.3f,\"pid\":%d,\"tid\":%ld,"
+						"\"args\":{\"job\":%lu}}", ts, pid, ring->tid, e->job);
+					break;
+				case TRACE_START:
+					fprintf(out, ",\n{\"name\":\"%p\",\"cat\":\"job\",\"ph\":\"B\",\"ts\":%.3f,\"pid\":%d,\"tid\":%ld,\"args\":{\"job\":%lu}}",
+						(void*)e->routine, ts, pid, ring->tid, e->job);
+					if (e->job) //a job dispatched before the start has no arrow
+						fprintf(out, ",\n{\"name\":\"queued\",\"cat\":\"threadpool\",\"ph\":\"f\",\"bp\":\"e\",\"id\":%lu,\"ts\":%.3f,\"pid\":%d,\"tid\":%ld}",
+							e->job, ts, pid, ring->tid);
+					break;
+				default:
+					fprintf(out, ",\n{\"name\":\"%p\",\"cat\":\"job\",\"ph\":\"E\",\"ts\":%.3f,\"pid\":%d,\"tid\":%ld}",
+						(void*)e->routine, ts, pid, ring->tid);
+			}
+			written++;
+		}
+	}
+	pthread_mutex_unlock(&(trace->lock));
+	free(events);
+	fprintf(out, "\n],\"displayTimeUnit\":\"ns\"}\n");
+	if (fclose(out))
+	{
+		perror("Writing the trace file failed\n");
+		return -1;
+	}
+	return written;
+}
+
+//the trace of a new pool, no ring yet
+static threadpool_trace* trace_create(void)
+{
+	threadpool_trace *trace = (threadpool_trace*)calloc(1, sizeof(threadpool_trace));
+	if (!trace)
+		return NULL;
+	if (pthread_mutex_init(&(trace->lock), NULL))
+	{
+		free(trace);
+		return NULL;
+	}
+	trace->id = atomic_fetch_add(&next_trace_id, 1);
+	atomic_init(&(trace->session), 0);
+	atomic_init(&(trace->next_job), 1);
+	return trace;
+}
+
+//free the trace of a pool and the rings of its threads
+static void trace_free(threadpool_trace *trace)
+{
+	while (trace->rings)
+	{
+		trace_ring *next = trace->rings->next;
+		free(trace->rings);
+		trace->rings = next;
+	}
+	pthread_mutex_destroy(&(trace->lock));
+	free(trace);
+}
+
+#ifndef THREADPOOL_NO_TRACE
+/* add an event of "work" to the calling thread's ring, an enqueue gives the
+job its trace id. no lock but for the first event of a thread in a session */
+static void trace_record(threadpool *pool, int kind, work_t *work)
+{
+	threadpool_trace *trace = pool->trace;
+	unsigned long session = atomic_load_explicit(&(trace->session), memory_order_acquire);
+	trace_ring *ring = trace_cache.trace_id == trace->id? trace_cache.ring : NULL;
+	if (!ring || atomic_load_explicit(&(ring->session), memory_order_relaxed) != session)
+	{
+		ring = trace_ring_get(pool);
+		if (!ring)
+			return;
+		//the ring starts over for the new session
+		if (atomic_load_explicit(&(ring->session), memory_order_relaxed) != session)
+		{
+			atomic_store_explicit(&(ring->head), 0, memory_order_relaxed);
+			atomic_store_explicit(&(ring->session), session, memory_order_release);
+		}
+	}
+	if (kind == TRACE_ENQUEUE)
+		work->trace_id = atomic_fetch_add_explicit(&(trace->next_job), 1, memory_order_relaxed);
+	unsigned long head = atomic_load_explicit(&(ring->head), memory_order_relaxed);
+	trace_event *e = &(ring->events[head & (ring->capacity - 1)]);
+	e->clock = trace_clock();
+	e->job = work->trace_id;
+	e->routine = work->routine;
+	e->kind = kind;
+	atomic_store_explicit(&(ring->head), head + 1, memory_order_release);
+}
+
+/* the calling thread's ring of the pool's trace, with the capacity of the
+session. a thread gets a new one the first time or when the capacity changed */
+static trace_ring* trace_ring_get(threadpool *pool)
+{
+	threadpool_trace *trace = pool->trace;
+	long tid = syscall(SYS_gettid);
+	trace_ring *ring;
+	pthread_mutex_lock(&(trace->lock));
+	for (ring = trace->rings; ring && (ring->tid != tid || ring->capacity != trace->capacity); ring = ring->next)
+		;
+	if (!ring)
+	{
+		ring = (trace_ring*)aligned_alloc(CACHE_LINE, sizeof(trace_ring) + trace->capacity * sizeof(trace_event));
+		if (ring)
+		{
+			atomic_init(&(ring->head), 0);
+			atomic_init(&(ring->session), 0);
+			ring->capacity = trace->capacity;
+			ring->tid = tid;
+			ring->worker = current_worker && current_worker->pool == pool? current_worker->id : -1;
+			ring->next = trace->rings;
+			trace->rings = ring;
+		}
+	}
+	pthread_mutex_unlock(&(trace->lock));
+	if (!ring)
+	{
+		perror("Allocating memory for the trace failed\n");
+		return NULL;
+	}
+	trace_cache.trace_id = trace->id;
+	trace_cache.ring = ring;
+	return ring;
+}
+#endif
+
+//a timestamp of the trace: the cpu's cycle counter, or the clock where there is none
+static unsigned long long trace_clock(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	return __rdtsc();
+#elif defined(__aarch64__)
+	unsigned long long ticks;
+	__asm__ __volatile__("mrs %0, cntvct_el0" : "=r"(ticks));
+	return ticks;
+#else
+	return (unsigned long long)threadpool_now_ns();
+#endif
+}
+
+//merge the instrumentation of the workers
+int threadpool_snapshot(threadpool *pool, threadpool_snapshot_t *snap, threadpool_worker_stats_t *workers, int max_workers)
+{
+	int i, copied = 0;
+	memset(snap, 0, sizeof(threadpool_snapshot_t));
+#ifndef THREADPOOL_NO_STATS
+	snap->total.lock_wait_ns = pool->lock_wait_ns;
+	for (i = 0; i < pool->num_slots; i++)
+	{
+		worker_stats *stats = &(pool->workers[i].stats);
+		threadpool_worker_stats_t counters;
+		counters.jobs = atomic_load_explicit(&(stats->jobs), memory_order_relaxed);
+		counters.failed = atomic_load_explicit(&(stats->failed), memory_order_relaxed);
+		counters.busy_ns = atomic_load_explicit(&(stats->busy_ns), memory_order_relaxed);
+		counters.idle_ns = atomic_load_explicit(&(stats->idle_ns), memory_order_relaxed);
+		counters.lock_wait_ns = atomic_load_explicit(&(stats->lock_wait_ns), memory_order_relaxed);
+		snap->total.jobs += counters.jobs;
+		snap->total.failed += counters.failed;
+		snap->total.busy_ns += counters.busy_ns;
+		snap->total.idle_ns += counters.idle_ns;
+		snap->total.lock_wait_ns += counters.lock_wait_ns;
+		histogram_merge(&(snap->queue_wait), &(stats->queue_wait));
+		histogram_merge(&(snap->run_time), &(stats->run_time));
+		if (workers && copied < max_workers)
+			workers[copied++] = counters;
+	}
+#else
+	for (i = 0; workers && i < max_workers && i < pool->num_slots; i++)
+		memset(&(workers[copied++]), 0, sizeof(threadpool_worker_stats_t));
+#endif
+	return copied;
+}
+
+//the lowest value of a histogram bucket
+long long threadpool_histogram_value(int index)
+{
+	int sub = 1 << HIST_SUB_BITS;
+	if (index < sub)
+		return index;
+	int group = index / sub;
+	return (long long)(sub + index % sub) << (group - 1);
+}
+
+//a percentile of a histogram, the top of the bucket it falls in
+long long threadpool_histogram_percentile(const threadpool_histogram_t *hist, double percentile)
+{
+	int i;
+	long seen = 0;
+	if (!hist->count)
+		return 0;
+	long rank = (long)(percentile / 100.0 * hist->count + 0.5);
+	if (rank < 1)
+		rank = 1;
+	for (i = 0; i < THREADPOOL_HIST_BUCKETS; i++)
+	{
+		seen += hist->buckets[i];
+		if (seen >= rank)
+		{
+			long long top = i + 1 < THREADPOOL_HIST_BUCKETS? threadpool_histogram_value(i + 1) - 1 : hist->max_ns;
+			return top < hist->max_ns? top : hist->max_ns;
+		}
+	}
+	return hist->max_ns;
+}
+
+#ifndef THREADPOOL_NO_STATS
+/* add to a counter that only one worker writes. a plain load and store,
+no locked instruction, atomic only so a snapshot may read it meanwhile */
+static void stat_add(atomic_llong *counter, long long n)
+{
+	atomic_store_explicit(counter, atomic_load_explicit(counter, memory_order_relaxed) + n, memory_order_relaxed);
+}
+
+//record a duration in a worker's histogram
+static void histogram_add(histogram *hist, long long ns)
+{
+	if (ns < 0)
+		ns = 0;
+	stat_add(&(hist->count), 1);
+	stat_add(&(hist->sum_ns), ns);
+	if (ns > atomic_load_explicit(&(hist->max_ns), memory_order_relaxed))
+		atomic_store_explicit(&(hist->max_ns), ns, memory_order_relaxed);
+	stat_add(&(hist->buckets[histogram_bucket(ns)]), 1);
+}
+
+//add a worker's histogram to a snapshot
+static void histogram_merge(threadpool_histogram_t *to, histogram *from)
+{
+	int i;
+	long long max = atomic_load_explicit(&(from->max_ns), memory_order_relaxed);
+	to->count += atomic_load_explicit(&(from->count), memory_order_relaxed);
+	to->sum_ns += atomic_load_explicit(&(from->sum_ns), memory_order_relaxed);
+	if (max > to->max_ns)
+		to->max_ns = max;
+	for (i = 0; i < THREADPOOL_HIST_BUCKETS; i++)
+		to->buckets[i] += atomic_load_explicit(&(from->buckets[i]), memory_order_relaxed);
+}
+
+/* the bucket of a value: values below 2^HIST_SUB_BITS have their own, above
+that every power of two is split into 2^HIST_SUB_BITS equal buckets */
+static int histogram_bucket(long long ns)
+{
+	int sub = 1 << HIST_SUB_BITS;
+	if (ns < sub)
+		return (int)ns;
+	int msb = 63 - __builtin_clzll((unsigned long long)ns);
+	int bucket = (msb - HIST_SUB_BITS + 1) * sub + (int)((ns >> (msb - HIST_SUB_BITS)) & (sub - 1));
+	return bucket < THREADPOOL_HIST_BUCKETS? bucket : THREADPOOL_HIST_BUCKETS - 1;
+}
+#endif
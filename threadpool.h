@@ -1,4 +1,6 @@
 #include <pthread.h>
+#include <stdatomic.h>
+#include <errno.h>
 
 /**
  * threadpool.h
@@ -7,9 +9,51 @@
  * your implementation of a threadpool.
  */
 
-// maximum number of threads allowed in a pool
+// default hard cap of the threads of a pool, see threadpool_attr_t.thread_limit
 #define MAXT_IN_POOL 200
 
+// the result a handle gets when its job was discarded instead of run
+#define THREADPOOL_DISCARDED (-ECANCELED)
+
+// dispatch_on_node target: the NUMA node of the calling thread
+#define THREADPOOL_NODE_LOCAL (-1)
+
+// buckets of a threadpool_histogram_t: 8 per power of two of nanoseconds, up to about two hours
+#define THREADPOOL_HIST_BUCKETS 328
+
+// priority classes of dispatch_priority, the most urgent first
+#define THREADPOOL_PRIO_HIGH 0
+#define THREADPOOL_PRIO_NORMAL 1	//the class of dispatch
+#define THREADPOOL_PRIO_LOW 2
+#define THREADPOOL_PRIO_LEVELS 3
+
+// bytes of argument dispatch_copy keeps in the job itself
+#define THREADPOOL_INLINE_ARG 48
+
+// longest name of a task group, with the terminating 0
+#define THREADPOOL_GROUP_NAME 32
+
+// what threadpool_wait_fd waits for, may be or'ed
+#define THREADPOOL_WAIT_READ 1
+#define THREADPOOL_WAIT_WRITE 2
+
+
+//a completion handle of a job, see dispatch_with_handle
+typedef struct threadpool_handle_st threadpool_handle_t;
+
+//cancels the jobs dispatched with it, see dispatch_with_token
+typedef struct threadpool_token_st threadpool_token_t;
+
+//a graph of jobs and the order they run in, see threadpool_graph_create
+typedef struct threadpool_graph_st threadpool_graph_t;
+typedef struct threadpool_task_st threadpool_task_t;
+
+//the child jobs a job forks and joins, see threadpool_join_create
+typedef struct threadpool_join_st threadpool_join_t;
+
+//a class of jobs sharing the pool by weight, see threadpool_group_create
+typedef struct threadpool_group_st threadpool_group_t;
+
 
 /**
  * the pool holds a queue of this structure
@@ -18,23 +62,242 @@ typedef struct work_st{
       int (*routine) (void*);  //the threads process function
       void * arg;  //argument to the function
       struct work_st* next;  
+      unsigned int flags;  //bookkeeping of the pool, e.g. where the node was allocated
+      threadpool_handle_t *handle;  //gets the result of the routine, or NULL
+      int priority;  //THREADPOOL_PRIO_HIGH..THREADPOOL_PRIO_LOW
+      long long deadline;  //absolute, threadpool_now_ns clock, 0 for none
+      unsigned long seq;  //arrival order in the priority mode
+      long long enqueued;  //threadpool_now_ns when it was queued, for the stats
+      threadpool_token_t *token;  //drops the job if cancelled before it starts, or NULL
+      unsigned long trace_id;  //links the trace events of the job, 0 if it wasn't traced
+      _Alignas(16) unsigned char payload[THREADPOOL_INLINE_ARG];  //the argument of dispatch_copy
 } work_t;
 
 
+/**
+ * the scheduling modes a pool can be created with
+ */
+typedef enum {
+	THREADPOOL_SCHED_FIFO = 0,	//a single queue guarded by qlock (default)
+	THREADPOOL_SCHED_WORK_STEALING,	//a deque per worker, an injection queue and stealing
+	THREADPOOL_SCHED_RING,	//a fixed capacity lock free ring, no allocation per job
+	THREADPOOL_SCHED_PRIORITY,	//a heap per priority class, earliest deadline first
+	THREADPOOL_SCHED_SHARDED	//locked queue shards, dispatch picks the shorter of two
+} threadpool_sched_t;
+
+
+/**
+ * what dispatch does when a bounded queue is full
+ */
+typedef enum {
+	THREADPOOL_OVERFLOW_BLOCK = 0,	//wait for room (default)
+	THREADPOOL_OVERFLOW_FAIL,	//return -1 right away
+	THREADPOOL_OVERFLOW_CALLER_RUNS,	//run the job on the calling thread
+	THREADPOOL_OVERFLOW_DISCARD_OLDEST	//drop the oldest queued job to make room
+} threadpool_overflow_t;
+
+
+/**
+ * where the workers run
+ */
+typedef enum {
+	THREADPOOL_AFFINITY_NONE = 0,	//the scheduler places them (default)
+	THREADPOOL_AFFINITY_CORE,	//a cpu per physical core first, then the hyperthreads
+	THREADPOOL_AFFINITY_COMPACT,	//fill a core and then a node before moving to the next
+	THREADPOOL_AFFINITY_SCATTER	//round robin over the nodes, a core at a time
+} threadpool_affinity_t;
+
+
+/**
+ * creation options for create_threadpool_attr.
+ * call threadpool_attr_init first and then change the fields you need
+ */
+typedef struct threadpool_attr_st {
+	int num_threads;		//number of threads the pool starts with
+	int min_threads;		//elastic pool: threads never retired, 0 for num_threads
+	int max_threads;		//elastic pool: most threads spawned, 0 for num_threads
+	int thread_limit;		//hard cap of the counts above (default MAXT_IN_POOL)
+	int spawn_depth;		//spawn when this many jobs wait and no worker is idle
+	int spawn_wait_ms;		//or when jobs waited this long with no worker idle
+	int keep_alive_ms;		//retire a thread above min_threads idle this long
+	int max_blocking;		//threads standing in for workers in blocking regions, 0 for none
+	threadpool_sched_t sched;	//scheduling mode
+	int queue_capacity;		//max queued jobs, 0 for unbounded (ring: slots, 0 for 1024)
+	threadpool_overflow_t overflow;	//what dispatch does when the queue is full
+	void (*discard_handler)(int (*routine)(void*), void *arg); //cleans up dropped jobs, or NULL
+	int aging_ms;			//priority mode anti starvation, 0 turns it off
+	int discard_expired;		//1 to drop jobs whose deadline passed before they started
+	threadpool_affinity_t affinity;	//pins every worker to a cpu of "cpus"
+	const int *cpus;		//the cpus workers may run on, NULL for the process affinity
+	int num_cpus;
+	int numa;			//1 for a sub-pool per NUMA node (work stealing mode)
+	int shards;			//queues of the sharded mode, 0 for one per thread
+	size_t fiber_stack_size;	//stack bytes of a dispatch_fiber job, 0 for the default
+	int slab_chunk;			//work_t nodes the slab grows by, 0 for the default
+	int batch_size;			//jobs a FIFO worker takes per qlock acquisition (default 1)
+	int idle_spin;			//checks of an idle worker, a cpu pause apart, before it yields
+	int idle_yield;			//then sched_yield calls before it parks (0 and 0 park at once)
+	size_t stack_size;		//stack bytes of a worker thread, 0 for the default (8 MB on glibc)
+	size_t guard_size;		//guard bytes past its end, 0 for the default
+	int sched_policy;		//SCHED_* of the workers, SCHED_OTHER (0) inherits the creator's
+	int sched_priority;		//their priority under SCHED_FIFO or SCHED_RR
+	size_t scratch_size;		//bytes of each worker's scratch arena, 0 for none
+} threadpool_attr_t;
+
+
+/**
+ * counters of a pool, filled by threadpool_get_stats
+ */
+typedef struct threadpool_stats_st {
+	long slab_hits;		//work_t nodes served by the slab
+	long slab_fallbacks;	//work_t nodes that had to be calloc'ed
+	long slab_chunks;	//chunks the slab allocated so far
+	long qlock_acquisitions;	//times qlock was taken by producers and workers
+	long parks;		//times a worker went to sleep on q_not_empty
+	long rejected;		//jobs dispatch refused because the queue was full
+	long discarded;		//queued jobs dropped without running
+	long caller_runs;	//jobs that ran on the dispatching thread because the queue was full
+	long expired;		//jobs dropped because their deadline passed before they started
+	long cancelled;		//jobs dropped because their token was cancelled before they started
+	long threads;		//live threads
+	long peak_threads;	//most live threads at once
+	long spawned;		//threads an elastic pool added after creation
+	long retired;		//threads an elastic pool retired for being idle
+	long blocked;		//workers in a blocking region now
+	long nodes;		//NUMA sub-pools, 0 if the pool has none
+} threadpool_stats_t;
+
+/**
+ * a log-linear (HDR style) histogram of durations in nanoseconds. bucket i
+ * covers the values threadpool_histogram_value returns for i up to the
+ * next bucket's, every bucket is within 12.5% of its values
+ */
+typedef struct threadpool_histogram_st {
+	long count;
+	long long sum_ns;
+	long long max_ns;
+	long buckets[THREADPOOL_HIST_BUCKETS];
+} threadpool_histogram_t;
+
+/**
+ * the counters of one worker, see threadpool_snapshot
+ */
+typedef struct threadpool_worker_stats_st {
+	long jobs;		//jobs it ran
+	long failed;		//of them, routines that returned a negative value
+	long long busy_ns;	//time spent running jobs
+	long long idle_ns;	//time between its jobs: looking for work, spinning and parked
+	long long lock_wait_ns;	//time blocked on qlock
+} threadpool_worker_stats_t;
+
+/**
+ * the instrumentation of a pool merged over its workers, see threadpool_snapshot
+ */
+typedef struct threadpool_snapshot_st {
+	threadpool_worker_stats_t total;	//lock_wait_ns includes the producers
+	threadpool_histogram_t queue_wait;	//enqueue to start of the jobs
+	threadpool_histogram_t run_time;	//start to end of the jobs
+} threadpool_snapshot_t;
+
+/**
+ * the counters of a task group, see threadpool_group_stats. the histograms
+ * are empty with THREADPOOL_NO_STATS
+ */
+typedef struct threadpool_group_stats_st {
+	char name[THREADPOOL_GROUP_NAME];
+	int weight;
+	int max_running;
+	long queued;		//jobs waiting for the group's turn
+	long running;		//jobs running now
+	long dispatched;
+	long completed;
+	long failed;		//of them, routines that returned a negative value
+	long discarded;		//dropped by the destructors or the overflow policy
+	threadpool_histogram_t queue_wait;	//dispatch to start of the jobs
+	threadpool_histogram_t run_time;	//start to end of the jobs
+} threadpool_group_stats_t;
+
+//per worker state and the ring queue, defined in threadpool.c
+struct threadpool_worker_st;
+struct threadpool_ring_st;
+struct threadpool_slab_st;
+struct threadpool_handles_st;
+struct threadpool_prio_st;
+struct threadpool_numa_st;
+struct threadpool_timers_st;
+struct threadpool_strands_st;
+struct threadpool_shard_st;
+struct threadpool_groups_st;
+
+
 /**
  * The actual pool
  */
 typedef struct _threadpool_st {
- 	int num_threads;	//number of active threads
-	int qsize;	        //number in the queue
+ 	atomic_int num_threads;	//number of live threads
+	int min_threads;	//the elastic bounds, equal in a fixed size pool
+	int max_threads;	//most threads without the stand-ins for blocked workers
+	int max_blocking;	//most stand-ins
+	int num_slots;	//of the threads and workers arrays, max_threads + max_blocking
+	atomic_int blocked;	//workers in a blocking region
+	int peak_threads;	//guarded by qlock
+	int spawn_depth;	//when an elastic pool spawns a thread
+	long long spawn_wait_ns;
+	long long keep_alive_ns;	//when an idle thread retires
+	atomic_llong backlog_since;	//when jobs started waiting with no idle worker, 0 if they don't
+	atomic_long spawned;
+	atomic_long retired;
+	atomic_int qsize;	//number of queued jobs, in all the queues of the pool
+	threadpool_sched_t sched;	//the scheduling mode
+	struct threadpool_worker_st *workers;	//per worker state (work stealing mode)
+	atomic_int idle_waiters;	//number of workers parked on q_not_empty (work stealing mode)
+	atomic_int inject_size;	//jobs in the qhead/qtail injection queue (work stealing mode)
+	struct threadpool_ring_st *ring;	//the queue of the ring mode
+	struct threadpool_shard_st *shards;	//the queues of the sharded mode
+	int num_shards;
+	int queue_capacity;	//max number of queued jobs, 0 for unbounded (ring mode: slots)
+	threadpool_overflow_t overflow;	//what dispatch does when the queue is full
+	void (*discard_handler)(int (*)(void*), void*);	//called for every dropped job
+	atomic_long rejected;	//counters of the overflow policy
+	atomic_long discarded;
+	atomic_long caller_runs;
+	struct threadpool_prio_st *prio;	//the heaps of the priority mode
+	int discard_expired;	//drop jobs whose deadline passed
+	atomic_long expired;
+	atomic_long cancelled;
+	atomic_int full_waiters;	//number of producers waiting on q_not_full
+	struct threadpool_numa_st *numa;	//the NUMA sub-pools, NULL if there are none
+	int num_numa;
+	int *cpu_numa;	//the sub-pool of every cpu, -1 for none
+	struct threadpool_slab_st *slab;	//allocator of the work_t nodes (the first sub-pool's)
+	int batch_size;	//jobs a FIFO worker takes per lock acquisition
+	int idle_spin;	//the idle policy
+	int idle_yield;
+	size_t stack_size;	//the thread attributes every worker starts with
+	size_t guard_size;
+	int sched_policy;
+	int sched_priority;
+	size_t scratch_size;	//of the arena of every worker
+	long qlock_acquisitions;	//guarded by qlock
+	long parks;	//guarded by qlock
+	atomic_llong lock_wait_ns;	//time producers outside the pool were blocked on qlock
+	struct threadpool_handles_st *handles;	//preallocated completion handles
+	struct threadpool_timers_st *timers;	//the timer wheel of dispatch_after
+	struct threadpool_strands_st *strands;	//the keys of dispatch_keyed with queued jobs
+	struct threadpool_groups_st *groups;	//the task groups and their queues
+	struct threadpool_fibers_st *fibers;	//the stacks of dispatch_fiber and the reactor resuming them
+	atomic_int tracing;	//1 while threadpool_trace_start records job events
+	struct threadpool_trace_st *trace;	//the event rings of the threads that used the pool
 	pthread_t *threads;	//pointer to threads
 	work_t* qhead;		//queue head pointer
 	work_t* qtail;		//queue tail pointer
 	pthread_mutex_t qlock;		//lock on the queue list
 	pthread_cond_t q_not_empty;	//non empty and empty condidtion vairiables
 	pthread_cond_t q_empty;
-      int shutdown;            //1 if the pool is in distruction process     
-      int dont_accept;       //1 if destroy function has begun
+	pthread_cond_t q_not_full;	//signaled when a job leaves a full queue
+      atomic_int shutdown;            //1 if the pool is in distruction process     
+      atomic_int dont_accept;       //1 if destroy function has begun
+	atomic_int dropping;	//1 once a destructor drops the queued jobs instead of running them
 } threadpool;
 
 
@@ -46,6 +309,17 @@ typedef struct _threadpool_st {
 
 typedef int (*dispatch_fn)(void *);
 
+// the body of threadpool_parallel_for, runs the indices begin..end-1.
+// returns a negative value on failure, like a dispatch_fn
+typedef int (*threadpool_range_fn)(long begin, long end, void *ctx);
+
+// the body of threadpool_parallel_reduce, folds the indices begin..end-1
+// into the accumulator "acc"
+typedef int (*threadpool_fold_fn)(long begin, long end, void *acc, void *ctx);
+
+// merges the accumulator "from" into "into"
+typedef void (*threadpool_combine_fn)(void *into, const void *from, void *ctx);
+
 /**
  * create_threadpool creates a fixed-sized thread
  * pool.  If the function succeeds, it returns a (non-NULL)
@@ -58,6 +332,123 @@ typedef int (*dispatch_fn)(void *);
  */
 threadpool* create_threadpool(int num_threads_in_pool);
 
+/**
+ * threadpool_attr_init fills "attr" with the defaults used by
+ * create_threadpool: one thread and the FIFO scheduling mode.
+ */
+void threadpool_attr_init(threadpool_attr_t *attr);
+
+/**
+ * create_threadpool_attr creates a pool with the options in "attr".
+ * the pool starts attr->num_threads threads. when attr->max_threads is above
+ * attr->min_threads it is elastic: a dispatch that finds no idle worker spawns
+ * a thread if attr->spawn_depth jobs are queued or jobs waited
+ * attr->spawn_wait_ms, and a thread idle for attr->keep_alive_ms retires
+ * while more than min_threads are alive. all the counts are capped by
+ * attr->thread_limit.
+ * attr->max_blocking extra threads may stand in for workers in blocking
+ * regions, see threadpool_blocking_begin.
+ * with THREADPOOL_SCHED_WORK_STEALING every worker owns a deque (Chase-Lev),
+ * jobs dispatched from outside the pool land in the injection queue (qhead/qtail),
+ * jobs dispatched by a worker are pushed to its own deque, and idle workers steal
+ * from their peers. THREADPOOL_SCHED_RING stores the jobs by value in a
+ * fixed ring of attr->queue_capacity slots (rounded up to a power of two)
+ * allocated here; dispatch and do_work use it without taking qlock.
+ * in the other modes a non zero attr->queue_capacity bounds the queue.
+ * when a bounded queue is full dispatch follows attr->overflow: it blocks,
+ * fails, runs the job on the calling thread, or drops the oldest queued job
+ * (attr->discard_handler gets its routine and arg, e.g. to close a socket).
+ * a worker of the pool never blocks on its own queue, it runs the job itself.
+ * THREADPOOL_SCHED_PRIORITY keeps a heap per priority class guarded by qlock,
+ * see dispatch_priority.
+ * THREADPOOL_SCHED_SHARDED splits the queue into attr->shards queues, each
+ * with its own lock on its own cache line: dispatch puts a job on the
+ * shorter of two shards picked at random, and a worker takes jobs from its
+ * home shard (up to attr->batch_size at a time) and looks at the others
+ * when it's empty.
+ * attr->affinity pins every worker to one of attr->cpus, read from sysfs
+ * with its core and NUMA node. attr->numa groups the workers of the work
+ * stealing mode into a sub-pool per node: each has its own injection queue
+ * and a slab in the node's memory, and workers steal from their own node
+ * before the others. workers of a sub-pool without a cpu of their own are
+ * pinned to the cpus of its node.
+ * a worker that runs out of jobs follows the idle policy: it checks for work
+ * attr->idle_spin times with a cpu pause, then attr->idle_yield times with
+ * sched_yield, and only then parks on q_not_empty. producers signal only
+ * when a worker is parked.
+ * every worker thread starts with attr->stack_size and attr->guard_size
+ * bytes (a small stack lets a pool run many more threads), and with
+ * attr->sched_policy and attr->sched_priority if the policy isn't
+ * SCHED_OTHER. the real time policies need CAP_SYS_NICE, the pool fails to
+ * start without it.
+ * dispatch and destroy_threadpool keep the same semantics in every mode.
+ * returns NULL on failure, like create_threadpool.
+ */
+threadpool* create_threadpool_attr(const threadpool_attr_t *attr);
+
+
+/**
+ * threadpool_get_stats copies the counters of the pool into "stats".
+ * the work_t nodes come from a slab owned by the pool: every worker keeps a
+ * cache of nodes, threads outside the pool have a per thread cache too, nodes
+ * freed on another thread go back through a lock free stack, and the slab
+ * grows by attr->slab_chunk nodes at a time. calloc is only used when it
+ * can't grow, slab_fallbacks counts those.
+ */
+void threadpool_get_stats(threadpool *pool, threadpool_stats_t *stats);
+
+
+/**
+ * threadpool_snapshot merges the instrumentation of the workers into
+ * "snap" and, if "workers" isn't NULL, copies the counters of up to
+ * max_workers worker slots into it. returns the number of slots copied.
+ * every worker keeps its counters and histograms on its own cache lines and
+ * only it writes them, a snapshot reads them on demand without stopping it.
+ * the cost is a clock read at dispatch and two per job, plus one when qlock
+ * is contended. compiling with THREADPOOL_NO_STATS removes all of it, the
+ * snapshot is then all zeros.
+ */
+int threadpool_snapshot(threadpool *pool, threadpool_snapshot_t *snap, threadpool_worker_stats_t *workers, int max_workers);
+
+/**
+ * threadpool_trace_start records the life of every job from now on: the
+ * dispatch, the worker taking it out of the queue, its start and end. each
+ * thread writes into a ring of its own (events_per_thread events, 0 for the
+ * default, rounded up to a power of two) with no lock, timestamps are cpu
+ * cycle counter reads; a full ring overwrites its oldest events. starting
+ * again throws the events of the last start away. returns 0, or -1.
+ * while tracing is off the cost is a load per event site, compiling with
+ * THREADPOOL_NO_TRACE removes it.
+ */
+int threadpool_trace_start(threadpool *pool, int events_per_thread);
+
+/**
+ * threadpool_trace_stop stops recording, the events are kept for a dump
+ */
+void threadpool_trace_stop(threadpool *pool);
+
+/**
+ * threadpool_trace_dump writes the recorded events to "path" in the Chrome
+ * trace event JSON format (chrome://tracing, ui.perfetto.dev): a slice per
+ * job on the thread that ran it, named by the address of its routine, and
+ * an arrow from its dispatch to its start. it may be called while tracing,
+ * events overwritten meanwhile are left out. returns the number of events
+ * written, or -1 if the file can't be written.
+ */
+int threadpool_trace_dump(threadpool *pool, const char *path);
+
+/**
+ * threadpool_histogram_value is the lowest value bucket "index" holds
+ */
+long long threadpool_histogram_value(int index);
+
+/**
+ * threadpool_histogram_percentile returns the value below which
+ * "percentile" percent (0 to 100) of the recorded values are, at the
+ * precision of the buckets. 0 for an empty histogram
+ */
+long long threadpool_histogram_percentile(const threadpool_histogram_t *hist, double percentile);
+
 
 /**
  * dispatch enter a "job" of type work_t into the queue.
@@ -68,18 +459,367 @@ threadpool* create_threadpool(int num_threads_in_pool);
  * 2. lock the mutex
  * 3. add the work_t element to the queue
  * 4. unlock mutex
- *
+ * returns 0 if the job was queued (or ran on the calling thread because the
+ * queue was full), -1 if it was rejected.
+ */
+int dispatch(threadpool* from_me, dispatch_fn dispatch_to_here, void *arg);
+
+/**
+ * dispatch_copy enters a job like dispatch whose argument is a copy of the
+ * "size" bytes at "arg" (up to THREADPOOL_INLINE_ARG), kept in the work_t
+ * itself: a small payload such as a socket needs no malloc by the caller
+ * and no free by the job. the routine gets a pointer to the copy, valid
+ * until it returns (the discard handler too). returns like dispatch, -1 if
+ * size is too big.
+ */
+int dispatch_copy(threadpool* from_me, dispatch_fn dispatch_to_here, const void *arg, size_t size);
+
+/**
+ * try_dispatch is dispatch that waits at most timeout_ms for room in a
+ * full bounded queue, whatever the overflow policy is, and then gives up.
+ * returns 0 if the job was queued, -1 if it wasn't.
+ */
+int try_dispatch(threadpool* from_me, dispatch_fn dispatch_to_here, void *arg, long timeout_ms);
+
+/**
+ * threadpool_blocking_begin tells the pool the job calling it is about to
+ * block (disk, network, a lock held elsewhere) and threadpool_blocking_end
+ * that it's back. while a worker is in the region the pool may run up to
+ * attr->max_blocking extra threads: one is spawned at once if jobs are
+ * queued and no worker is idle, later dispatches do the same, so the
+ * workers running jobs stay close to the pool's size. once the region ends,
+ * the first idle threads above it retire without waiting for keep_alive.
+ * regions nest. both calls do nothing outside a worker of the pool or on a
+ * fiber (a fiber gives its thread up instead of blocking).
+ */
+void threadpool_blocking_begin(void);
+void threadpool_blocking_end(void);
+
+/**
+ * dispatch_blocking enters a job that runs as a whole in a blocking region.
+ * returns like dispatch.
+ */
+int dispatch_blocking(threadpool* from_me, dispatch_fn dispatch_to_here, void *arg);
+
+/**
+ * threadpool_scratch lends the running job "size" bytes of its worker's
+ * scratch arena (attr->scratch_size bytes, allocated by the worker on first
+ * use), aligned for any type. the memory isn't zeroed and is taken back when
+ * the job returns, so the next job reuses it instead of a fresh buffer on
+ * its stack or the heap. a job may borrow several times; jobs run by a
+ * joining worker borrow past it and give theirs back first.
+ * returns NULL if the arena is full, outside a worker of a pool, or on a
+ * fiber (it may move to another worker while suspended).
+ */
+void* threadpool_scratch(size_t size);
+
+/**
+ * dispatch_priority enters a job with a priority class (THREADPOOL_PRIO_*)
+ * and an optional absolute deadline on the threadpool_now_ns clock (0 for
+ * none). in the priority mode workers take the most urgent class first and
+ * the earliest deadline within it (jobs without a deadline after those with
+ * one, in arrival order). a less urgent class that waited attr->aging_ms per
+ * class it's behind is served first, so no class starves. with
+ * attr->discard_expired a job whose deadline passed before it started is
+ * dropped like a discarded job, in every mode; the other modes ignore the
+ * priority. returns like dispatch.
+ */
+int dispatch_priority(threadpool* from_me, dispatch_fn dispatch_to_here, void *arg, int priority, long long deadline_ns);
+
+/**
+ * dispatch_on_node is dispatch that queues the job on NUMA sub-pool "node"
+ * (0 to stats.nodes - 1), or on the one of the calling thread's cpu with
+ * THREADPOOL_NODE_LOCAL, so the job's data stays in that node's memory.
+ * plain dispatch from outside the pool spreads the jobs over the sub-pools
+ * and a worker's dispatch stays on its node. pools without sub-pools ignore
+ * the node.
+ */
+int dispatch_on_node(threadpool* from_me, int node, dispatch_fn dispatch_to_here, void *arg);
+
+/**
+ * threadpool_now_ns returns the monotonic clock of the deadlines in nanoseconds.
+ */
+long long threadpool_now_ns(void);
+
+/**
+ * dispatch_after enters the job "delay_ms" milliseconds from now and
+ * returns the id of its timer for threadpool_timer_cancel, or -1.
+ * the timers of a pool live in a hierarchical timer wheel with 1 ms slots
+ * (up to about 49 days ahead), so arming and cancelling is O(1) and takes
+ * no allocation per timer. a single thread of the pool, started with the
+ * first timer, sleeps until the next due slot and queues the due jobs like
+ * dispatch from outside the pool. timers still armed when the pool is
+ * destroyed are dropped (attr->discard_handler gets them).
+ */
+long long dispatch_after(threadpool* from_me, long delay_ms, dispatch_fn dispatch_to_here, void *arg);
+
+/**
+ * dispatch_every is dispatch_after that enters the job again every
+ * "period_ms" milliseconds after the first time, until it's cancelled.
+ * the runs don't wait for each other, a slow job may overlap its next run.
+ */
+long long dispatch_every(threadpool* from_me, long delay_ms, long period_ms, dispatch_fn dispatch_to_here, void *arg);
+
+/**
+ * threadpool_timer_cancel disarms the timer "timer" of the pool. returns 0
+ * if its job won't be entered again (a run already due may still start),
+ * -1 if a one shot timer already fired or the id is stale.
+ */
+int threadpool_timer_cancel(threadpool* pool, long long timer);
+
+/**
+ * dispatch_keyed enters a job on the strand of "key" (a client, a file...):
+ * the jobs of a key run one at a time in the order they were entered, on
+ * any worker, while the jobs of other keys run in parallel. a key with
+ * queued jobs has a single job in the pool's queue that runs a few of them
+ * and queues itself again, so no worker ever blocks on a busy key and a key
+ * costs no thread (only a small entry while it has jobs). returns like
+ * dispatch. only the key's own job counts against queue_capacity, so the
+ * bound and the overflow policy apply to the first job of an idle key; the
+ * jobs that join a key with queued jobs wait on its strand, which has no
+ * bound. when a destructor drops the queued jobs, a key whose job is
+ * running finishes the jobs it started and gives the rest to
+ * attr->discard_handler.
+ */
+int dispatch_keyed(threadpool* from_me, unsigned long key, dispatch_fn dispatch_to_here, void *arg);
+
+/**
+ * threadpool_group_create returns the task group "name" of the pool, made
+ * with "weight" (at least 1) and "max_running" (the most jobs of the group
+ * running at once, 0 for no cap). an existing group of that name gets the
+ * new weight and cap. NULL if there's no memory. groups live as long as the
+ * pool.
+ */
+threadpool_group_t* threadpool_group_create(threadpool *pool, const char *name, int weight, int max_running);
+
+/**
+ * dispatch_group enters a job on the queue of "group". the groups share the
+ * workers by deficit round robin over run time: in every round a group may
+ * start jobs worth weight * 100 us of run time (charged by a moving average
+ * of its jobs, corrected when each one ends), so a flood of long jobs in one
+ * group doesn't starve the short jobs of another, and a group at its cap is
+ * skipped. the pool's queue holds a ticket per job that may start, the
+ * worker running a ticket picks the job then. returns like dispatch.
+ */
+int dispatch_group(threadpool_group_t *group, dispatch_fn dispatch_to_here, void *arg);
+
+/**
+ * threadpool_group_stats copies the counters of "group" into "stats"
+ */
+void threadpool_group_stats(threadpool_group_t *group, threadpool_group_stats_t *stats);
+
+/**
+ * dispatch_batch enters n jobs, dispatch_to_here[i] with args[i], at once.
+ * the work_t chain is built outside the lock and linked into the queue under
+ * a single qlock acquisition, and only min(n, idle) workers are woken.
+ * in the work stealing mode a worker pushes the chain to its own deque, in the
+ * ring mode every job takes its own slot. returns the number of jobs queued.
+ */
+int dispatch_batch(threadpool* from_me, dispatch_fn *dispatch_to_here, void **args, int n);
+
+/**
+ * dispatch_with_handle enters a job like dispatch and returns a handle
+ * the caller uses to collect the value the routine returns, or NULL if the
+ * job wasn't queued. handles come from a preallocated free list of the pool,
+ * waiting sleeps on a futex in the handle itself (no mutex per wait) and the
+ * worker only pays for a wakeup when somebody actually waits.
+ * every handle must be given back with threadpool_handle_release, before the
+ * pool is destroyed.
+ */
+threadpool_handle_t* dispatch_with_handle(threadpool* from_me, dispatch_fn dispatch_to_here, void *arg);
+
+/**
+ * threadpool_wait blocks until the job of "handle" ran and returns the value
+ * its routine returned.
+ */
+int threadpool_wait(threadpool_handle_t *handle);
+
+/**
+ * threadpool_try_get returns 1 and stores the routine's value in *result if
+ * the job already ran, 0 otherwise. it never blocks.
+ */
+int threadpool_try_get(threadpool_handle_t *handle, int *result);
+
+/**
+ * threadpool_wait_all waits for the n jobs of "handles" and returns how
+ * many of their routines returned a negative value.
+ */
+int threadpool_wait_all(threadpool_handle_t **handles, int n);
+
+/**
+ * threadpool_wait_any waits until at least one of the n jobs of "handles"
+ * ran and returns its index. all the handles must belong to the same pool.
+ */
+int threadpool_wait_any(threadpool_handle_t **handles, int n);
+
+/**
+ * threadpool_handle_release gives the handle back to the pool, it can't be
+ * used afterwards. a handle may be released before its job ran.
+ */
+void threadpool_handle_release(threadpool_handle_t *handle);
+
+/**
+ * threadpool_parallel_for runs fn over the index range begin..end-1 split
+ * in chunks, on the workers and on the calling thread, and returns when all
+ * of it ran. the participants claim chunks from a shared cursor: half their
+ * share of what's left at first, down to "grain" indices near the end, so a
+ * busy worker takes less and a free one keeps claiming (grain < 1 means 1).
+ * up to a helper job per worker is queued (none if the queue is full or the
+ * pool shuts down, the caller then runs it all); a helper that starts after
+ * the range ran out returns at once, so the caller never waits for a queued
+ * job. it may be called from a job of the same pool.
+ * returns 0, or -1 if fn returned a negative value for a chunk.
+ */
+int threadpool_parallel_for(threadpool *pool, long begin, long end, long grain, threadpool_range_fn fn, void *ctx);
+
+/**
+ * threadpool_parallel_reduce is threadpool_parallel_for with a result.
+ * "result" points at "size" bytes holding the identity of combine. every
+ * participant starts an accumulator of its own from it, folds its chunks
+ * into it with fn, and at the end the caller merges the accumulators into
+ * *result with combine, which must be associative and commutative (the
+ * order of the chunks isn't fixed). returns like threadpool_parallel_for.
+ */
+int threadpool_parallel_reduce(threadpool *pool, long begin, long end, long grain, threadpool_fold_fn fn,
+	threadpool_combine_fn combine, void *result, size_t size, void *ctx);
+
+/**
+ * threadpool_graph_create returns an empty task graph, or NULL if there's
+ * no memory. a graph isn't tied to a pool: it's built once with
+ * threadpool_graph_add and threadpool_graph_depend and then run as many
+ * times as needed, on any pool, without allocating its tasks again.
+ */
+threadpool_graph_t* threadpool_graph_create(void);
+
+/**
+ * threadpool_graph_add adds a task that calls "routine" with "arg" and
+ * returns it, or NULL if there's no memory or the graph is running.
+ */
+threadpool_task_t* threadpool_graph_add(threadpool_graph_t *graph, dispatch_fn routine, void *arg);
+
+/**
+ * threadpool_graph_depend makes "task" wait for "before" to complete, both
+ * of the same graph. returns 0, or -1 if the graph is running or there's no
+ * memory.
+ */
+int threadpool_graph_depend(threadpool_task_t *task, threadpool_task_t *before);
+
+/**
+ * threadpool_graph_run queues the tasks of the graph that wait for nothing
+ * and returns. every task counts the predecessors it still waits for, the
+ * one that completes the last of them queues it (a task the queue rejects
+ * runs on that thread). a discarded task counts as failed and still
+ * releases the tasks after it. once the pool is being destroyed, the tasks
+ * that become ready are discarded too. returns 0, or -1 if the graph has
+ * a cycle (checked when the graph changed) or is already running.
+ */
+int threadpool_graph_run(threadpool *pool, threadpool_graph_t *graph);
+
+/**
+ * threadpool_graph_wait blocks until every task of the last run completed
+ * and returns how many of their routines returned a negative value (or
+ * were discarded). the graph can then be changed or run again.
+ */
+int threadpool_graph_wait(threadpool_graph_t *graph);
+
+/**
+ * threadpool_graph_destroy waits for a run in progress and frees the graph
+ * and its tasks.
+ */
+void threadpool_graph_destroy(threadpool_graph_t *graph);
+
+/**
+ * threadpool_join_create returns a fork/join scope of "pool", or NULL if
+ * there's no memory. a job (or any thread) forks child jobs into it and
+ * joins them; the scope can fork and join again afterwards.
+ */
+threadpool_join_t* threadpool_join_create(threadpool *pool);
+
+/**
+ * threadpool_fork queues a child job of the scope. a worker never waits for
+ * room in a full queue, the child runs on its thread instead, and so does a
+ * child the queue rejects. returns 0.
+ */
+int threadpool_fork(threadpool_join_t *join, dispatch_fn routine, void *arg);
+
+/**
+ * threadpool_join waits until every child forked so far ran and returns how
+ * many of them returned a negative value (or were discarded). a worker of
+ * the pool doesn't block meanwhile, it runs queued jobs - in the work
+ * stealing mode its own deque first, where its newest children are - so
+ * nested fork/join never holds the workers and deadlocks the pool. it only
+ * sleeps when nothing is queued, while its last children run elsewhere.
+ */
+int threadpool_join(threadpool_join_t *join);
+
+/**
+ * threadpool_join_release gives the scope up after its last join, queued
+ * children still holding it free it when they end.
+ */
+void threadpool_join_release(threadpool_join_t *join);
+
+/**
+ * threadpool_token_create returns a cancel token, or NULL if there's no
+ * memory. the jobs dispatched with the token (see dispatch_with_token) can
+ * be cancelled together, and a running job can poll the token to stop early.
+ */
+threadpool_token_t* threadpool_token_create(void);
+
+/**
+ * threadpool_token_cancel cancels the jobs of the token: the ones that didn't
+ * start yet are dropped like discarded jobs when a worker takes them (their
+ * handles get THREADPOOL_DISCARDED, attr->discard_handler gets them), and
+ * threadpool_token_cancelled tells the running ones. it can't be undone.
+ */
+void threadpool_token_cancel(threadpool_token_t *token);
+
+/**
+ * threadpool_token_cancelled returns 1 if the token was cancelled, 0 if not.
+ */
+int threadpool_token_cancelled(threadpool_token_t *token);
+
+/**
+ * threadpool_token_release gives the token up. the queued jobs of the token
+ * keep it alive until they ran or were dropped.
+ */
+void threadpool_token_release(threadpool_token_t *token);
+
+/**
+ * dispatch_with_token enters a job like dispatch that "token" can cancel.
+ */
+int dispatch_with_token(threadpool* from_me, threadpool_token_t *token, dispatch_fn dispatch_to_here, void *arg);
+
+/**
+ * dispatch_fiber enters a job that runs on a stack of its own (a fiber,
+ * attr->fiber_stack_size bytes) instead of the worker's. the job can
+ * suspend in threadpool_wait_fd until a socket is ready, and the worker
+ * goes on with other jobs meanwhile: a few workers serve any number of
+ * fibers blocked on slow clients. a fiber may resume on another worker, so
+ * it must not keep thread local state (errno too) across a wait.
+ * returns 0, or -1 like dispatch (or if there's no memory for the stack).
+ */
+int dispatch_fiber(threadpool* from_me, dispatch_fn dispatch_to_here, void *arg);
+
+/**
+ * threadpool_wait_fd waits until "fd" is ready for "events"
+ * (THREADPOOL_WAIT_READ/THREADPOOL_WAIT_WRITE). in a fiber it suspends the
+ * fiber, the pool's reactor thread (an epoll loop started with the first
+ * wait) queues it again when fd is ready; one fiber at a time may wait for
+ * an fd. on any other thread it blocks in poll. returns 0 when fd is ready
+ * (or has an error or hung up, the next read/write tells), or a negative
+ * errno value, -ECANCELED if the pool is being destroyed (not errno itself,
+ * the fiber may be on another thread by then).
  */
-void dispatch(threadpool* from_me, dispatch_fn dispatch_to_here, void *arg);
+int threadpool_wait_fd(int fd, int events);
 
 /**
  * The work function of the thread
  * this function should:
  * 1. lock mutex
  * 2. if the queue is empty, wait
- * 3. take the first element from the queue (work_t)
+ * 3. take the first elements from the queue (work_t), up to batch_size of them
  * 4. unlock mutex
- * 5. call the thread routine
+ * 5. call the thread routines
  *
  */
 void* do_work(void* p);
@@ -89,7 +829,28 @@ void* do_work(void* p);
  * destroy_threadpool kills the threadpool, causing
  * all threads in it to commit suicide, and then
  * frees all the memory associated with the threadpool.
+ * it waits for the fibers to end too, like for the queued jobs.
  */
 void destroy_threadpool(threadpool* destroyme);
 
+/**
+ * destroy_threadpool_now destroys the pool without running its queued jobs.
+ * the running jobs finish, timers and the queued jobs are dropped: if
+ * "pending" isn't NULL it gets a malloc'ed array of the dropped jobs, the
+ * oldest first (the caller frees it, e.g. after closing the sockets in their args; the arg
+ * of a dispatch_copy job points at its payload in the array), else
+ * attr->discard_handler gets every job. handles of dropped jobs get
+ * THREADPOOL_DISCARDED. returns the number of jobs in *pending, or of the
+ * dropped jobs if "pending" is NULL.
+ */
+int destroy_threadpool_now(threadpool* destroyme, work_t **pending);
+
+/**
+ * destroy_threadpool_drain lets the workers run the queued jobs for up to
+ * timeout_ms and then destroys the pool like destroy_threadpool_now.
+ * fibers still suspended in threadpool_wait_fd by then (right away for
+ * destroy_threadpool_now) resume with -ECANCELED and run to the end.
+ */
+int destroy_threadpool_drain(threadpool* destroyme, long timeout_ms, work_t **pending);
+
 